@@ -1,4 +1,4 @@
-CXXFLAGS="${CXXFLAGS} -DMSCOMP_API_EXPORT -DMSCOMP_WITHOUT_LZX -O3 -march=native -mtune=generic -Wall -fno-exceptions -fno-rtti -fomit-frame-pointer"
+CXXFLAGS="${CXXFLAGS} -DMSCOMP_API_EXPORT -DMSCOMP_WITHOUT_LZX -O3 -mtune=generic -Wall -fno-exceptions -fno-rtti -fomit-frame-pointer -pthread"
 FILES="src/*.cpp"
 OUT="MSCompression"
 
@@ -48,8 +48,10 @@ EXTERN_C_START
 
 MSCOMPAPI MSCompStatus lznt1_compress(const_bytes in, size_t in_len, bytes out, size_t* out_len);
 MSCOMPAPI size_t lznt1_max_compressed_size(size_t in_len);
+MSCOMPAPI MSCompStatus lznt1_compress_cached(const_bytes in, size_t in_len, bytes out, size_t* out_len, mscomp_chunk_cache* cache);
 
 MSCOMPAPI MSCompStatus lznt1_decompress(const_bytes in, size_t in_len, bytes out, size_t* out_len);
+MSCOMPAPI MSCompStatus lznt1_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* out_len);
 
 
 MSCOMPAPI MSCompStatus lznt1_deflate_init(mscomp_stream* stream);
@@ -58,6 +58,21 @@ EXTERN_C_START
 // MSCOMP_ERRNO (-1), MSCOMP_ARG_ERROR (-2), MSCOMP_MEM_ERROR (-4), or MSCOMP_BUF_ERROR (-5)).
 MSCOMPAPI MSCompStatus ms_compress(MSCompFormat format, const_bytes in, size_t in_len, bytes out, size_t* out_len);
 
+///// MSCompStatus ms_compress_level(       /////
+/////        MSCompFormat format,           /////
+/////        unsigned level,                /////
+/////        const_bytes in, size_t in_len, /////
+/////        bytes out, size_t* out_len)    /////
+//
+// Compress like ms_compress with the given compression level, which trades speed for compression
+// ratio. The output is always in the same format and decompresses with ms_decompress.
+//
+// <level> is from MSCOMP_LEVEL_FASTEST (1) to MSCOMP_LEVEL_MAX (8), or MSCOMP_LEVEL_DEFAULT (0) for
+// the level used by ms_compress (3). Higher levels look at more possible matches and keep looking
+// for longer ones. Only MSCOMP_XPRESS (3) and MSCOMP_XPRESS_HUFF (4) have levels, the other formats
+// check the level and then ignore it. An invalid level gives MSCOMP_ARG_ERROR.
+MSCOMPAPI MSCompStatus ms_compress_level(MSCompFormat format, unsigned level, const_bytes in, size_t in_len, bytes out, size_t* out_len);
+
 ///////////////////////// Decompression ///////////////////////////////////////
 ///// MSCompStatus ms_decompress(           /////
 /////        MSCompFormat format,           /////
@@ -87,6 +102,19 @@ MSCOMPAPI MSCompStatus ms_compress(MSCompFormat format, const_bytes in, size_t i
 // or MSCOMP_BUF_ERROR (-5)).
 MSCOMPAPI MSCompStatus ms_decompress(MSCompFormat format, const_bytes in, size_t in_len, bytes out, size_t* out_len);
 
+///// MSCompStatus ms_decompress_padded(    /////
+/////        MSCompFormat format,           /////
+/////        const_bytes in, size_t in_len, /////
+/////        bytes out, size_t* out_len)    /////
+//
+// Decompress exactly like ms_decompress except that the caller guarantees that the
+// MSCOMP_DECOMPRESS_PADDING bytes after the end of the output buffer can be written. This lets the
+// decompressor stay in its fast loop until the end of the output, which is most noticeable when
+// decompressing many small buffers. The padding may be overwritten with garbage and the
+// decompressed size is still limited to the original value of <out_len>. The input needs no
+// padding. Formats without a fast path for padded output are decompressed like ms_decompress.
+MSCOMPAPI MSCompStatus ms_decompress_padded(MSCompFormat format, const_bytes in, size_t in_len, bytes out, size_t* out_len);
+
 ///////////////////////// Max Compressed Size /////////////////////////////////
 ///// size_t ms_max_compressed_size(MSCompFormat format, size_t in_len) /////
 //
@@ -98,6 +126,47 @@ MSCOMPAPI MSCompStatus ms_decompress(MSCompFormat format, const_bytes in, size_t
 // The return value is some value >=in_len.
 MSCOMPAPI size_t ms_max_compressed_size(MSCompFormat format, size_t in_len);
 
+///////////////////////// Chunk Cache /////////////////////////////////////////
+///// mscomp_chunk_cache* ms_chunk_cache_create(size_t max_size) /////
+//
+// Create a cache of compressed chunks for data that has many identical chunks, such as disk images,
+// hibernation files, and backups. When a chunk is compressed with the cache and the same chunk was
+// compressed before, its compressed data is copied instead of being compressed again. For Xpress
+// Huffman the data before the chunk that it can refer to must also be the same. A cache can be
+// used with many calls to ms_compress_cached and with both LZNT1 and Xpress Huffman, but only by
+// one thread at a time.
+//
+// <max_size> is the most bytes of memory used for the cached chunks. Each one uses about the size
+// of the chunk and its compressed data (4 KiB for LZNT1 and 64 KiB for Xpress Huffman). When full,
+// the chunks that have not been used recently are removed.
+//
+// The return value is the new cache or NULL if there is not enough memory.
+MSCOMPAPI mscomp_chunk_cache* ms_chunk_cache_create(size_t max_size);
+
+///// void ms_chunk_cache_free(mscomp_chunk_cache* cache) /////
+//
+// Free a cache created with ms_chunk_cache_create.
+MSCOMPAPI void ms_chunk_cache_free(mscomp_chunk_cache* cache);
+
+///// void ms_chunk_cache_stats(const mscomp_chunk_cache* cache, uint64_t* hits, uint64_t* misses) /////
+//
+// Get the number of chunks that were found in the cache and the number that were not found (and
+// were compressed) since it was created. Either pointer may be NULL.
+MSCOMPAPI void ms_chunk_cache_stats(const mscomp_chunk_cache* cache, uint64_t* hits, uint64_t* misses);
+
+///// MSCompStatus ms_compress_cached(        /////
+/////        MSCompFormat format,             /////
+/////        const_bytes in, size_t in_len,   /////
+/////        bytes out, size_t* out_len,      /////
+/////        mscomp_chunk_cache* cache)       /////
+//
+// Compress like ms_compress using and adding to the chunk cache. The output decompresses to the
+// same data but may be slightly different than from ms_compress since cached Xpress Huffman chunks
+// never have matches that continue into the next chunk.
+//
+// <format> is one of MSCOMP_LZNT1 (2) or MSCOMP_XPRESS_HUFF (4), others give MSCOMP_ARG_ERROR.
+MSCOMPAPI MSCompStatus ms_compress_cached(MSCompFormat format, const_bytes in, size_t in_len, bytes out, size_t* out_len, mscomp_chunk_cache* cache);
+
 ///////////////////////// Deflate [Compress] - Streaming //////////////////////
 ///// MSCompStatus ms_deflate_init(MSCompFormat format, mscomp_stream* stream) /////
 //
@@ -113,6 +182,12 @@ MSCOMPAPI size_t ms_max_compressed_size(MSCompFormat format, size_t in_len);
 // MSCOMP_ERRNO (-1), MSCOMP_ARG_ERROR (-2), or MSCOMP_MEM_ERROR (-4)).
 MSCOMPAPI MSCompStatus ms_deflate_init(MSCompFormat format, mscomp_stream* stream);
 
+///// MSCompStatus ms_deflate_init_level(MSCompFormat format, unsigned level, mscomp_stream* stream) /////
+//
+// Initialize a stream like ms_deflate_init with the given compression level (see
+// ms_compress_level). The Xpress compressor does not support levels when streaming and ignores it.
+MSCOMPAPI MSCompStatus ms_deflate_init_level(MSCompFormat format, unsigned level, mscomp_stream* stream);
+
 ///// MSCompStatus ms_deflate(mscomp_stream* stream, MSCompFlush flush) /////
 //
 // Deflate as much as possible from a stream's input to its output.
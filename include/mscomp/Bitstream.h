@@ -21,7 +21,7 @@
 // These are designed for speed and perform few checks. The burden of checking is on the caller.
 // See the functions for assumptions they make that should be checked by the caller (asserts check
 // these in the functions as well). Note that this->bits is >= 16 unless near the very end of the
-// stream.
+// stream. InputBitstream64 is a drop-in replacement for InputBitstream that reads more at a time.
 
 #ifndef MSCOMP_BITSTREAM_H
 #define MSCOMP_BITSTREAM_H
@@ -39,13 +39,23 @@ private:
 	uint32_t mask;		// The next bits to be read/written in the bitstream
 	uint_fast8_t bits;	// The number of bits in mask that are valid
 public:
+	// The most bits that can be peeked or read at once
+	static const uint_fast8_t PeekBitsMax = 16;
+
 	// Create an input bitstream
 	//   Assumption: in != NULL && in_end - in >= 4
 	INLINE InputBitstream(const_bytes in, const const_bytes in_end) : in(in+4), in_end(in_end), mask((GET_UINT16(in) << 16) | GET_UINT16(in+2)), bits(32) { assert(in); assert(in_end - in >= 4); }
+	// Resume an input bitstream that was saved with RawStream, Mask, and AvailableBits (possibly with more data after in_end)
+	//   Assumption: in != NULL && in <= in_end && bits <= 32
+	INLINE InputBitstream(const_bytes in, const const_bytes in_end, uint32_t mask, uint_fast8_t bits) : in(in), in_end(in_end), mask(mask), bits(bits) { assert(in); assert(in <= in_end); assert(bits <= 32); }
 	
 	///// Basic Properties /////
 	FORCE_INLINE const_bytes RawStream() { return this->in; }
+	// Get the position just past the last byte read into the pre-read bits, which is the same as RawStream for this bitstream
+	FORCE_INLINE const_bytes LoadedStream() { return this->in; }
 	FORCE_INLINE uint_fast8_t AvailableBits() const { return this->bits; }
+	// Get the pre-read bits, aligned to the most-significant bit
+	FORCE_INLINE uint32_t Mask() const { return this->mask; }
 	// Get the remaining number of raw bytes (disregards pre-read bits)
 	FORCE_INLINE size_t RemainingRawBytes() const { return this->in_end - this->in; }
 
@@ -57,6 +67,21 @@ public:
 	// If there are 0 pre-read bits, returns true
 	FORCE_INLINE bool MaskIsZero() const { return this->bits == 0 || (this->mask>>(32-this->bits)) == 0; }
 	
+	///// Refilling Functions /////
+	// The skipping functions always refill so these are only needed when switching between
+	// bitstream types in generic code (see InputBitstream64) or when a resumed bitstream was saved
+	// before the data it needed to refill was available
+	FORCE_INLINE void Refill()
+	{
+		if (this->bits < 16 && this->in + 2 <= this->in_end)
+		{
+			this->mask |= GET_UINT16(this->in) << (16 - this->bits);
+			this->bits |= 0x10; //this->bits += 16;
+			this->in += 2;
+		}
+	}
+	FORCE_INLINE void Refill_Fast() { }
+
 	///// Skipping Functions /////
 	// Skip the next n bits of the stream
 	//   Assumption: n <= 16 && n <= this->bits
@@ -107,14 +132,162 @@ public:
 };
 
 
+////////// 64-bit Input Bitstream /////////////////////////////////////////////
+// The same as InputBitstream except that it has a 64-bit buffer which is refilled with 32 bits at a
+// time by a single unaligned read. The fast functions never refill, instead Refill_Fast needs to be
+// called before reading at most 32 bits (e.g. a Huffman symbol along with the offset bits after it).
+//
+// The bits are still read in 16-bit units but more units are read ahead of time than the 32-bit
+// bitstream would. Those always read exactly enough units to keep at least 16 bits pre-read, which
+// defines where the raw bytes are. The extra units are detected using the number of pre-read bits:
+// the 32-bit bitstream would have 16-31 bits once any bits have been read (or less if it is at the
+// end of the stream) so anything more is an extra unit. The raw reading functions discard the extra
+// units before reading since they are actually raw bytes. The RawStream, RemainingRawBytes and
+// MaskIsZero functions are also based on the position of the 32-bit bitstream, however they can
+// only be used once at least one bit has been read.
+class InputBitstream64
+{
+private:
+	const_bytes in;		// The end of the bytes read into mask
+	const const_bytes in_end;
+	uint64_t mask;		// The next bits to be read in the bitstream, aligned to the most-significant bit
+	uint_fast8_t bits;	// The number of bits in mask that are valid
+
+	// Get the number of bits that InputBitstream would have pre-read
+	FORCE_INLINE uint_fast8_t LogicalBits() const { return this->bits < 16 ? this->bits : (0x10 | (this->bits & 0xF)); }
+	// Discard the pre-read bits that InputBitstream would not have read yet
+	FORCE_INLINE void Discard()
+	{
+		const uint_fast8_t n = this->LogicalBits();
+		this->in -= (this->bits - n) >> 3;
+		this->mask = n ? (this->mask & (~(uint64_t)0 << (64 - n))) : 0;
+		this->bits = n;
+	}
+	// Read the next two 16-bit units as a 32-bit value with the first in the most-significant bits
+	FORCE_INLINE static uint32_t GetUnits(const_bytes in) { const uint32_t x = GET_UINT32(in); return (x << 16) | (x >> 16); }
+
+public:
+	// The most bits that can be peeked or read at once
+	static const uint_fast8_t PeekBitsMax = 32;
+
+	// Create an input bitstream
+	//   Assumption: in != NULL && in_end - in >= 4
+	INLINE InputBitstream64(const_bytes in, const const_bytes in_end) : in(in+4), in_end(in_end), mask((uint64_t)GetUnits(in) << 32), bits(32) { assert(in); assert(in_end - in >= 4); }
+	
+	///// Basic Properties /////
+	FORCE_INLINE const_bytes RawStream() { return this->in - ((this->bits - this->LogicalBits()) >> 3); }
+	// Get the position just past the last byte read into the pre-read bits
+	FORCE_INLINE const_bytes LoadedStream() { return this->in; }
+	FORCE_INLINE uint_fast8_t AvailableBits() const { return this->bits; }
+	// Get the remaining number of raw bytes (disregards pre-read bits)
+	FORCE_INLINE size_t RemainingRawBytes() { return this->in_end - this->RawStream(); }
+
+	///// Peeking Functions /////
+	// Peek at the next n bits of the stream
+	//   Assumption: n <= 32 && n <= this->bits
+	FORCE_INLINE uint32_t Peek(const uint_fast8_t n) const { ASSERT_ALWAYS(n <= 32); assert(n <= this->bits); return (uint32_t)((this->mask >> 32) >> (32 - n)); }
+	// Check if all pre-read bits that InputBitstream would have are 0
+	// If there are 0 pre-read bits, returns true
+	FORCE_INLINE bool MaskIsZero() const { const uint_fast8_t n = this->LogicalBits(); return n == 0 || (this->mask >> (64 - n)) == 0; }
+
+	///// Refilling Functions /////
+	// Make sure there are at least 32 bits pre-read, or as many as are left in the stream
+	INLINE void Refill()
+	{
+		if (this->bits < 32)
+		{
+			if (this->in + 4 <= this->in_end)
+			{
+				this->mask |= (uint64_t)GetUnits(this->in) << (32 - this->bits);
+				this->bits += 32;
+				this->in += 4;
+			}
+			else if (this->in + 2 <= this->in_end)
+			{
+				this->mask |= (uint64_t)GET_UINT16(this->in) << (48 - this->bits);
+				this->bits += 16;
+				this->in += 2;
+			}
+		}
+	}
+	// Make sure there are at least 32 bits pre-read without bounds checks
+	//   Assumption: this->in + 4 <= this->in_end
+	FORCE_INLINE void Refill_Fast()
+	{
+		if (this->bits < 32)
+		{
+			this->mask |= (uint64_t)GetUnits(this->in) << (32 - this->bits);
+			this->bits += 32;
+			this->in += 4;
+		}
+	}
+
+	///// Skipping Functions /////
+	// Skip the next n bits of the stream then refill
+	//   Assumption: n <= 32 && n <= this->bits
+	INLINE void Skip(const uint_fast8_t n)
+	{
+		ASSERT_ALWAYS(n <= 32); ASSERT_ALWAYS(n <= this->bits);
+		this->mask <<= n;
+		this->bits -= n;
+		this->Refill();
+	}
+	// Skip the next n bits of the stream without refilling
+	//   Assumption: n <= 32 && n <= this->bits
+	FORCE_INLINE void Skip_Fast(const uint_fast8_t n)
+	{
+		ASSERT_ALWAYS(n <= 32); assert(n <= this->bits);
+		this->mask <<= n;
+		this->bits -= n;
+	}
+	
+	///// Reading Functions /////
+	// Read the next n bits of the stream, where n <= 32 (essentially Peek(n); Skip(n))
+	//   Assumption: n <= 32 && n <= this->bits
+	FORCE_INLINE uint32_t ReadBits(const uint_fast8_t n) { const uint32_t x = this->Peek(n); this->Skip(n); return x; }
+	
+	///// Fast Reading Functions /////
+	// Read the next n bits of the stream without refilling (essentially Peek(n); Skip_Fast(n))
+	//   Assumption: n <= 32 && n <= this->bits
+	FORCE_INLINE uint32_t ReadBits_Fast(const uint_fast8_t n) { const uint32_t x = this->Peek(n); this->Skip_Fast(n); return x; }
+	
+	///// Raw Reading Functions /////
+	// Get the next integer from the underlying stream, not the pre-read bits.
+	// These assume that this->RemainingRawBytes() >= sizeof(type)
+	FORCE_INLINE byte     ReadRawByte()   { this->Discard(); assert(this->in + 1 <= this->in_end); return *this->in++; }
+	FORCE_INLINE uint16_t ReadRawUInt16() { this->Discard(); assert(this->in + 2 <= this->in_end); const uint16_t x = GET_UINT16(this->in); this->in += 2; return x; }
+	FORCE_INLINE uint32_t ReadRawUInt32() { this->Discard(); assert(this->in + 4 <= this->in_end); const uint32_t x = GET_UINT32(this->in); this->in += 4; return x; }
+};
+
+
 ////////// Output Bitstream ///////////////////////////////////////////////////
+// Bits are collected in a 64-bit mask and only written once more than 48 are waiting, so several
+// symbols are written per flush. The uint16s are still placed where the reader expects them: the
+// reader has always loaded the next two uint16s so the raw data goes after them. Each time 16 more
+// bits are written a uint16 is reserved at the raw position, but while there is no raw data the
+// reserved uint16s are consecutive so reserving them can wait until the raw data is written.
 class OutputBitstream
 {
 private:
 	bytes out;
-	uint16_t* pntr[2];	// the uint16's to write the data in mask to when there are enough bits
-	uint32_t mask;		// The next bits to be read/written in the bitstream
+	uint16_t* pntr[2];	// the uint16's to write the first 32 bits in mask to
+	uint64_t mask;		// The next bits to be written in the bitstream, aligned to the most-significant bit
 	uint_fast8_t bits;	// The number of bits in mask that are valid
+
+	// Writes all complete uint16s in mask except the last 1-16 bits
+	FORCE_INLINE void Flush()
+	{
+		while (this->bits > 16)
+		{
+			SET_UINT16(this->pntr[0], (uint16_t)(this->mask >> 48));
+			this->mask <<= 16;
+			this->bits -= 16;
+			this->pntr[0] = this->pntr[1];
+			this->pntr[1] = (uint16_t*)(this->out);
+			this->out += 2;
+		}
+	}
+
 public:
 	INLINE OutputBitstream(bytes out) : out(out+4), mask(0), bits(0)
 	{
@@ -122,27 +295,31 @@ public:
 		this->pntr[0] = (uint16_t*)(out);
 		this->pntr[1] = (uint16_t*)(out+2);
 	}
-	FORCE_INLINE bytes RawStream() { return this->out; }
-	INLINE void WriteBits(uint32_t b, uint_fast8_t n)
+	FORCE_INLINE bytes RawStream() { this->Flush(); return this->out; }
+	FORCE_INLINE void WriteBits(uint32_t b, uint_fast8_t n)
 	{
 		assert(n <= 16);
-		this->mask |= b << (32 - (this->bits += n));
-		if (this->bits > 16)
+		this->mask |= (uint64_t)b << (64 - (this->bits += n));
+		if (this->bits > 48)
 		{
-			SET_UINT16(this->pntr[0], this->mask >> 16);
-			this->mask <<= 16;
-			this->bits &= 0xF; //this->bits -= 16;
-			this->pntr[0] = this->pntr[1];
-			this->pntr[1] = (uint16_t*)(this->out);
-			this->out += 2;
+			// Same as Flush when there are 49-64 bits: 3 uint16s are written and 2 more reserved
+			SET_UINT16(this->pntr[0], (uint16_t)(this->mask >> 48));
+			SET_UINT16(this->pntr[1], (uint16_t)(this->mask >> 32));
+			SET_UINT16(this->out,     (uint16_t)(this->mask >> 16));
+			this->mask <<= 48;
+			this->bits -= 48;
+			this->pntr[0] = (uint16_t*)(this->out + 2);
+			this->pntr[1] = (uint16_t*)(this->out + 4);
+			this->out += 6;
 		}
 	}
-	FORCE_INLINE void WriteRawByte(byte x)       { *this->out++ = x; }
-	FORCE_INLINE void WriteRawUInt16(uint16_t x) { SET_UINT16(this->out, x); this->out += 2; }
-	FORCE_INLINE void WriteRawUInt32(uint32_t x) { SET_UINT32(this->out, x); this->out += 4; }
+	FORCE_INLINE void WriteRawByte(byte x)       { this->Flush(); *this->out++ = x; }
+	FORCE_INLINE void WriteRawUInt16(uint16_t x) { this->Flush(); SET_UINT16(this->out, x); this->out += 2; }
+	FORCE_INLINE void WriteRawUInt32(uint32_t x) { this->Flush(); SET_UINT32(this->out, x); this->out += 4; }
 	FORCE_INLINE void Finish()
 	{
-		SET_UINT16(this->pntr[0], this->mask >> 16); // if !bits then mask is 0 anyways
+		this->Flush();
+		SET_UINT16(this->pntr[0], (uint16_t)(this->mask >> 48)); // if !bits then mask is 0 anyways
 		SET_UINT16_RAW(this->pntr[1], 0);
 	}
 };
@@ -0,0 +1,195 @@
+// ms-compress: implements Microsoft compression algorithms
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/////////////////// Chunk Cache ////////////////////////////////////////////////
+// Keeps the compressed data of recently compressed chunks so that a chunk that is seen again is
+// copied instead of compressed again. Disk images, hibernation files, and backups have many
+// identical chunks, especially ones that are all zeros.
+//
+// Entries are found with a hash of the chunk along with the data before it that its matches can
+// refer to. The chunk and the part of the data before it that its matches actually refer to are kept
+// and compared, so a hash collision cannot give compressed data that decompresses differently.
+//
+// The total size of the entries is limited. When full, entries are evicted with the CLOCK
+// algorithm: the entries are in a ring and are marked when used, the hand goes around the ring
+// clearing the marks until it reaches an entry that has not been used since it last passed.
+
+#ifndef MSCOMP_CHUNK_CACHE_H
+#define MSCOMP_CHUNK_CACHE_H
+#include "internal.h"
+
+// The kinds of chunks, since the compressed data of a chunk also depends on the format and where
+// the chunk is
+#define CHUNK_CACHE_LZNT1				1
+#define CHUNK_CACHE_XPRESS_HUFF			2
+#define CHUNK_CACHE_XPRESS_HUFF_END		3 // the last chunk, which has the end of stream symbol
+
+#define CHUNK_CACHE_MIN_BUCKETS		0x10
+#define CHUNK_CACHE_MAX_BUCKETS		0x100000
+#define CHUNK_CACHE_BYTES_PER_BUCKET	0x1000
+
+// The hash is similar to xxHash64, going through 4 independent lanes of 8 bytes at a time
+#define CHUNK_HASH_PRIME1	0x9E3779B185EBCA87ull
+#define CHUNK_HASH_PRIME2	0xC2B2AE3D27D4EB4Full
+#define CHUNK_HASH_PRIME3	0x165667B19E3779F9ull
+#define CHUNK_HASH_ROTL(x, n)	(((x) << (n)) | ((x) >> (64 - (n))))
+#define CHUNK_HASH_GET(x)		((uint64_t)GET_UINT32_RAW(x) | ((uint64_t)GET_UINT32_RAW((x)+4) << 32))
+
+struct _mscomp_chunk_cache
+{
+private:
+	struct Entry
+	{ // followed by the data before the chunk that it refers to, the raw chunk, and then the compressed data
+		Entry* next; // the next entry in the same bucket
+		Entry* ring; // the next entry in the clock ring
+		uint64_t key;
+		uint32_t kind, prev_len, raw_len, comp_len;
+		bool used;
+		INLINE bytes Prev() { return (bytes)(this + 1); }
+		INLINE bytes Raw() { return this->Prev() + this->prev_len; }
+		INLINE bytes Comp() { return this->Raw() + this->raw_len; }
+		INLINE size_t Size() const { return sizeof(Entry) + this->prev_len + this->raw_len + this->comp_len; }
+	};
+
+	Entry** buckets;
+	size_t bucket_mask;
+	Entry* hand; // the next entry to be considered for eviction
+	Entry* prev; // the entry before the hand, new entries go between them
+	size_t size, max_size;
+	uint64_t hits, misses;
+
+	FORCE_INLINE static uint64_t HashRound(const uint64_t h, const uint64_t v) { const uint64_t x = h + v * CHUNK_HASH_PRIME2; return CHUNK_HASH_ROTL(x, 31) * CHUNK_HASH_PRIME1; }
+
+	INLINE void Evict()
+	{
+		// Removes the entry at the hand and moves the hand to the next entry
+		Entry* e = this->hand;
+		Entry** p = &this->buckets[e->key & this->bucket_mask];
+		while (*p != e) { p = &(*p)->next; }
+		*p = e->next;
+		if (e == this->prev) { this->hand = this->prev = NULL; } // the only entry
+		else { this->hand = this->prev->ring = e->ring; }
+		this->size -= e->Size();
+		free(e);
+	}
+
+public:
+	INLINE bool Init(const size_t max_size)
+	{
+		size_t n = CHUNK_CACHE_MIN_BUCKETS;
+		while (n < CHUNK_CACHE_MAX_BUCKETS && n * CHUNK_CACHE_BYTES_PER_BUCKET < max_size) { n <<= 1; }
+		this->buckets = (Entry**)calloc(n, sizeof(Entry*));
+		this->bucket_mask = n - 1;
+		this->hand = this->prev = NULL;
+		this->size = 0;
+		this->max_size = max_size;
+		this->hits = this->misses = 0;
+		return this->buckets != NULL;
+	}
+	INLINE void Destroy()
+	{
+		while (this->hand) { this->Evict(); }
+		free(this->buckets);
+	}
+
+	INLINE void Stats(uint64_t* hits, uint64_t* misses) const
+	{
+		if (hits)   { *hits   = this->hits;   }
+		if (misses) { *misses = this->misses; }
+	}
+
+	// Gets the key of a chunk, data includes any data before the chunk that it depends on
+	static uint64_t Hash(const uint32_t kind, const_bytes data, const size_t len)
+	{
+		uint64_t h;
+		const const_bytes end = data + len;
+		if (len >= 32)
+		{
+			uint64_t a = kind + CHUNK_HASH_PRIME1 + CHUNK_HASH_PRIME2, b = kind + CHUNK_HASH_PRIME2, c = kind, d = kind - CHUNK_HASH_PRIME1;
+			for (const const_bytes end32 = end - 31; data < end32; data += 32)
+			{
+				a = HashRound(a, CHUNK_HASH_GET(data));
+				b = HashRound(b, CHUNK_HASH_GET(data+8));
+				c = HashRound(c, CHUNK_HASH_GET(data+16));
+				d = HashRound(d, CHUNK_HASH_GET(data+24));
+			}
+			h = CHUNK_HASH_ROTL(a, 1) + CHUNK_HASH_ROTL(b, 7) + CHUNK_HASH_ROTL(c, 12) + CHUNK_HASH_ROTL(d, 18);
+			h = (h ^ HashRound(0, a)) * CHUNK_HASH_PRIME1;
+			h = (h ^ HashRound(0, b)) * CHUNK_HASH_PRIME1;
+			h = (h ^ HashRound(0, c)) * CHUNK_HASH_PRIME1;
+			h = (h ^ HashRound(0, d)) * CHUNK_HASH_PRIME1;
+		}
+		else { h = kind + CHUNK_HASH_PRIME3; }
+		h += len;
+		for (; data + 8 <= end; data += 8) { h ^= HashRound(0, CHUNK_HASH_GET(data)); h = CHUNK_HASH_ROTL(h, 27) * CHUNK_HASH_PRIME1; }
+		for (; data < end; ++data) { h ^= *data * CHUNK_HASH_PRIME3; h = CHUNK_HASH_ROTL(h, 11) * CHUNK_HASH_PRIME1; }
+		h ^= h >> 33; h *= CHUNK_HASH_PRIME2;
+		h ^= h >> 29; h *= CHUNK_HASH_PRIME3;
+		return h ^ (h >> 32);
+	}
+
+	// Finds the compressed data of a chunk, counting it as a hit or miss, there are prev_avail bytes of
+	// data before the chunk
+	INLINE const_bytes Find(const uint32_t kind, const uint64_t key, const_bytes raw, const size_t raw_len, const size_t prev_avail, size_t* comp_len)
+	{
+		for (Entry* e = this->buckets[key & this->bucket_mask]; e; e = e->next)
+		{
+			if (e->key == key && e->kind == kind && e->raw_len == raw_len && e->prev_len <= prev_avail &&
+				memcmp(e->Prev(), raw - e->prev_len, e->prev_len + raw_len) == 0)
+			{
+				++this->hits;
+				e->used = true;
+				*comp_len = e->comp_len;
+				return e->Comp();
+			}
+		}
+		++this->misses;
+		return NULL;
+	}
+
+	// Adds the compressed data of a chunk that was not found, evicting entries to make room for it,
+	// if there is not enough memory it is simply not added. The matches of the chunk refer to at most
+	// prev_len bytes before it.
+	INLINE void Add(const uint32_t kind, const uint64_t key, const_bytes raw, const size_t raw_len, const size_t prev_len, const_bytes comp, const size_t comp_len)
+	{
+		const size_t size = sizeof(Entry) + prev_len + raw_len + comp_len;
+		if (size > this->max_size) { return; }
+		while (this->size + size > this->max_size)
+		{
+			while (this->hand->used) { this->hand->used = false; this->prev = this->hand; this->hand = this->hand->ring; }
+			this->Evict();
+		}
+		Entry* e = (Entry*)malloc(size);
+		if (UNLIKELY(e == NULL)) { return; }
+		e->key = key;
+		e->kind = kind;
+		e->prev_len = (uint32_t)prev_len;
+		e->raw_len = (uint32_t)raw_len;
+		e->comp_len = (uint32_t)comp_len;
+		e->used = false;
+		memcpy(e->Prev(), raw - prev_len, prev_len + raw_len);
+		memcpy(e->Comp(), comp, comp_len);
+		Entry** bucket = &this->buckets[key & this->bucket_mask];
+		e->next = *bucket;
+		*bucket = e;
+		if (this->hand) { e->ring = this->hand; this->prev->ring = e; this->prev = e; }
+		else { this->hand = this->prev = e->ring = e; }
+		this->size += size;
+	}
+};
+
+#endif
@@ -14,104 +14,234 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 
-// Adapted from 7-zip. See http://www.7-zip.org/.
-
+// The decoder uses a two-level lookup table. The root table is indexed by the first NumTableBits
+// bits of the code. Codes that are no longer than that are resolved directly by the root entry. For
+// longer codes the root entry links to a sub-table indexed by the remaining bits, which is only as
+// large as the longest code with that prefix requires. Every symbol is decoded with at most two
+// dependent table loads.
+//
+// Each entry is a uint32 holding the number of bits in the low 8 bits and the symbol in bits 15-30.
+// Bits 9-14 hold the number of bits plus the number of extra bits that directly follow the code of
+// the symbol in the bitstream, as given by ExtraBits::Get(symbol), so that a symbol and its extra
+// bits can be read at once. Link entries have the LINK flag set, hold the sub-table offset in place
+// of the symbol and the shift for the sub-table index in place of the number of bits. Unused codes
+// (the code is incomplete) are set to an entry with INVALID_SYMBOL and 0 bits.
+//
+// If NumLiterals is not 0 then the symbols below it are literals and root entries whose code is a
+// literal followed by another complete literal code within the root bits decode both at once. These
+// entries have the TWO_LITERALS flag set (bit 31), hold both literals in bits 15-30 (the first in
+// the lower byte), the total number of bits in the low 8 bits, and the number of bits of the first
+// literal in bits 9-14. DecodeSymbolsFast and LookupFast use them, the other functions only use the
+// first literal.
+//
+// The decoding functions work with either InputBitstream or InputBitstream64. The fast ones need at
+// least NumBitsMax bits pre-read.
 #ifndef MSCOMP_HUFFMAN_DECODER
 #define MSCOMP_HUFFMAN_DECODER
 
 #include "internal.h"
 #include "Bitstream.h"
 
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
 #define INVALID_SYMBOL 0xFFFF
 
-template <byte NumBitsMax, uint16_t NumSymbols> // for NumBitsMax = 15 and NumSymbols = 0x200 this takes 1.625 kb (+~0.15 during SetCodeLengths)
+// The default extra bits for HuffmanDecoder, no symbols have any
+struct HuffmanNoExtraBits { static FORCE_INLINE uint_fast8_t Get(uint_fast16_t) { return 0; } };
+
+template <byte NumBitsMax, uint16_t NumSymbols, uint16_t NumLiterals = 0, class ExtraBits = HuffmanNoExtraBits> // for NumBitsMax = 15 and NumSymbols = 0x200 this takes 6.75 kb (+1 kb during SetCodeLengths)
 class HuffmanDecoder
 {
-	CASSERT(NumBitsMax <= 16 && NumBitsMax > 2);
+	CASSERT(NumBitsMax <= 16 && NumBitsMax > 2 && NumLiterals <= 0x100 && NumLiterals <= NumSymbols);
 
 private:
-	static const int NumTableBits = (NumBitsMax+1)/2 + 1; // = 9 for a NumBitsMax of 15 and 16
-	// TODO: increasing the value gives speedups but requires more space, eventually great increases in memory provide little increase in speed
+	static const int NumTableBits = NumBitsMax > 10 ? 10 : NumBitsMax; // = 10 for a NumBitsMax of 15 and 16
+	static const int NumSubBits = NumBitsMax - NumTableBits; // the maximum number of bits used to index a sub-table
+	static const uint32_t SubMask = (1 << NumSubBits) - 1;
+
+	// Since the codes are canonical, every root entry with a sub-table is completely filled with codes
+	// of a single length except for at most one per long code length transition and the last one (if
+	// the code is incomplete). The completely filled ones have one entry per symbol.
+	static const uint_fast16_t NumSubEntries = NumSymbols + ((NumSubBits + 1) << NumSubBits);
+
+	static const uint32_t LINK = 0x100;
+	static const uint32_t TWO_LITERALS = 0x80000000;
+	static const uint32_t INVALID_ENTRY = (uint32_t)INVALID_SYMBOL << 15;
+
+	// Creates the entry for a single symbol
+	FORCE_INLINE static uint32_t Entry(const uint_fast16_t sym, const uint_fast8_t len) { return ((uint32_t)sym << 15) | ((uint32_t)(len + ExtraBits::Get(sym)) << 9) | len; }
 
-	uint_fast16_t lims[NumBitsMax + 1]; // lims[i] = value limit for syms with length = i
-	uint_fast16_t poss[NumBitsMax + 1]; // poss[i] = index in syms[] of first symbol with length = i
-	uint16_t syms[NumSymbols];
-	byte     lens[1 << NumTableBits]; // table for short codes
+	uint32_t table[(1 << NumTableBits) + NumSubEntries];
+
+	// Fills n entries starting at entries with x, n is a power of 2
+	FORCE_INLINE static void Fill(uint32_t* entries, uint32_t x, uint_fast16_t n)
+	{
+		const uint32_t* end = entries + n;
+#ifdef __SSE2__
+		if (n >= 4)
+		{
+			const __m128i v = _mm_set1_epi32((int)x);
+			for (; entries < end; entries += 4) { _mm_storeu_si128((__m128i*)entries, v); }
+			return;
+		}
+#endif
+		for (; entries < end; ++entries) { *entries = x; }
+	}
+
+	// Gets the number of bits and the symbol of the first code of an entry that is not a link
+	FORCE_INLINE static uint_fast8_t FirstBits(const uint32_t e) { return (uint_fast8_t)((NumLiterals && (e & TWO_LITERALS)) ? ((e >> 9) & 0x3F) : (e & 0xFF)); }
+	FORCE_INLINE static uint_fast16_t FirstSymbol(const uint32_t e) { return (uint_fast16_t)((NumLiterals && (e & TWO_LITERALS)) ? ((e >> 15) & 0xFF) : (e >> 15)); }
+
+	// Gets the entry for the code in x, which are the next NumBitsMax bits of the stream
+	FORCE_INLINE uint32_t Lookup(const uint32_t x) const
+	{
+		const uint32_t e = this->table[x >> NumSubBits];
+		return UNLIKELY(e & LINK) ? this->table[(e >> 15) + ((x & SubMask) >> (e & 0xFF))] : e;
+	}
 
 public:
 	INLINE bool SetCodeLengths(const const_byte code_lengths[NumSymbols])
 	{
-		memset(this->syms, INVALID_SYMBOL, sizeof(this->syms));
-
-		// Get all length counts
-		uint_fast16_t cnts[NumBitsMax + 1];
-		memset(cnts+1, 0, NumBitsMax*sizeof(uint_fast16_t));
-		for (uint_fast16_t s = 0; s < NumSymbols; ++s)
+		// Get all length counts, counting even and odd symbols separately so consecutive symbols with
+		// the same length do not wait on each other
+		uint_fast16_t cnts[NumBitsMax + 1], cnts2[NumBitsMax + 1];
+		memset(cnts, 0, (NumBitsMax+1)*sizeof(uint_fast16_t));
+		memset(cnts2, 0, (NumBitsMax+1)*sizeof(uint_fast16_t));
+		for (uint_fast16_t s = 0; s < NumSymbols; s += 2)
 		{
-			const byte len = code_lengths[s];
+			const byte len = code_lengths[s], len2 = code_lengths[s+1];
 			//if (UNLIKELY(len > NumBitsMax)) { return false; } // TODO: Not needed for XPRESS Huffman, need to check if LZX needs it
-			ALWAYS(len <= NumBitsMax);
+			ALWAYS(len <= NumBitsMax && len2 <= NumBitsMax);
 			++cnts[len];
+			++cnts2[len2];
 		}
+		for (uint_fast8_t len = 1; len <= NumBitsMax; ++len) { cnts[len] += cnts2[len]; }
 		cnts[0] = 0;
 
-		// Get limits and lengths
-		const uint_fast16_t MaxValue = (1 << NumBitsMax);
-		uint_fast16_t last = 0, index = 0;
-		this->lims[0] = 0; this->lims[NumBitsMax] = MaxValue;
-		for (uint_fast8_t len = 1; len <= NumTableBits; ++len)
+		// Make sure the code is not over-subscribed and get the positions of the first symbol of each length
+		const uint_fast32_t MaxValue = (1 << NumBitsMax);
+		uint_fast32_t last = 0;
+		uint_fast16_t poss[NumBitsMax + 1];
+		poss[0] = 0;
+		for (uint_fast8_t len = 1; len <= NumBitsMax; ++len)
 		{
-			uint_fast16_t inc = cnts[len] << (NumBitsMax - len);
-			if (UNLIKELY(last + (uint_fast32_t)inc > MaxValue)) { return false; }
-			this->lims[len] = (last += inc);
-			const uint_fast16_t limit = last >> (NumBitsMax - NumTableBits);
-			memset(this->lens+index, len, limit-index); index = limit;
+			if (UNLIKELY((last += cnts[len] << (NumBitsMax - len)) > MaxValue)) { return false; }
+			poss[len] = poss[len-1] + cnts[len-1];
+		}
+
+		// Sort the symbols by code length then symbol value, which is the order of the canonical codes
+		uint16_t syms[NumSymbols];
+		const uint_fast16_t count = poss[NumBitsMax] + cnts[NumBitsMax];
+		for (uint16_t s = 0; s < NumSymbols; ++s)
+		{
+			const byte len = code_lengths[s];
+			if (len) { syms[poss[len]++] = s; }
 		}
-		for (uint_fast8_t len = NumTableBits + 1; len < NumBitsMax; ++len)
+
+		// Fill in the root table, one code length at a time, all codes of a length fill the same number
+		// of entries, then the rest of it is set to invalid and the sub-tables are created
+		uint32_t* entries = this->table;
+		uint_fast16_t i = 0, sub_pos = 1 << NumTableBits;
+		for (uint_fast8_t len = 1; len <= NumTableBits; ++len)
 		{
-			uint_fast16_t inc = cnts[len] << (NumBitsMax - len);
-			if (UNLIKELY(last + (uint_fast32_t)inc > MaxValue)) { return false; }
-			this->lims[len] = (last += inc);
+			const uint_fast16_t n = 1 << (NumTableBits - len);
+			for (const uint_fast16_t end = i + cnts[len]; i < end; ++i, entries += n) { Fill(entries, Entry(syms[i], len), n); }
 		}
-		if (UNLIKELY(last + cnts[NumBitsMax] > MaxValue)) { return false; }
+		const uint_fast16_t short_end = (uint_fast16_t)(entries - this->table); // the root entries for codes no longer than NumTableBits
+		uint_fast32_t code = (uint_fast32_t)short_end << NumSubBits; // left-justified to NumBitsMax bits
+		for (; entries < this->table + (1 << NumTableBits); ++entries) { *entries = INVALID_ENTRY; }
+		while (i < count)
+		{
+			// Start a new sub-table, its size is set by the longest code that shares the root prefix
+			const uint_fast32_t root = code >> NumSubBits;
+			uint_fast16_t j = i;
+			for (uint_fast32_t c = code; j < count && (c >> NumSubBits) == root; c += 1 << (NumBitsMax - code_lengths[syms[j++]]));
+			const uint_fast8_t sub_bits = code_lengths[syms[j-1]] - NumTableBits, shift = NumSubBits - sub_bits;
+			if (UNLIKELY(sub_pos + (1 << sub_bits) > (1 << NumTableBits) + NumSubEntries)) { return false; } // never happens
+			this->table[root] = ((uint32_t)sub_pos << 15) | LINK | shift;
+			uint32_t* sub = this->table + sub_pos;
+			Fill(sub, INVALID_ENTRY, 1 << sub_bits);
+			sub_pos += 1 << sub_bits;
 
-		// Get positions
-		this->poss[0] = 0;
-		for (uint_fast8_t len = 1; len <= NumBitsMax; ++len) { this->poss[len] = this->poss[len-1] + cnts[len-1]; }
+			// Fill in the sub-table
+			for (; i < j; ++i)
+			{
+				const uint_fast8_t len = code_lengths[syms[i]];
+				Fill(sub + ((code & SubMask) >> shift), Entry(syms[i], len), 1 << (NumBitsMax - len - shift));
+				code += 1 << (NumBitsMax - len);
+			}
+		}
 
-		// Get symbols
-		memcpy(cnts, this->poss, sizeof(this->poss));
-		for (uint16_t s = 0; s < NumSymbols; ++s)
+		// Pack pairs of literals into the root table, going through the entries of each literal with a
+		// code shorter than NumTableBits
+		if (NumLiterals)
 		{
-			int len = code_lengths[s];
-			if (len) { this->syms[cnts[len]++] = s; }
+			// no pairs are possible once the code length plus the shortest code length is too long
+			uint_fast8_t min_len = 1;
+			while (min_len < NumTableBits && cnts[min_len] == 0) { ++min_len; }
+			uint32_t* entries = this->table;
+			for (uint_fast16_t j = 0; entries < this->table + short_end; ++j)
+			{
+				const uint_fast8_t n1 = code_lengths[syms[j]];
+				const uint_fast16_t n = 1 << (NumTableBits - n1), lit1 = syms[j];
+				if (n1 + min_len > NumTableBits) { break; }
+				if (lit1 >= NumLiterals) { entries += n; continue; }
+				for (uint_fast16_t k = 0; k < n; ++k, ++entries)
+				{
+					// the entry at the remaining bits (followed by 0s) has the second literal if its code fits in the remaining bits
+					const uint32_t e2 = this->table[k << n1];
+					const uint_fast8_t n2 = FirstBits(e2);
+					const uint_fast16_t lit2 = FirstSymbol(e2);
+					if ((e2 & LINK) || lit2 >= NumLiterals || n2 == 0 || n1 + n2 > NumTableBits) { continue; }
+					*entries = TWO_LITERALS | ((uint32_t)lit2 << 23) | ((uint32_t)lit1 << 15) | (n1 << 9) | (n1 + n2);
+				}
+			}
 		}
 
 		return true;
 	}
 
-	INLINE uint_fast16_t DecodeSymbol(InputBitstream *bits) const
+	template <class Bitstream>
+	INLINE uint_fast16_t DecodeSymbol(Bitstream *bits) const
 	{
-		uint_fast8_t n, r = bits->AvailableBits();
-		const uint32_t x = UNLIKELY(r < NumBitsMax) ? (bits->Peek(r) << (NumBitsMax - r)) : bits->Peek(NumBitsMax);
-		if (LIKELY(x < this->lims[NumTableBits])) { n = this->lens[x >> (NumBitsMax - NumTableBits)]; }
-		else { for (n = NumTableBits + 1; x >= this->lims[n]; ++n); }
+		const uint_fast8_t r = bits->AvailableBits();
+		const uint32_t e = this->Lookup(UNLIKELY(r < NumBitsMax) ? (bits->Peek(r) << (NumBitsMax - r)) : bits->Peek(NumBitsMax));
+		const uint_fast8_t n = FirstBits(e);
 		if (UNLIKELY(n > r)) { return INVALID_SYMBOL; }
 		bits->Skip(n);
-		uint32_t s = this->poss[n] + ((x - this->lims[n-1]) >> (NumBitsMax-n));
-		return UNLIKELY(s >= NumSymbols) ? INVALID_SYMBOL : this->syms[s];
+		return FirstSymbol(e);
 	}
 	
-	INLINE uint_fast16_t DecodeSymbolFast(InputBitstream *bits) const
+	template <class Bitstream>
+	INLINE uint_fast16_t DecodeSymbolFast(Bitstream *bits) const
 	{
-		uint_fast8_t n;
-		const uint32_t x = bits->Peek(NumBitsMax);
-		if (LIKELY(x < this->lims[NumTableBits])) { n = this->lens[x >> (NumBitsMax - NumTableBits)]; }
-		else { for (n = NumTableBits + 1; x >= this->lims[n]; ++n); }
-		bits->Skip_Fast(n);
-		uint32_t s = this->poss[n] + ((x - this->lims[n-1]) >> (NumBitsMax-n));
-		return UNLIKELY(s >= NumSymbols) ? INVALID_SYMBOL : this->syms[s]; // TODO: can this ever happen? does removing it make things faster?
+		const uint32_t e = this->Lookup(bits->Peek(NumBitsMax));
+		bits->Skip_Fast(FirstBits(e));
+		return FirstSymbol(e); // unused codes give INVALID_SYMBOL
 	}
+
+	// Decodes the next symbol, or the next two literals if they fit in a single root entry. If two
+	// literals are decoded the return value is >= 0x10000 and the lower 16 bits hold the literals as
+	// a little-endian uint16. Otherwise it is the same as DecodeSymbolFast. Requires NumLiterals != 0.
+	template <class Bitstream>
+	FORCE_INLINE uint_fast32_t DecodeSymbolsFast(Bitstream *bits) const
+	{
+		const uint32_t e = this->Lookup(bits->Peek(NumBitsMax));
+		bits->Skip_Fast((uint_fast8_t)(e & 0xFF));
+		return e >> 15;
+	}
+
+	// Gets the entry of the next symbol, or the next two literals, without skipping any bits. The
+	// symbol (or two literals like DecodeSymbolsFast) is given by SymbolOf, the bits to skip for it by
+	// BitsOf, and for a single symbol the bits to skip for it and its extra bits by BitsWithExtraOf.
+	// Requires NumLiterals != 0.
+	template <class Bitstream>
+	FORCE_INLINE uint32_t LookupFast(const Bitstream *bits) const { return this->Lookup(bits->Peek(NumBitsMax)); }
+	FORCE_INLINE static uint_fast32_t SymbolOf(const uint32_t e) { return e >> 15; }
+	FORCE_INLINE static uint_fast8_t BitsOf(const uint32_t e) { return (uint_fast8_t)(e & 0xFF); }
+	FORCE_INLINE static uint_fast8_t BitsWithExtraOf(const uint32_t e) { return (uint_fast8_t)((e >> 9) & 0x3F); }
 };
 
 #endif
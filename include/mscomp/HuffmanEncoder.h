@@ -28,207 +28,132 @@ private:
 	uint16_t codes[NumSymbols];
 	byte lens[NumSymbols];
 
-#define HEAP_PUSH(x)                         \
-{                                            \
-	heap[++heap_len] = x;                    \
-	uint_fast16_t j = heap_len;              \
-	while (weights[x] < weights[heap[j>>1]]) \
-	{                                        \
-		heap[j] = heap[j>>1]; j >>= 1;       \
-	}                                        \
-	heap[j] = x;                             \
-}
-
-#define HEAP_POP()                                  \
-{                                                   \
-	uint_fast16_t i = 1, t = heap[1] = heap[heap_len--]; \
-	for (;;)                                        \
-	{                                               \
-		uint_fast16_t j = i << 1;                   \
-		if (j > heap_len) { break; }                \
-		if (j < heap_len && weights[heap[j+1]] < weights[heap[j]]) { ++j; } \
-		if (weights[t] < weights[heap[j]]) { break; } \
-		heap[i] = heap[j];                          \
-		i = j;                                      \
-	}                                               \
-	heap[i] = t;                                    \
-}
+	void CreateCanonicalCodes()
+	{
+		// Codes are assigned in increasing length then symbol order
+		uint16_t next_code[NumBitsMax+2];
+		memset(next_code, 0, sizeof(next_code));
+		for (uint_fast16_t i = 0; i < NumSymbols; ++i) { ++next_code[this->lens[i]+1]; }
+		next_code[1] = 0; // unused symbols
+		for (uint_fast8_t l = 2; l <= NumBitsMax; ++l) { next_code[l] = (uint16_t)((next_code[l-1] + next_code[l]) << 1); }
+		for (uint_fast16_t i = 0; i < NumSymbols; ++i) { if (this->lens[i]) { this->codes[i] = next_code[this->lens[i]]++; } }
+	}
 
 public:
-	const_bytes CreateCodes(uint32_t symbol_counts[NumSymbols]) // 17 kb stack (for NumSymbols == 0x200)
+	INLINE HuffmanEncoder() { memset(this->lens, 0, sizeof(this->lens)); } // no codes until CreateCodes
+
+	const_bytes CreateCodes(const uint32_t symbol_counts[NumSymbols]) // 11 kb stack (for NumSymbols == 0x200)
 	{
-		// Creates Length-Limited Huffman Codes using an optimized version of the original Huffman algorithm
-		// Does not always produce optimal codes
-		// Algorithm from "In-Place Calculation of Minimum-Redundancy Codes" by A Moffat and J Katajainen
-		// Code adapted from bzip2. See http://www.bzip.org/.
+		// Creates optimal Length-Limited Huffman Codes using the package-merge algorithm
+		// Algorithm from "A Fast Algorithm for Optimal Length-Limited Huffman Codes" by L Larmore and D Hirschberg
+		// The list of each level is made by merging the used symbols with the pairs ("packages") of
+		// items from the list of the level below it. Only the first 2n-2 items of a list can ever be
+		// selected and each list only remembers which of its items are packages, which is enough to
+		// follow the selected items back down through the lists. Unused symbols get a length of 0.
 		memset(this->codes, 0, sizeof(this->codes));
+		memset(this->lens,  0, sizeof(this->lens));
 
-		// Compute the initial weights (the weight is in the upper 24 bits, the depth (initially 0) is in the lower 8 bits
-		uint32_t weights[NumSymbols * 2]; // weights of nodes
-		weights[0] = 0;
-		for (uint_fast16_t i = 0; i < NumSymbols; ++i) { weights[i+1] = (symbol_counts[i] == 0 ? 1 : symbol_counts[i]) << 8; }
-
-		for (;;)
+		// Get the symbols that are used, sorted by their counts
+		uint16_t syms[NumSymbols], temp[NumSymbols]; // 2*2*512 = 2 kb
+		uint_fast16_t n = 0;
+		for (uint_fast16_t i = 0; i < NumSymbols; ++i) { if (symbol_counts[i]) { syms[n++] = (uint16_t)i; } }
+		if (UNLIKELY(n <= 1))
 		{
-			// Build the initial heap
-			uint_fast16_t heap_len = 0, heap[NumSymbols + 2] = { 0 }; // heap of symbols, 1 to heap_len
-			for (uint_fast16_t i = 1; i <= NumSymbols; ++i) { HEAP_PUSH(i); }
-
-			// Build the tree (its a bottom-up tree)
-			uint_fast16_t n_nodes = NumSymbols, parents[NumSymbols * 2]; // parents of nodes, 1 to n_nodes
-			memset(parents, 0, sizeof(parents));
-			while (heap_len > 1)
-			{
-				uint_fast16_t n1 = heap[1]; HEAP_POP();
-				uint_fast16_t n2 = heap[1]; HEAP_POP();
-				parents[n1] = parents[n2] = ++n_nodes;
-				weights[n_nodes] = ((weights[n1]&0xffffff00)+(weights[n2]&0xffffff00)) | (1 + MAX((weights[n1]&0x000000ff),(weights[n2]&0x000000ff)));
-				HEAP_PUSH(n_nodes);
-			}
-
-			// Create the actual length codes
-			bool too_long = false;
-			for (uint_fast16_t i = 1; i <= NumSymbols; ++i)
-			{
-				byte j = 0;
-				uint_fast16_t k = i;
-				while (parents[k] > 0) { k = parents[k]; ++j; }
-				this->lens[i-1] = j;
-				if (j > NumBitsMax) { too_long = true; }
-			}
-
-			// If we had codes that were too long then we need to make all the weights smaller
-			if (!too_long) { break; }
-			for (uint_fast16_t i = 1; i <= NumSymbols; ++i)
+			// a lone symbol still needs a code, and an unused symbol gets the other 1-bit code so that
+			// the code is complete (some decoders reject incomplete codes)
+			if (n) { this->lens[syms[0]] = 1; this->lens[syms[0] == 0] = 1; this->CreateCanonicalCodes(); }
+			return this->lens;
+		}
+		radix_sort(syms, temp, symbol_counts, n);
+
+		////////// Package-Merge Algorithm //////////
+		const uint_fast16_t max_items = 2*n - 2;
+		uint32_t leaves[NumSymbols], items[2*NumSymbols]; // 3*4*512 = 6 kb
+		uint32_t is_pkg[NumBitsMax][(2*NumSymbols+31)/32]; // 15*4*32 = 1.9 kb
+		for (uint_fast16_t i = 0; i < n; ++i) { items[i] = leaves[i] = symbol_counts[syms[i]]; }
+		uint_fast16_t len = n; // the first list only has symbols
+		for (uint_fast8_t j = 1; j < NumBitsMax; ++j)
+		{
+			// Package the pairs of items of the previous list in place
+			uint_fast16_t p = len >> 1, s = n;
+			for (uint_fast16_t i = 0; i < p; ++i) { items[i] = items[2*i] + items[2*i+1]; }
+
+			// Merge the packages and symbols from the back, symbols go first when the weights are equal
+			uint32_t* const pkgs = is_pkg[j];
+			memset(pkgs, 0, (max_items+31)/32*sizeof(uint32_t));
+			len = MIN(p + s, max_items);
+			for (uint_fast16_t k = p + s; k--; )
 			{
-				weights[i] = (1 + (weights[i] >> 9)) << 8;
+				if (s == 0 || (p > 0 && items[p-1] >= leaves[s-1]))
+				{
+					--p;
+					if (k < max_items) { items[k] = items[p]; pkgs[k >> 5] |= 1u << (k & 0x1F); }
+				}
+				else if (k < max_items) { items[k] = leaves[--s]; }
+				else { --s; }
 			}
 		}
 
-		// Compute the values of the codes
-		uint_fast16_t min = this->lens[0], max = min;
-		for (uint_fast16_t i = 1; i < NumSymbols; ++i)
+		// Follow the first 2n-2 items of the last list back down through the lists, every time a
+		// symbol is selected its code becomes 1 bit longer (ends[m] is the number of lists where the
+		// first m symbols are selected)
+		uint16_t ends[NumSymbols+1]; // 1 kb
+		memset(ends, 0, (n+1)*sizeof(uint16_t));
+		uint_fast16_t k = max_items;
+		for (uint_fast8_t j = NumBitsMax - 1; j > 0; --j)
 		{
-			if (this->lens[i] > max) { max = this->lens[i]; }
-			else if (this->lens[i] < min) { min = this->lens[i]; }
-		}
-		uint16_t code = 0;
-		for (uint_fast16_t n = min; n <= max; ++n)
-		{
-			for (uint_fast16_t i = 0; i < NumSymbols; ++i)
-			{
-				if (this->lens[i] == n) { this->codes[i] = code++; }
-			}
-			code <<= 1;
+			const uint32_t* const pkgs = is_pkg[j];
+			uint_fast16_t n_pkgs = 0;
+			for (uint_fast16_t i = 0; i < (k >> 5); ++i) { n_pkgs += count_bits_set(pkgs[i]); }
+			if (k & 0x1F) { n_pkgs += count_bits_set((uint32_t)(pkgs[k >> 5] & ((1u << (k & 0x1F)) - 1))); }
+			++ends[k - n_pkgs];
+			k = 2 * n_pkgs;
 		}
+		++ends[k];
+		for (uint_fast16_t i = n, l = 0; i--; ) { l += ends[i+1]; this->lens[syms[i]] = (byte)l; }
+
+		////////// Create canonical Huffman codes from the lengths //////////
+		this->CreateCanonicalCodes();
 
 		// Done!
 		return this->lens;
 	}
 
-	const_bytes CreateCodesSlow(uint32_t symbol_counts[NumSymbols]) // 3 kb stack (for NumSymbols == 0x200) [519kb stack when compiled with MSCOMP_WITH_LARGE_STACK]
+	// Uses the given code lengths instead of creating them, returns false if a length is too long or
+	// they are over-subscribed (the same check as HuffmanDecoder::SetCodeLengths)
+	bool SetLens(const const_byte lens[NumSymbols])
 	{
-		// Creates Length-Limited Huffman Codes using the package-merge algorithm
-		// Always produces optimal codes but is significantly slower than the Huffman algorithm
-		memset(this->codes, 0, sizeof(this->codes));
-		memset(this->lens,  0, sizeof(this->lens));
-
-		// Fill the syms_by_count and syms_by_length with the symbols that were found
-		uint16_t syms_by_count[NumSymbols], syms_by_len[NumSymbols], temp[NumSymbols]; // 3*2*512 = 3 kb
-		uint_fast16_t len = 0;
-		for (uint_fast16_t i = 0; i < NumSymbols; ++i) { if (symbol_counts[i]) { syms_by_count[len] = (uint16_t)i; syms_by_len[len++] = (uint16_t)i; this->lens[i] = NumBitsMax; } }
-
-		////////// Get the Huffman lengths //////////
-		merge_sort(syms_by_count, temp, symbol_counts, len); // sort by the counts
-		if (UNLIKELY(len == 1))
+		uint_fast32_t total = 0;
+		for (uint_fast16_t i = 0; i < NumSymbols; ++i)
 		{
-			this->lens[syms_by_count[0]] = 1; // never going to happen, but the code below would probably assign a length of 0 which is not right
+			if (UNLIKELY(lens[i] > NumBitsMax)) { return false; }
+			if (lens[i]) { total += 1 << (NumBitsMax - lens[i]); }
 		}
-		else
-		{
-			///// Package-Merge Algorithm /////
-			typedef struct _collection // 516 bytes each
-			{
-				byte symbols[NumSymbols];
-				uint_fast16_t count;
-			} collection;
-#ifdef MSCOMP_WITH_LARGE_STACK
-			collection _cols[NumSymbols], _next_cols[NumSymbols],
-#else
-			collection *_cols = (collection*)malloc(NumSymbols*sizeof(collection)),
-				*_next_cols = (collection*)malloc(NumSymbols*sizeof(collection)),
-#endif
-				*cols = _cols, *next_cols = _next_cols; // 2*516*512 = 516 kb (not on stack any more)
-			uint_fast16_t cols_len = 0, next_cols_len = 0;
-
-			// Start at the lowest value row, adding new collection
-			for (uint_fast16_t j = 0; j < NumBitsMax; ++j)
-			{
-				uint_fast16_t cols_pos = 0, pos = 0;
-
-				// All but the last one/none get added to collections
-				while ((cols_len-cols_pos + len-pos) > 1)
-				{
-					memset(next_cols+next_cols_len, 0, sizeof(collection));
-					for (uint_fast16_t i = 0; i < 2; ++i) // hopefully unrolled...
-					{
-						if (pos >= len || (cols_pos < cols_len && cols[cols_pos].count < symbol_counts[syms_by_count[pos]]))
-						{
-							// Add cols[cols_pos]
-							next_cols[next_cols_len].count += cols[cols_pos].count;
-							for (uint_fast16_t s = 0; s < NumSymbols; ++s)
-							{
-								next_cols[next_cols_len].symbols[s] += cols[cols_pos].symbols[s];
-							}
-							++cols_pos;
-						}
-						else
-						{
-							// Add syms[pos]
-							next_cols[next_cols_len].count += symbol_counts[syms_by_count[pos]];
-							++next_cols[next_cols_len].symbols[syms_by_count[pos]];
-							++pos;
-						}
-					}
-					++next_cols_len;
-				}
-			
-				// Leftover gets dropped
-				if (cols_pos < cols_len)
-				{
-					const byte* const syms = cols[cols_pos].symbols;
-					for (uint_fast16_t i = 0; i < NumSymbols; ++i) { this->lens[i] -= syms[i]; }
-				}
-				else if (pos < len)
-				{
-					--this->lens[syms_by_count[pos]];
-				}
+		if (UNLIKELY(total > (1 << NumBitsMax))) { return false; }
+		memset(this->codes, 0, sizeof(this->codes));
+		memcpy(this->lens, lens, sizeof(this->lens));
+		this->CreateCanonicalCodes();
+		return true;
+	}
 
-				// Move the next_collections to the current collections
-				collection* temp_cols = cols; cols = next_cols; next_cols = temp_cols;
-				cols_len = next_cols_len;
-				next_cols_len = 0;
-			}
-#ifndef MSCOMP_WITH_LARGE_STACK
-			free(_cols); free(_next_cols);
-#endif
+	// Gets the code lengths from the last call to CreateCodes or SetLens
+	FORCE_INLINE const_bytes Lens() const { return this->lens; }
 
-			////////// Create Huffman codes from lengths //////////
-			merge_sort(syms_by_len, temp, this->lens, len); // Sort by the code lengths
-			for (uint_fast16_t i = 1; i < len; ++i)
-			{
-				// Code is previous code +1 with added zeroes for increased code length
-				this->codes[syms_by_len[i]] = (this->codes[syms_by_len[i-1]] + 1) << (this->lens[syms_by_len[i]] - this->lens[syms_by_len[i-1]]);
-			}
+	// Gets the number of bits the current codes use for symbols with the given counts, or SIZE_MAX
+	// if one of the symbols has no code
+	size_t Cost(const uint32_t symbol_counts[NumSymbols]) const
+	{
+		size_t bits = 0;
+		bool missing = false;
+		for (uint_fast16_t i = 0; i < NumSymbols; ++i)
+		{
+			bits += this->lens[i] * symbol_counts[i];
+			missing |= (this->lens[i] == 0) & (symbol_counts[i] != 0);
 		}
-
-		return this->lens;
+		return missing ? SIZE_MAX : bits;
 	}
 
 	FORCE_INLINE void EncodeSymbol(uint_fast16_t sym, OutputBitstream *bits) const { bits->WriteBits(this->codes[sym], this->lens[sym]); }
 };
 
-#undef HEAP_PUSH
-#undef HEAP_POP
-
 #endif
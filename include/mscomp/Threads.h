@@ -0,0 +1,109 @@
+// ms-compress: implements Microsoft compression algorithms
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+// A minimal wrapper around native threads for compressors that split their work between threads.
+// Uses Windows threads on Windows and POSIX threads everywhere else. Without the THREADS option
+// the function is simply run in the calling thread when it is started.
+
+#ifndef MSCOMP_THREADS_H
+#define MSCOMP_THREADS_H
+
+#include "internal.h"
+
+#ifdef MSCOMP_WITH_THREADS
+	#ifdef _WIN32
+		#ifndef WIN32_LEAN_AND_MEAN
+		#define WIN32_LEAN_AND_MEAN
+		#endif
+		#ifndef NOMINMAX
+		#define NOMINMAX
+		#endif
+		#include <windows.h>
+	#else
+		#include <pthread.h>
+		#include <unistd.h>
+	#endif
+#endif
+
+typedef void (*ThreadFunc)(void*);
+
+class Thread
+{
+private:
+	ThreadFunc func;
+	void* arg;
+#ifdef MSCOMP_WITH_THREADS
+	bool started;
+#ifdef _WIN32
+	HANDLE handle;
+	static DWORD WINAPI Run(LPVOID t) { ((Thread*)t)->func(((Thread*)t)->arg); return 0; }
+#else
+	pthread_t thread;
+	static void* Run(void* t) { ((Thread*)t)->func(((Thread*)t)->arg); return NULL; }
+#endif
+#endif
+
+public:
+	// Starts running func(arg). If a new thread cannot be created the function is run in the
+	// calling thread before this returns, so the work is always done once Join returns.
+	INLINE void Start(ThreadFunc func, void* arg)
+	{
+		this->func = func;
+		this->arg = arg;
+#ifdef MSCOMP_WITH_THREADS
+#ifdef _WIN32
+		this->started = (this->handle = CreateThread(NULL, 0, &Run, this, 0, NULL)) != NULL;
+#else
+		this->started = pthread_create(&this->thread, NULL, &Run, this) == 0;
+#endif
+		if (!this->started)
+#endif
+		{ func(arg); }
+	}
+
+	// Waits for the function started with Start to finish
+	INLINE void Join()
+	{
+#ifdef MSCOMP_WITH_THREADS
+		if (!this->started) { return; }
+#ifdef _WIN32
+		WaitForSingleObject(this->handle, INFINITE);
+		CloseHandle(this->handle);
+#else
+		pthread_join(this->thread, NULL);
+#endif
+		this->started = false;
+#endif
+	}
+
+	// Gets the number of processors available, at least 1
+	INLINE static unsigned ProcessorCount()
+	{
+#if defined(MSCOMP_WITH_THREADS) && defined(_WIN32)
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return info.dwNumberOfProcessors ? (unsigned)info.dwNumberOfProcessors : 1;
+#elif defined(MSCOMP_WITH_THREADS) && defined(_SC_NPROCESSORS_ONLN)
+		const long n = sysconf(_SC_NPROCESSORS_ONLN);
+		return n > 0 ? (unsigned)n : 1;
+#else
+		return 1;
+#endif
+	}
+};
+
+#endif
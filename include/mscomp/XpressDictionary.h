@@ -24,6 +24,12 @@
 #define MSCOMP_XPRESS_DICTIONARY_H
 #include "internal.h"
 #include "Array.h"
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+#define XPRESS_DICTIONARY_DEFAULT_LEVEL	3
+#define XPRESS_DICTIONARY_MAX_SKIP_LEVEL	7 // higher levels are for the best ratio so always search (see SkipIncompressible)
 
 template<unsigned> class XpressDictionaryLevel { private: XpressDictionaryLevel(); };
 template<> struct XpressDictionaryLevel<1> { const static uint32_t NiceLength =  16, MaxChain =   4; };
@@ -35,10 +41,27 @@ template<> struct XpressDictionaryLevel<6> { const static uint32_t NiceLength =
 template<> struct XpressDictionaryLevel<7> { const static uint32_t NiceLength = 512, MaxChain = 128; };
 template<> struct XpressDictionaryLevel<8> { const static uint32_t NiceLength = UINT32_MAX, MaxChain = UINT32_MAX; };
 
+// Returns f<Level>args for a level chosen at runtime (see MSCOMP_LEVEL_*), with MSCOMP_ARG_ERROR
+// for invalid levels, so that every level uses a dictionary specialized for it
+#define XPRESS_DICTIONARY_LEVEL_SWITCH(level, f, args) \
+	switch (level) \
+	{ \
+	case MSCOMP_LEVEL_DEFAULT: return f<XPRESS_DICTIONARY_DEFAULT_LEVEL>args; \
+	case 1: return f<1>args; \
+	case 2: return f<2>args; \
+	case 3: return f<3>args; \
+	case 4: return f<4>args; \
+	case 5: return f<5>args; \
+	case 6: return f<6>args; \
+	case 7: return f<7>args; \
+	case 8: return f<8>args; \
+	default: return MSCOMP_ARG_ERROR; \
+	}
+
 WARNINGS_PUSH()
 WARNINGS_IGNORE_ASSIGNMENT_OPERATOR_NOT_GENERATED()
 
-template<uint32_t MaxOffset, uint32_t ChunkSize = MaxOffset, unsigned HashBits = 15, bool ForceUseStack = false, unsigned Level = 3>
+template<uint32_t MaxOffset, uint32_t ChunkSize = MaxOffset, unsigned HashBits = 15, bool ForceUseStack = false, unsigned Level = XPRESS_DICTIONARY_DEFAULT_LEVEL>
 class XpressDictionary
 	// when ChunkSize is 0x02000: 192 kb (or  384 kb on 64-bit) [Xpress]
 	// when ChunkSize is 0x10000: 640 kb (or 1280 kb on 64-bit) [Xpress Huffman]
@@ -59,7 +82,7 @@ private:
 	static const unsigned HashShift = (HashBits+2)/3;
 	FORCE_INLINE static uint_fast16_t HashUpdate(const uint_fast16_t h, const byte c) { return ((h<<HashShift) ^ c) & HashMask; }
 
-	const const_bytes start, end, end2;
+	const_bytes start, end, end2;
 #ifdef MSCOMP_WITH_LARGE_STACK
 	Array<const_bytes, HashSize, true> table;    // 128/256 kb
 	Array<const_bytes, WindowSize, true> window; //  64/128 kb  or  512/1024 kb
@@ -95,12 +118,64 @@ private:
 
 public:
 	typedef XpressDictionaryLevel<Level> LevelConfig;
+	// If data that looks incompressible (see entropy.h) does not need to be searched
+	static const bool SkipIncompressible = Level <= XPRESS_DICTIONARY_MAX_SKIP_LEVEL;
 
 	INLINE XpressDictionary(const const_bytes start, const const_bytes end) : start(start), end(end), end2(end - 2)
 	{
 		memset(this->table.data(), 0, HashSize*sizeof(const_bytes));
 	}
 
+	// Removes everything from the dictionary and changes the end of the data, used when the data
+	// after start has been replaced (e.g. moved within a buffer when streaming)
+	INLINE void Reset(const const_bytes end)
+	{
+		this->SetEnd(end);
+		memset(this->table.data(), 0, HashSize*sizeof(const_bytes));
+	}
+
+	// Changes the end of the data, used when more data is available after the end (e.g. streaming)
+	INLINE void SetEnd(const const_bytes end)
+	{
+		this->end = end;
+		this->end2 = end - 2;
+	}
+
+	// Keeps the last ChunkSize bytes that were added, used when the data after start + ChunkSize has
+	// been moved to start (e.g. moved within a buffer when streaming) so that it does not need to be
+	// added again. Everything before start + ChunkSize is removed.
+	INLINE void Slide()
+	{
+		// local pointers since the arrays may be on the heap and the loops only vectorize when the
+		// compiler knows that they are not written by the loops
+		const const_bytes keep = this->start + ChunkSize;
+		const_bytes* const table = this->table.data();
+		const_bytes* const window = this->window.data();
+		for (uint32_t i = 0; i < HashSize; ++i)
+		{
+			const const_bytes x = table[i];
+			table[i] = (x >= keep) ? x - ChunkSize : NULL;
+		}
+		// the data is moved by half of the window so its positions in the window swap halves, the
+		// other half is written when the data after it is added
+		for (uint32_t i = 0; i < ChunkSize; ++i)
+		{
+			const const_bytes x = window[i + ChunkSize];
+			window[i] = (x >= keep) ? x - ChunkSize : NULL;
+		}
+	}
+
+	// Removes everything from the dictionary and starts over with new data, used when pieces of data
+	// are compressed independently of each other
+	INLINE void Reset(const const_bytes start, const const_bytes end)
+	{
+		this->start = start;
+		this->Reset(end);
+	}
+
+	// The beginning of the data, matches can never refer to data before this
+	INLINE const_bytes Start() const { return this->start; }
+
 	INLINE const_bytes Fill(const_bytes data)
 	{
 		// equivalent to Add(data, ChunkSize)
@@ -181,8 +256,355 @@ public:
 		}
 		return len;
 	}
+
+	// Finds the match with the smallest offset for each length that is longer than the matches with
+	// smaller offsets, giving up to max matches in increasing length (and offset). If there are more
+	// than max, the last one is replaced so that it is always the longest match found. Returns the
+	// number of matches found.
+	INLINE uint32_t FindAll(const const_bytes data, uint32_t* lens, uint32_t* offsets, const uint32_t max) const
+	{
+#if PNTR_BITS <= 32
+		const const_bytes endx = this->end; // on 32-bit, + UINT32_MAX will always overflow
+#else
+		const const_bytes endx = ((data + UINT32_MAX) < data || (data + UINT32_MAX) >= this->end) ? this->end : data + UINT32_MAX; // if overflow or past end use the end
+#endif
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+		const const_bytes xend = data - MaxOffset, end4 = endx - 4;
+		const uint16_t prefix = *(uint16_t*)data;
+#else
+		const const_bytes xend = data - MaxOffset;
+		const byte prefix0 = data[0], prefix1 = data[1];
+#endif
+		const_bytes x;
+		uint32_t len = 2, n = 0, chain_length = LevelConfig::MaxChain;
+		for (x = this->window[WindowPos(data)]; chain_length && x >= xend; x = this->window[WindowPos(x)], --chain_length)
+		{
+			// only a match that is longer than the last one is needed so first check the byte after it
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+			if (x[len] == data[len] && *(uint16_t*)x == prefix)
+			{
+				const uint32_t l = GetMatchLength(x, data, endx, end4);
+#else
+			if (x[len] == data[len] && x[0] == prefix0 && x[1] == prefix1)
+			{
+				const uint32_t l = GetMatchLength(x, data, endx);
+#endif
+				if (l > len)
+				{
+					if (n == max) { --n; }
+					offsets[n] = (uint32_t)(data - x);
+					lens[n++] = len = l;
+					if (len >= LevelConfig::NiceLength || data + len >= endx) { break; }
+				}
+			}
+		}
+		return n;
+	}
 };
 
+// A dictionary for the fast levels that keeps the last few positions of each hash in a bucket of one
+// cache line instead of chaining every position, with a tag of more bits of the hash for each so
+// that most positions that cannot match are rejected without reading them. Positions are added in
+// batches when they are needed instead of when the data is filled, fetching the buckets ahead of
+// time, so most of the cache misses of adding positions overlap each other.
+//
+// Unlike XpressDictionary the positions are added by Find and FindAll (so they are not const) and
+// older positions are dropped once a bucket is full.
+template<uint32_t MaxOffset, uint32_t ChunkSize = MaxOffset, unsigned HashBits = 12, bool ForceUseStack = false, unsigned Level = XPRESS_DICTIONARY_DEFAULT_LEVEL>
+class XpressBucketDictionary
+	// when HashBits is 12: 256 kb
+{
+	CASSERT(MaxOffset <= ChunkSize);
+	CASSERT(HashBits >= 8 && HashBits <= 16);
+
+public:
+	typedef XpressDictionaryLevel<Level> LevelConfig;
+	// If data that looks incompressible (see entropy.h) does not need to be searched
+	static const bool SkipIncompressible = Level <= XPRESS_DICTIONARY_MAX_SKIP_LEVEL;
+
+private:
+	// A bucket is one cache line: the positions are a ring with the next one to replace at head
+	static const uint32_t Slots = 12;
+	CASSERT(LevelConfig::MaxChain <= Slots);
+	typedef struct _Bucket
+	{
+		uint32_t pos[Slots]; // distance from base (see Slide)
+		byte tag[Slots];
+		uint32_t head;
+	} Bucket;
+	CASSERT(sizeof(Bucket) == 64);
+
+	// The hash of 3 bytes, the high bits are the bucket and the next 8 bits are the tag
+	static const uint32_t HashSize = 1 << HashBits;
+	FORCE_INLINE static uint32_t Hash(const_bytes x) { return (GET_UINT16_RAW(x) | (x[2] << 16)) * 0x9E3779B1u; }
+	FORCE_INLINE Bucket* GetBucket(const uint32_t hash) const { return this->buckets + (hash >> (32 - HashBits)); }
+	FORCE_INLINE static byte Tag(const uint32_t hash) { return (byte)(hash >> (24 - HashBits)); }
+
+	// Number of positions ahead whose buckets are fetched while adding
+	static const uint32_t PrefetchDistance = 8;
+
+	const_bytes start, end, end2;
+	const_bytes base;			// the stored positions are relative to this
+	const_bytes added, filled;	// positions from added to filled still need to be added
+#ifdef MSCOMP_WITH_LARGE_STACK
+	Array<Bucket, HashSize + 1, true> bucket_data;
+#else
+	Array<Bucket, HashSize + 1, ForceUseStack> bucket_data;
+#endif
+	Bucket* buckets;			// aligned to a cache line within bucket_data
+
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+	INLINE static uint32_t GetMatchLength(const_bytes a, const_bytes b, const const_bytes end, const const_bytes end4)
+#else
+	INLINE static uint32_t GetMatchLength(const_bytes a, const_bytes b, const const_bytes end)
+#endif
+	{
+		// like memcmp but tells you the length of the match and optimized
+		// assumptions: a < b < end, end4 = end - 4
+		const const_bytes b_start = b;
+		byte a0, b0;
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+		while (b < end4 && *((uint32_t*)a) == *((uint32_t*)b))
+		{
+			a += sizeof(uint32_t);
+			b += sizeof(uint32_t);
+		}
+#endif
+		do
+		{
+			a0 = *a++;
+			b0 = *b++;
+		} while (b < end && a0 == b0);
+		return (uint32_t)(b - b_start - 1);
+	}
+
+	FORCE_INLINE void Insert(const_bytes x, const uint32_t hash)
+	{
+		Bucket* const b = this->GetBucket(hash);
+		const uint32_t i = b->head;
+		b->pos[i] = (uint32_t)(x - this->base);
+		b->tag[i] = Tag(hash);
+		b->head = (i == 0) ? Slots - 1 : i - 1;
+	}
+
+	// Gets the positions in a bucket that have the tag, limited to the MaxChain newest, as a mask
+	// where bit k is set if the position that was added k positions ago has the tag
+	FORCE_INLINE static uint32_t Candidates(const Bucket* const b, const byte tag)
+	{
+#ifdef __SSE2__
+		const uint32_t m = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)b->tag), _mm_set1_epi8((char)tag)));
+#else
+		uint32_t m = 0;
+		for (uint32_t i = 0; i < Slots; ++i) { m |= (uint32_t)(b->tag[i] == tag) << i; }
+#endif
+		// the newest position is just after head
+		const uint32_t newest = (b->head + 1 == Slots) ? 0 : b->head + 1, mask = m & ((1 << Slots) - 1);
+		return ((mask >> newest) | (mask << (Slots - newest))) & ((1 << LevelConfig::MaxChain) - 1);
+	}
+
+	// Adds the positions from added up to x (but not past filled)
+	INLINE void AddUpTo(const_bytes x)
+	{
+		if (x > this->filled) { x = this->filled; }
+		const_bytes data = this->added;
+		if (data >= x) { return; }
+		const uint32_t n = (uint32_t)(x - data);
+		this->added = x;
+		if (n == 1) { this->Insert(data, Hash(data)); return; } // after a literal, its bucket was just searched
+
+		// the hashes of the next PrefetchDistance positions, whose buckets are being fetched
+		uint32_t hashes[PrefetchDistance];
+		const uint32_t ahead = MIN(n, PrefetchDistance);
+		for (uint32_t i = 0; i < ahead; ++i) { PREFETCH(this->GetBucket(hashes[i] = Hash(data + i))); }
+		for (uint32_t i = 0; i < n; ++i)
+		{
+			const uint32_t hash = hashes[i % PrefetchDistance];
+			if (i + PrefetchDistance < n)
+			{
+				const uint32_t next = Hash(data + i + PrefetchDistance);
+				PREFETCH(this->GetBucket(next));
+				hashes[i % PrefetchDistance] = next;
+			}
+			this->Insert(data + i, hash);
+		}
+	}
+
+public:
+	INLINE XpressBucketDictionary(const const_bytes start, const const_bytes end) : start(start), end(end), end2(end - 2), base(start), added(start), filled(start)
+	{
+		this->buckets = (Bucket*)(((uintptr_t)this->bucket_data.data() + sizeof(Bucket) - 1) & ~(uintptr_t)(sizeof(Bucket) - 1));
+		memset(this->buckets, 0, HashSize*sizeof(Bucket));
+	}
+
+	// Removes everything from the dictionary and changes the end of the data, used when the data
+	// after start has been replaced (e.g. moved within a buffer when streaming)
+	INLINE void Reset(const const_bytes end)
+	{
+		this->SetEnd(end);
+		this->base = this->added = this->filled = this->start;
+		memset(this->buckets, 0, HashSize*sizeof(Bucket));
+	}
+
+	// Changes the end of the data, used when more data is available after the end (e.g. streaming)
+	INLINE void SetEnd(const const_bytes end)
+	{
+		this->end = end;
+		this->end2 = end - 2;
+	}
+
+	// Keeps the last ChunkSize bytes that were added, used when the data after start + ChunkSize has
+	// been moved to start (e.g. moved within a buffer when streaming) so that it does not need to be
+	// added again. Since the positions are relative to base only base has to move, the positions
+	// before start are never matched.
+	INLINE void Slide()
+	{
+		this->base -= ChunkSize;
+		const const_bytes keep = this->start + ChunkSize;
+		this->added = (this->added > keep) ? this->added - ChunkSize : this->start;
+		this->filled = (this->filled > keep) ? this->filled - ChunkSize : this->start;
+	}
+
+	// Removes everything from the dictionary and starts over with new data, used when pieces of data
+	// are compressed independently of each other
+	INLINE void Reset(const const_bytes start, const const_bytes end)
+	{
+		this->start = start;
+		this->Reset(end);
+	}
+
+	// The beginning of the data, matches can never refer to data before this
+	INLINE const_bytes Start() const { return this->start; }
+
+	INLINE const_bytes Fill(const_bytes data)
+	{
+		// equivalent to Add(data, ChunkSize) except that the positions are added once they are needed
+		this->AddUpTo(this->filled);
+		if (UNLIKELY(data >= this->end2)) { return this->end2; }
+		const const_bytes endx = ((data + ChunkSize) < this->end2) ? data + ChunkSize : this->end2;
+		if (data > this->added) { this->added = data; }
+		if (endx > this->filled) { this->filled = endx; }
+		return endx;
+	}
+
+	INLINE void Add(const_bytes data, size_t len)
+	{
+		if (UNLIKELY(data >= this->end2)) { return; }
+		const const_bytes end = ((data + len) < this->end2) ? data + len : this->end2;
+		if (data > this->added) { this->added = data; } // the positions before it are not needed
+		if (end > this->filled) { this->filled = end; }
+		this->AddUpTo(end);
+	}
+
+	INLINE uint32_t Find(const const_bytes data, uint32_t* offset)
+	{
+		this->AddUpTo(data);
+#if PNTR_BITS <= 32
+		const const_bytes endx = this->end; // on 32-bit, + UINT32_MAX will always overflow
+#else
+		const const_bytes endx = ((data + UINT32_MAX) < data || (data + UINT32_MAX) >= this->end) ? this->end : data + UINT32_MAX; // if overflow or past end use the end
+#endif
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+		const const_bytes end4 = endx - 4;
+		const uint16_t prefix = *(uint16_t*)data;
+#else
+		const byte prefix0 = data[0], prefix1 = data[1];
+#endif
+		const uint32_t hash = Hash(data);
+		if (data + PrefetchDistance < this->filled) { PREFETCH(this->GetBucket(Hash(data + PrefetchDistance))); } // the next literals search these
+		const Bucket* const b = this->GetBucket(hash);
+		const byte tag = Tag(hash);
+		const uint32_t pos = (uint32_t)(data - this->base), max_dist = (uint32_t)MIN((size_t)(data - this->start), MaxOffset);
+		const uint32_t newest = (b->head + 1 == Slots) ? 0 : b->head + 1;
+		uint32_t len = 2;
+		for (uint32_t c = Candidates(b, tag); c; c &= c - 1)
+		{
+			// from the newest position to the oldest
+			const uint32_t i = newest + log2(c & (~c + 1)), dist = pos - b->pos[i >= Slots ? i - Slots : i];
+			if (dist - 1 >= max_dist) { break; } // the older positions are even farther
+			const const_bytes x = data - dist;
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+			if (*(uint16_t*)x == prefix && x[2] == data[2])
+			{
+				const uint32_t l = GetMatchLength(x, data, endx, end4);
+#else
+			if (x[0] == prefix0 && x[1] == prefix1 && x[2] == data[2])
+			{
+				const uint32_t l = GetMatchLength(x, data, endx);
+#endif
+				if (l > len)
+				{
+					*offset = dist;
+					len = l;
+					if (len >= LevelConfig::NiceLength) { break; }
+				}
+			}
+		}
+		return len;
+	}
+	// Finds the match with the smallest offset for each length that is longer than the matches with
+	// smaller offsets, giving up to max matches in increasing length (and offset). If there are more
+	// than max, the last one is replaced so that it is always the longest match found. Returns the
+	// number of matches found.
+	INLINE uint32_t FindAll(const const_bytes data, uint32_t* lens, uint32_t* offsets, const uint32_t max)
+	{
+		this->AddUpTo(data);
+#if PNTR_BITS <= 32
+		const const_bytes endx = this->end; // on 32-bit, + UINT32_MAX will always overflow
+#else
+		const const_bytes endx = ((data + UINT32_MAX) < data || (data + UINT32_MAX) >= this->end) ? this->end : data + UINT32_MAX; // if overflow or past end use the end
+#endif
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+		const const_bytes end4 = endx - 4;
+		const uint16_t prefix = *(uint16_t*)data;
+#else
+		const byte prefix0 = data[0], prefix1 = data[1];
+#endif
+		const uint32_t hash = Hash(data);
+		const Bucket* const b = this->GetBucket(hash);
+		const byte tag = Tag(hash);
+		const uint32_t pos = (uint32_t)(data - this->base), max_dist = (uint32_t)MIN((size_t)(data - this->start), MaxOffset);
+		const uint32_t newest = (b->head + 1 == Slots) ? 0 : b->head + 1;
+		uint32_t len = 2, n = 0;
+		for (uint32_t c = Candidates(b, tag); c; c &= c - 1)
+		{
+			const uint32_t i = newest + log2(c & (~c + 1)), dist = pos - b->pos[i >= Slots ? i - Slots : i];
+			if (dist - 1 >= max_dist) { break; }
+			const const_bytes x = data - dist;
+			// only a match that is longer than the last one is needed so first check the byte after it
+#ifdef MSCOMP_WITH_UNALIGNED_ACCESS
+			if (x[len] == data[len] && *(uint16_t*)x == prefix && x[2] == data[2])
+			{
+				const uint32_t l = GetMatchLength(x, data, endx, end4);
+#else
+			if (x[len] == data[len] && x[0] == prefix0 && x[1] == prefix1 && x[2] == data[2])
+			{
+				const uint32_t l = GetMatchLength(x, data, endx);
+#endif
+				if (l > len)
+				{
+					if (n == max) { --n; }
+					offsets[n] = dist;
+					lens[n++] = len = l;
+					if (len >= LevelConfig::NiceLength || data + len >= endx) { break; }
+				}
+			}
+		}
+		return n;
+	}
+};
+
+// The dictionary used for each level, with MSCOMP_WITH_XPRESS_BUCKET_DICT the fastest levels use
+// XpressBucketDictionary
+#ifdef MSCOMP_WITH_XPRESS_BUCKET_DICT
+#define XPRESS_DICTIONARY_MAX_BUCKET_LEVEL	3
+#else
+#define XPRESS_DICTIONARY_MAX_BUCKET_LEVEL	0
+#endif
+template<uint32_t MaxOffset, uint32_t ChunkSize, unsigned Level, bool Buckets = (Level <= XPRESS_DICTIONARY_MAX_BUCKET_LEVEL)>
+struct XpressLevelDictionary { typedef XpressDictionary<MaxOffset, ChunkSize, 15, false, Level> Type; };
+template<uint32_t MaxOffset, uint32_t ChunkSize, unsigned Level>
+struct XpressLevelDictionary<MaxOffset, ChunkSize, Level, true> { typedef XpressBucketDictionary<MaxOffset, ChunkSize, 12, false, Level> Type; };
+
 WARNINGS_POP()
 
 #endif
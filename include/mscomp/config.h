@@ -62,6 +62,13 @@
 #define MSCOMP_WITH_WARNING_MESSAGES
 #endif
 
+// THREADS - Allow compressors to use multiple threads
+// Without this option the multi-threaded compressors do all of their work in the calling thread.
+// Uses POSIX threads (so may need -pthread) except on Windows.
+#if !defined(MSCOMP_WITH_THREADS) && !defined(MSCOMP_WITHOUT_THREADS)
+#define MSCOMP_WITH_THREADS
+#endif
+
 // LZNT1, XPRESS, XPRESS_HUFF, LZX
 // Enable/disable support for a specific algorithm.
 #if !defined(MSCOMP_WITH_LZNT1) && !defined(MSCOMP_WITHOUT_LZNT1)
@@ -86,3 +93,11 @@
 #if !defined(MSCOMP_WITH_LZNT1_SA_DICT) && !defined(MSCOMP_WITHOUT_LZNT1_SA_DICT)
 #define MSCOMP_WITHOUT_LZNT1_SA_DICT
 #endif
+
+// XPRESS_BUCKET_DICT - Use the bucket dictionary for the fastest levels of Xpress and Xpress Huffman
+// compression (levels 1 to 3, including the default level). It keeps only the last few positions of
+// each hash so it finds slightly different matches, and for Xpress Huffman it uses 256 KB instead of
+// 640 KB (1280 KB on 64-bit). It is slower than the default dictionary when that fits in the cache.
+#if !defined(MSCOMP_WITH_XPRESS_BUCKET_DICT) && !defined(MSCOMP_WITHOUT_XPRESS_BUCKET_DICT)
+#define MSCOMP_WITHOUT_XPRESS_BUCKET_DICT
+#endif
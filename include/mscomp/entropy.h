@@ -0,0 +1,123 @@
+// ms-compress: implements Microsoft compression algorithms
+// Copyright (C) 2012  Jeffrey Bush  jeff@coderforlife.com
+//
+// This library is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+/////////////////// Incompressible Data Detection and Entropy /////////////////
+// Quickly guesses if data will not compress, such as data that is already compressed or is
+// encrypted, so that the compressors can skip searching it for matches. Only a sample of the data
+// is looked at, making this much faster than trying to compress it. The data must have bytes that
+// are nearly evenly spread and almost no repeated strings to be considered incompressible.
+//
+// This does change the output for mostly-compressed data: the few matches in it are lost. For a mix
+// of gzip files Xpress and Xpress Huffman output is about 0.1% larger while compressing it is over
+// twice as fast. Requiring no repeated strings at all keeps those matches but also loses the speed.
+
+#ifndef MSCOMP_ENTROPY_H
+#define MSCOMP_ENTROPY_H
+#include "internal.h"
+
+#define ENTROPY_MIN_LEN		0x200	// shorter data is never considered incompressible
+#define ENTROPY_SAMPLE_LEN	32		// the number of bytes in each sample
+#define ENTROPY_SAMPLES_MAX	128		// the most samples taken (4 kb)
+#define ENTROPY_HASH_BITS	12		// the size of the table used to find repeated strings
+#define ENTROPY_PROBE_MAX	0x10000	// the most bytes searched for repeated strings
+
+INLINE bool is_incompressible(const_bytes in, const size_t len, size_t history)
+{
+	// history is the number of bytes before in that matches can refer to
+	if (len < ENTROPY_MIN_LEN) { return false; }
+
+	////////// Byte Histogram //////////
+	// The samples are spread evenly through the data. Each of 4 consecutive bytes is counted in its
+	// own histogram so the increments do not wait on each other when bytes repeat.
+	uint16_t counts[4][0x100]; // 2 kb
+	memset(counts, 0, sizeof(counts));
+	const size_t n_samples = MIN(len / ENTROPY_SAMPLE_LEN, ENTROPY_SAMPLES_MAX), stride = len / n_samples;
+	for (const_bytes x = in, end = in + n_samples * stride; x < end; x += stride)
+	{
+		for (uint_fast8_t i = 0; i < ENTROPY_SAMPLE_LEN; i += 4) { ++counts[0][x[i]]; ++counts[1][x[i+1]]; ++counts[2][x[i+2]]; ++counts[3][x[i+3]]; }
+	}
+
+	// The chance that two sampled bytes are the same must be less than 2^-7.5 (it is 2^-8 for
+	// random bytes), with at most 7.5 bits per byte coding the literals saves at most ~6%
+	const uint64_t n = n_samples * ENTROPY_SAMPLE_LEN;
+	uint64_t same = 0;
+	for (uint_fast16_t i = 0; i < 0x100; ++i)
+	{
+		const uint32_t c = counts[0][i] + counts[1][i] + counts[2][i] + counts[3][i];
+		same += c * (c - 1);
+	}
+	if (same * 181 >= n * (n - 1)) { return false; }
+
+	////////// Repeated Strings //////////
+	// Looks up every 4-byte string in a table of previous positions, starting in the history so
+	// repeats of earlier data are found as well. Skipping ahead like fast LZ compressors do would be
+	// quicker but misses repeats whose distance is not a multiple of the step.
+	uint16_t table[1 << ENTROPY_HASH_BITS]; // 8 kb
+	memset(table, 0, sizeof(table));
+	const size_t probe_len = MIN(len, ENTROPY_PROBE_MAX);
+	history = MIN(history, ENTROPY_PROBE_MAX - probe_len); // positions must fit in 16 bits
+	const const_bytes base = in - history, end = in + probe_len - 4;
+	size_t matched = 0;
+	for (const_bytes x = base + 1; x < end; )
+	{
+		const uint32_t v = GET_UINT32_RAW(x);
+		const uint_fast16_t h = (uint_fast16_t)((v * 0x9E3779B1u) >> (32 - ENTROPY_HASH_BITS));
+		const_bytes y = base + table[h];
+		table[h] = (uint16_t)(x - base);
+		if (x >= in && GET_UINT32_RAW(y) == v)
+		{
+			const const_bytes start = x;
+			for (x += 4, y += 4; x < end && *x == *y; ++x, ++y);
+			if ((matched += x - start) >= probe_len / 32) { return false; }
+		}
+		else { ++x; }
+	}
+	return true;
+}
+
+/////////////////// Entropy ////////////////////////////////////////////////////
+// The fewest bits that any prefix code could use for symbols with given counts, used to judge how
+// good a code is without creating the optimal one. Values are in 1/256ths of a bit.
+
+#define ENTROPY_FRAC_BITS	8
+
+// Gets log2(x) of x > 0 by squaring x/2^floor(log2(x)) once for each fractional bit
+INLINE uint32_t entropy_log2(const uint32_t x)
+{
+	const int l = log2(x);
+	uint64_t y = (l <= 16) ? ((uint64_t)x << (16 - l)) : (x >> (l - 16)); // in [1, 2) as 16.16 fixed-point
+	uint32_t r = (uint32_t)l << ENTROPY_FRAC_BITS;
+	for (uint32_t b = 1 << (ENTROPY_FRAC_BITS - 1); b; b >>= 1)
+	{
+		y = (y * y) >> 16;
+		if (y >= 0x20000) { y >>= 1; r |= b; }
+	}
+	return r;
+}
+
+// Gets the Shannon entropy of the symbols, which is sum(count * log2(total / count))
+INLINE uint64_t entropy_bits(const uint32_t* counts, const size_t n)
+{
+	uint64_t total = 0, sum = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		if (counts[i]) { total += counts[i]; sum += (uint64_t)counts[i] * entropy_log2(counts[i]); }
+	}
+	return total ? total * entropy_log2((uint32_t)total) - sum : 0;
+}
+
+#endif
@@ -60,6 +60,7 @@ typedef const byte const_byte;
 typedef const_byte* const_bytes;
 
 typedef struct _mscomp_internal_state mscomp_internal_state;
+typedef struct _mscomp_chunk_cache mscomp_chunk_cache; // see ms_chunk_cache_create
 
 // Formats supported
 typedef enum _MSCompFormat {
@@ -92,6 +93,15 @@ typedef enum _MSCompFlush
 	MSCOMP_FINISH    = 4
 } MSCompFlush;
 
+// Compression Levels (only used by Xpress and Xpress Huffman, the other formats ignore them)
+#define MSCOMP_LEVEL_DEFAULT	0 // the level used by the functions without a level (3)
+#define MSCOMP_LEVEL_FASTEST	1
+#define MSCOMP_LEVEL_MAX		8
+
+// Bytes past the end of the output buffer that the *_decompress_padded functions may overwrite
+// with garbage
+#define MSCOMP_DECOMPRESS_PADDING 512
+
 // Compression Stream Object
 typedef struct _mscomp_stream {
 	MSCompFormat	format;
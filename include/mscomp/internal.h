@@ -218,7 +218,7 @@ typedef const_byte* RESTRICT const_rest_bytes;
 	#define NEVER(x)      __assume(!(x))
 	#define UNREACHABLE() __assume(0)
 	#ifdef __SSE__
-	#define PREFETCH(p)   _mm_prefetch((char*)(p), _MM_HINT_NTA)
+	#define PREFETCH(p)   _mm_prefetch((char*)(p), _MM_HINT_T0)
 	#else
 	#define PREFETCH(p)   
 	#endif
@@ -296,7 +296,7 @@ typedef const_byte* RESTRICT const_rest_bytes;
 	#define UNLIKELY(x)   __builtin_expect((x), 0)
 	#define NEVER(x)      if (x) { __builtin_unreachable(); }
 	#define UNREACHABLE() __builtin_unreachable()
-	#define PREFETCH(p)   __builtin_prefetch(p, 0, 0)
+	#define PREFETCH(p)   __builtin_prefetch(p, 0, 3)
 	#define ASSUME_ALIGNED(p, n) __builtin_assume_aligned(p, n)
 	uint8_t  FORCE_INLINE rotl(uint8_t x,  int bits) { return ((x << bits) | (x >> (8  - bits))); } // the compiler detects these and optimizes, no need for a special builtin
 	uint16_t FORCE_INLINE rotl(uint16_t x, int bits) { return ((x << bits) | (x >> (16 - bits))); }
@@ -396,6 +396,19 @@ typedef const_byte* RESTRICT const_rest_bytes;
 	#define ENTRY_POINT
 #endif
 
+///// Runtime processor selection /////
+// When the compiler is not already using BMI2 instructions everywhere but can for single functions,
+// MSCOMP_BMI2_DISPATCH is defined. Then TARGET_BMI2 marks a function to be compiled with them (the
+// variable shifts in the bitstreams become SHLX/SHRX/BZHI) and HAS_BMI2() checks if the processor
+// supports them, which must be true before calling any of those functions. HAS_BMI2() can be used
+// during static initialization so the check is done once instead of every call.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(__BMI2__) && \
+	((defined(__clang__) && __clang_major__ >= 6) || (!defined(__clang__) && __GNUC__ >= 5))
+	#define MSCOMP_BMI2_DISPATCH
+	#define TARGET_BMI2 __attribute__((target("bmi,bmi2")))
+	#define HAS_BMI2() (__builtin_cpu_init(), __builtin_cpu_supports("bmi2"))
+#endif
+
 ///// Warning disable support /////
 #if defined(_MSC_VER)
 	#define WARNINGS_PUSH() __pragma(warning(push))
@@ -19,50 +19,35 @@
 
 #include "internal.h"
 
-#define SORT_SWITCH_TO_INSERT_LIMIT 90
-
-// Insertion-sorts syms[l, r) using conditions[syms[x]]
-// Use insertion-sort so that it is stable, keeping symbols in increasing order
-// This is only used at the tail end of merge_sort.
+// Radix-sorts syms[0, len) using conditions[syms[x]], 8 bits at a time
+// Radix-sort is stable, keeping symbols with equal conditions in increasing order
+// Bytes that are the same for every symbol are skipped so small conditions only take 1 or 2 passes.
+// temp must have room for len symbols.
 template<typename T> // T is either uint32_t or byte
-void insertion_sort(uint16_t* syms, const T* const conditions, const uint_fast16_t len)
+void radix_sort(uint16_t* syms, uint16_t* temp, const T* const conditions, const uint_fast16_t len)
 {
-	for (uint_fast16_t i = 1; i < len; ++i)
+	if (len < 2) { return; }
+	uint32_t counts[sizeof(T)][0x100]; // 4 kb (for uint32_t)
+	memset(counts, 0, sizeof(counts));
+	for (uint_fast16_t i = 0; i < len; ++i)
 	{
-		const uint16_t x = syms[i];
-		const T cond = conditions[x];
-		uint_fast16_t j = i;
-		while (j > 0 && conditions[syms[j-1]] > cond) { syms[j] = syms[j-1]; --j; }
-		syms[j] = x;
+		const T c = conditions[syms[i]];
+		for (uint_fast8_t b = 0; b < sizeof(T); ++b) { ++counts[b][(c >> (b*8)) & 0xFF]; }
 	}
-}
 
-// Merge-sorts syms[l, r) using conditions[syms[x]]
-// Use merge-sort so that it is stable, keeping symbols in increasing order
-template<typename T> // T is either uint32_t or byte
-void merge_sort(uint16_t* syms, uint16_t* temp, const T* const conditions, const uint_fast16_t len)
-{
-	if (len < SORT_SWITCH_TO_INSERT_LIMIT)
+	uint16_t* const syms_orig = syms;
+	for (uint_fast8_t b = 0; b < sizeof(T); ++b)
 	{
-		// Insertion-Sort for the last "few"
-		insertion_sort(syms, conditions, len);
-	}
-	else
-	{
-		// Merge-Sort
-		const uint_fast16_t m = len >> 1;
-		uint_fast16_t i = 0, j = 0, k = m;
-		
-		// Divide and Conquer
-		merge_sort(syms,   temp,   conditions, m      );
-		merge_sort(syms+m, temp+m, conditions, len - m);
-		memcpy(temp, syms, len*sizeof(uint16_t));
-		
-		// Merge
-		while (j < m && k < len) syms[i++] = (conditions[temp[k]] < conditions[temp[j]]) ? temp[k++] : temp[j++]; // if == then does j which is from the lower half, keeping stable
-		if (j < m)        { memcpy(syms+i, temp+j, (m  -j)*sizeof(uint16_t)); }
-		else if (k < len) { memcpy(syms+i, temp+k, (len-k)*sizeof(uint16_t)); }
+		uint32_t* const pos = counts[b];
+		const uint_fast8_t shift = b*8;
+		if (pos[(conditions[syms[0]] >> shift) & 0xFF] == len) { continue; } // all the same
+
+		// Turn the counts into the first position of each value then move the symbols there
+		for (uint32_t i = 0, total = 0; i < 0x100; ++i) { const uint32_t c = pos[i]; pos[i] = total; total += c; }
+		for (uint_fast16_t i = 0; i < len; ++i) { const uint16_t x = syms[i]; temp[pos[(conditions[x] >> shift) & 0xFF]++] = x; }
+		uint16_t* const t = syms; syms = temp; temp = t;
 	}
+	if (syms != syms_orig) { memcpy(syms_orig, syms, len*sizeof(uint16_t)); }
 }
 
 #endif
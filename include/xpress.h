@@ -47,9 +47,14 @@ EXTERN_C_START
 MSCOMPAPI MSCompStatus xpress_compress(const_bytes in, size_t in_len, bytes out, size_t* out_len);
 MSCOMPAPI size_t xpress_max_compressed_size(size_t in_len);
 
+// Compresses with one of the levels MSCOMP_LEVEL_DEFAULT to MSCOMP_LEVEL_MAX (see ms_compress_level)
+MSCOMPAPI MSCompStatus xpress_compress_level(const_bytes in, size_t in_len, bytes out, size_t* out_len, unsigned level);
+
 MSCOMPAPI MSCompStatus xpress_decompress(const_bytes in, size_t in_len, bytes out, size_t* out_len);
+MSCOMPAPI MSCompStatus xpress_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* out_len);
 
 MSCOMPAPI MSCompStatus xpress_deflate_init(mscomp_stream* stream);
+MSCOMPAPI MSCompStatus xpress_deflate_init_level(mscomp_stream* stream, unsigned level);
 MSCOMPAPI MSCompStatus xpress_deflate(mscomp_stream* stream, MSCompFlush flush);
 MSCOMPAPI MSCompStatus xpress_deflate_end(mscomp_stream* stream);
 
@@ -34,6 +34,11 @@
 //
 // The compression code is completely new and performs similar to the WIMGAPI compression ratio
 // (time not tested).
+//
+// When streaming compression, MSCOMP_FLUSH only outputs complete 64 KiB chunks since every chunk
+// besides the last must decompress to exactly 64 KiB. Up to 64 KiB of input may stay buffered.
+// Streaming output is not the same as xpress_huff_compress and can be slightly larger since its
+// matches never continue past the end of a chunk.
 
 #ifndef XPRESS_HUFF_H
 #define XPRESS_HUFF_H
@@ -46,15 +51,107 @@ EXTERN_C_START
 MSCOMPAPI MSCompStatus xpress_huff_compress(const_bytes in, size_t in_len, bytes out, size_t* out_len);
 MSCOMPAPI size_t xpress_huff_max_compressed_size(size_t in_len);
 
+// Compresses with one of the levels MSCOMP_LEVEL_DEFAULT to MSCOMP_LEVEL_MAX (see ms_compress_level)
+MSCOMPAPI MSCompStatus xpress_huff_compress_level(const_bytes in, size_t in_len, bytes out, size_t* out_len, unsigned level);
+
+// Compresses like xpress_huff_compress except that a chunk uses the Huffman codes of the chunk
+// before it again when they are nearly as good as new ones, which skips creating the codes.
+MSCOMPAPI MSCompStatus xpress_huff_compress_fast(const_bytes in, size_t in_len, bytes out, size_t* out_len);
+
+// Compresses like xpress_huff_compress but meant for small inputs (a few KiB) where setting up the
+// compressor takes much of the time. Each chunk is encoded with the given code lengths unless
+// creating new codes would save a lot. The code lengths are given as 256 bytes in the same format
+// as the start of each chunk (two 4-bit lengths per byte, see xpress_huff_train), or NULL for
+// built-in lengths trained on text and executables. Returns MSCOMP_ARG_ERROR if they are invalid.
+MSCOMPAPI MSCompStatus xpress_huff_compress_trained(const_bytes in, size_t in_len, bytes out, size_t* out_len, const_bytes lens);
+
+// Creates code lengths for xpress_huff_compress_trained from sample data like the data that will be
+// compressed, writing 256 bytes to lens. The samples are compressed in pieces of msg_len bytes each
+// on their own (0 or more than 64 KiB for 64 KiB pieces), which should be about the size of the
+// inputs that will be compressed.
+MSCOMPAPI MSCompStatus xpress_huff_train(const_bytes in, size_t in_len, size_t msg_len, bytes lens);
+
+// Compresses like xpress_huff_compress while using and adding to a chunk cache (see
+// ms_chunk_cache_create), a chunk is copied from the cache when it and the 64 KiB before it are the
+// same as a chunk compressed before.
+MSCOMPAPI MSCompStatus xpress_huff_compress_cached(const_bytes in, size_t in_len, bytes out, size_t* out_len, mscomp_chunk_cache* cache);
+
+// Compresses like xpress_huff_compress except that the symbols of each chunk are chosen by a
+// near-optimal parse priced with Huffman code lengths instead of always taking the longest match.
+// This is about ten times slower but gives smaller output, for data that is decompressed many times.
+MSCOMPAPI MSCompStatus xpress_huff_compress_optimal(const_bytes in, size_t in_len, bytes out, size_t* out_len);
+
+// Compresses using up to nthreads threads (0 for one per processor), each compressing a contiguous
+// range of 64 KiB chunks. The output is identical to xpress_huff_compress.
+MSCOMPAPI MSCompStatus xpress_huff_compress_mt(const_bytes in, size_t in_len, bytes out, size_t* out_len, unsigned nthreads);
+
 MSCOMPAPI MSCompStatus xpress_huff_decompress(const_bytes in, size_t in_len, bytes out, size_t* out_len);
+MSCOMPAPI MSCompStatus xpress_huff_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* out_len);
+
+// Decompresses n separate buffers of compressed data on the calling thread, alternating between two
+// of them at a time so that their decoding overlaps. The arguments are arrays of the arguments to
+// xpress_huff_decompress and status gets the result of each. Returns the first error or MSCOMP_OK.
+MSCOMPAPI MSCompStatus xpress_huff_decompress_multi(const const_bytes* in, const size_t* in_len, const bytes* out, size_t* out_len, MSCompStatus* status, size_t n);
+
+// A chunk index gives where each chunk starts in the compressed and decompressed data so that the
+// chunks can be decompressed without decompressing everything before them first. It has one entry
+// for each chunk followed by one entry with the ends of the compressed and decompressed data. The
+// index_len arguments are the number of entries, for outputs it is initially the number of
+// entries available.
+typedef struct _mscomp_xpress_huff_chunk
+{
+	size_t in_offset;	// offset of the chunk in the compressed data
+	size_t out_offset;	// offset of the chunk in the decompressed data
+} mscomp_xpress_huff_chunk;
+
+// Gets the most index entries that compressed data of length in_len can have
+MSCOMPAPI size_t xpress_huff_max_index_len(size_t in_len);
+
+// Creates the chunk index of compressed data by reading its symbols without writing any output
+MSCOMPAPI MSCompStatus xpress_huff_index(const_bytes in, size_t in_len, mscomp_xpress_huff_chunk* index, size_t* index_len);
+
+// Compresses like xpress_huff_compress while also creating the chunk index of the compressed data,
+// which has in_len / 65536 + 2 entries at most
+MSCOMPAPI MSCompStatus xpress_huff_compress_indexed(const_bytes in, size_t in_len, bytes out, size_t* out_len, mscomp_xpress_huff_chunk* index, size_t* index_len);
+
+// Decompresses only the out_len bytes starting at out_offset in the decompressed data using the chunk
+// index of the compressed data. Only the chunks covering the range and the few earlier chunks they
+// reference are decompressed when the data before the range is rarely referenced (like most text).
+// Otherwise (like most binary data) every chunk before the range must be decompressed, so a read
+// near the end of the data costs about as much as decompressing all of it. Fast seeks in such data
+// would need an index that also stores the 64 KiB window before each chunk. out_len is set to the
+// number of bytes decompressed, which is less than requested if the range goes past the end of the
+// data. An offset past the end of the data or an invalid index gives MSCOMP_ARG_ERROR.
+MSCOMPAPI MSCompStatus xpress_huff_decompress_range(const_bytes in, size_t in_len, const mscomp_xpress_huff_chunk* index, size_t index_len, size_t out_offset, bytes out, size_t* out_len);
+
+// Decompresses using up to nthreads threads (0 for one per processor) with the chunk index of the
+// compressed data. Each thread decompresses a contiguous range of chunks, copies that need data from
+// before the range are done once all of the threads are done. Invalid indices are detected.
+MSCOMPAPI MSCompStatus xpress_huff_decompress_mt(const_bytes in, size_t in_len, bytes out, size_t* out_len, const mscomp_xpress_huff_chunk* index, size_t index_len, unsigned nthreads);
+
+// Compresses in independent chunks of chunk_size bytes (4, 8, 16, 32, or 64 KiB) like WIM resources
+// and Windows system compression (WOF) do. Each chunk is complete compressed data on its own with
+// no matches to other chunks, so chunks can be compressed and decompressed in parallel and any
+// chunk can be decompressed with xpress_huff_decompress without the others. The chunks are written
+// one after the other and sizes gets the compressed size of each one, a chunk that does not get
+// smaller is stored as-is and its size is its length. n_chunks is initially the number of entries
+// in sizes and is set to the number of chunks, (in_len + chunk_size - 1) / chunk_size. Uses up to
+// nthreads threads (0 for one per processor). Returns MSCOMP_ARG_ERROR for other chunk sizes.
+MSCOMPAPI MSCompStatus xpress_huff_compress_chunked(const_bytes in, size_t in_len, bytes out, size_t* out_len, size_t chunk_size, uint32_t* sizes, size_t* n_chunks, unsigned nthreads);
+
+// Decompresses data from xpress_huff_compress_chunked given the chunk size and the sizes of the
+// chunks using up to nthreads threads (0 for one per processor). Unlike the other decompressors
+// out_len must be the exact decompressed length since the size of the last chunk depends on it.
+MSCOMPAPI MSCompStatus xpress_huff_decompress_chunked(const_bytes in, size_t in_len, bytes out, size_t* out_len, size_t chunk_size, const uint32_t* sizes, size_t n_chunks, unsigned nthreads);
 
-//MSCOMPAPI MSCompStatus xpress_huff_deflate_init(mscomp_stream* stream);
-//MSCOMPAPI MSCompStatus xpress_huff_deflate(mscomp_stream* stream, MSCompFlush flush);
-//MSCOMPAPI MSCompStatus xpress_huff_deflate_end(mscomp_stream* stream);
+MSCOMPAPI MSCompStatus xpress_huff_deflate_init(mscomp_stream* stream);
+MSCOMPAPI MSCompStatus xpress_huff_deflate_init_level(mscomp_stream* stream, unsigned level);
+MSCOMPAPI MSCompStatus xpress_huff_deflate(mscomp_stream* stream, MSCompFlush flush);
+MSCOMPAPI MSCompStatus xpress_huff_deflate_end(mscomp_stream* stream);
 
-//MSCOMPAPI MSCompStatus xpress_huff_inflate_init(mscomp_stream* stream);
-//MSCOMPAPI MSCompStatus xpress_huff_inflate(mscomp_stream* stream);
-//MSCOMPAPI MSCompStatus xpress_huff_inflate_end(mscomp_stream* stream);
+MSCOMPAPI MSCompStatus xpress_huff_inflate_init(mscomp_stream* stream);
+MSCOMPAPI MSCompStatus xpress_huff_inflate(mscomp_stream* stream);
+MSCOMPAPI MSCompStatus xpress_huff_inflate_end(mscomp_stream* stream);
 
 EXTERN_C_END
 
@@ -21,6 +21,8 @@
 
 #include "../include/lznt1.h"
 #include "../include/mscomp/LZNT1Dictionary.h"
+#include "../include/mscomp/entropy.h"
+#include "../include/mscomp/ChunkCache.h"
 
 #define CHUNK_SIZE 0x1000 // to be compatible with all known forms of Windows
 
@@ -49,6 +51,7 @@ typedef struct
 FORCE_INLINE static uint_fast16_t lznt1_compress_chunk(const_rest_bytes const in, const uint_fast16_t in_len, rest_bytes const out, const size_t out_len, LZNT1Dictionary* RESTRICT d)
 {
 	uint_fast16_t in_pos = 0, out_pos = 0, rem = in_len, pow2 = 0x10, mask3 = 0x1002, shift = 12;
+	if (UNLIKELY(is_incompressible(in, in_len, 0))) { return in_len; } // not worth searching, will be uncompressed
 #ifdef MSCOMP_WITH_LZNT1_SA_DICT
 	d->Fill(in, in_len);
 #else
@@ -229,17 +232,35 @@ MSCompStatus lznt1_deflate_end(mscomp_stream* RESTRICT stream)
 
 	return status;
 }
-#ifdef MSCOMP_WITH_OPT_COMPRESS
-ENTRY_POINT MSCompStatus lznt1_compress(const_rest_bytes in, size_t in_len, rest_bytes out, size_t* RESTRICT _out_len)
+static MSCompStatus lznt1_compress_all(const_rest_bytes in, size_t in_len, rest_bytes out, size_t* RESTRICT _out_len, mscomp_chunk_cache* cache)
 {
+	// Compresses everything at once, if cache is not NULL chunks are copied from it when possible
 	const size_t out_len = *_out_len;
 	size_t out_pos = 0, in_pos = 0;
 	LZNT1Dictionary d; // requires 512-768 KB of stack space   or   ~24kb of stack space (+ up to ~17kb during Fill())
 
 	while (out_pos < out_len-1 && in_pos < in_len)
 	{
-		// Compress the next chunk
 		const uint_fast16_t in_size = (uint_fast16_t)MIN(in_len-in_pos, 0x1000);
+
+		// Copy the chunk from the cache (the chunk header is cached as well)
+		uint64_t key = 0;
+		if (cache)
+		{
+			size_t cached_len;
+			key = mscomp_chunk_cache::Hash(CHUNK_CACHE_LZNT1, in+in_pos, in_size);
+			const const_bytes cached = cache->Find(CHUNK_CACHE_LZNT1, key, in+in_pos, in_size, 0, &cached_len);
+			if (cached)
+			{
+				if (UNLIKELY(out_pos+cached_len > out_len)) { return MSCOMP_BUF_ERROR; }
+				memcpy(out+out_pos, cached, cached_len);
+				out_pos += cached_len;
+				in_pos  += in_size;
+				continue;
+			}
+		}
+
+		// Compress the next chunk
 		uint_fast16_t out_size = lznt1_compress_chunk(in+in_pos, in_size, out+out_pos+2, out_len-out_pos-2, &d), flags;
 		RETURN_IF_NOT_SA_DICT_AND_OUT_ZERO(MSCOMP_MEM_ERROR);
 		if (out_size < in_size) // chunk is compressed
@@ -258,6 +279,9 @@ ENTRY_POINT MSCompStatus lznt1_compress(const_rest_bytes in, size_t in_len, rest
 		const uint16_t header = (uint16_t)(flags | (out_size-1));
 		SET_UINT16(out+out_pos, header);
 
+		// Add the chunk to the cache unless the output buffer may have been too small to compress it
+		if (cache && out_len-out_pos-2 >= in_size) { cache->Add(CHUNK_CACHE_LZNT1, key, in+in_pos, in_size, 0, out+out_pos, out_size+2); }
+
 		// Increment positions
 		out_pos += out_size+2;
 		in_pos  += in_size;
@@ -271,6 +295,15 @@ ENTRY_POINT MSCompStatus lznt1_compress(const_rest_bytes in, size_t in_len, rest
 	*_out_len = out_pos;
 	return MSCOMP_OK;
 }
+ENTRY_POINT MSCompStatus lznt1_compress_cached(const_bytes in, size_t in_len, bytes out, size_t* _out_len, mscomp_chunk_cache* cache)
+{
+	return lznt1_compress_all(in, in_len, out, _out_len, cache);
+}
+#ifdef MSCOMP_WITH_OPT_COMPRESS
+ENTRY_POINT MSCompStatus lznt1_compress(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	return lznt1_compress_all(in, in_len, out, _out_len, NULL);
+}
 #else
 ALL_AT_ONCE_WRAPPER_COMPRESS(lznt1)
 #endif
@@ -34,10 +34,17 @@ typedef struct
 
 
 /////////////////// Decompression Functions ///////////////////////////////////
+// When Padded is true the output has MSCOMP_DECOMPRESS_PADDING writable bytes after out_end so the
+// fast loop runs all the way to out_end. It only checks the output once per fragment so the 8
+// symbols of the last fragment may each write up to FAST_COPY_ROOM bytes into the padding.
+#if MSCOMP_DECOMPRESS_PADDING < 9*FAST_COPY_ROOM
+	#error MSCOMP_DECOMPRESS_PADDING is too small for the padded LZNT1 decompressor
+#endif
+template <bool Padded>
 static MSCompStatus lznt1_decompress_chunk(const_rest_bytes in, const const_bytes in_end, rest_bytes out, const const_bytes out_end, size_t* RESTRICT _out_len)
 {
 	const const_bytes                  in_endx  = in_end -0x11; // 1 + 8 * 2 from the end
-	const const_bytes out_start = out, out_endx = out_end-8*FAST_COPY_ROOM;
+	const const_bytes out_start = out, out_endx = Padded ? out_end : out_end-8*FAST_COPY_ROOM;
 	byte flags, flagged;
 
 	uint_fast16_t pow2 = 0x10, mask = 0xFFF, shift = 12;
@@ -72,6 +79,7 @@ static MSCompStatus lznt1_decompress_chunk(const_rest_bytes in, const const_byte
 			flags >>= 1;
 		} while (LIKELY(flags));
 	}
+	if (Padded && UNLIKELY(out > out_end)) { return (size_t)(out - out_start) > CHUNK_SIZE ? MSCOMP_DATA_ERROR : MSCOMP_BUF_ERROR; }
 
 	// Slower decompression but with full bounds checking
 	while (LIKELY(in < in_end))
@@ -108,7 +116,7 @@ static MSCompStatus lznt1_decompress_chunk(const_rest_bytes in, const const_byte
 CHECKED_COPY:		for (end = out + len; out < end; ++out) { *out = *(out-off); }
 				}
 			}
-			//else if (out == out_end) { printf("D %p %p %zu\n", out, out_end, out_end-out_start); return MSCOMP_BUF_ERROR; }
+			else if (UNLIKELY(out == out_end)) { return (size_t)(out - out_start) >= CHUNK_SIZE ? MSCOMP_DATA_ERROR : MSCOMP_BUF_ERROR; }
 			else { *out++ = *in++; } // Copy byte directly
 			flagged = flags & 0x01;
 			flags >>= 1;
@@ -156,7 +164,7 @@ MSCompStatus lznt1_decompress_chunk_read(mscomp_stream* RESTRICT const stream, c
 		{
 			// buffer decompression
 			size_t out_size;
-			MSCompStatus status = lznt1_decompress_chunk(in+2, in+in_size, state->out, state->out+CHUNK_SIZE, &out_size);
+			MSCompStatus status = lznt1_decompress_chunk<false>(in+2, in+in_size, state->out, state->out+CHUNK_SIZE, &out_size);
 			if (UNLIKELY(status != MSCOMP_OK))
 			{
 #ifdef MSCOMP_WITH_ERROR_MESSAGES
@@ -174,7 +182,7 @@ MSCompStatus lznt1_decompress_chunk_read(mscomp_stream* RESTRICT const stream, c
 		{
 			// direct decompress
 			size_t out_size;
-			MSCompStatus status = lznt1_decompress_chunk(in+2, in+in_size, stream->out, stream->out+CHUNK_SIZE, &out_size);
+			MSCompStatus status = lznt1_decompress_chunk<false>(in+2, in+in_size, stream->out, stream->out+CHUNK_SIZE, &out_size);
 			if (UNLIKELY(status != MSCOMP_OK))
 			{
 #ifdef MSCOMP_WITH_ERROR_MESSAGES
@@ -289,6 +297,44 @@ MSCompStatus lznt1_inflate_end(mscomp_stream* RESTRICT stream)
 
 	return status;
 }
+#ifdef MSCOMP_WITH_OPT_DECOMPRESS
+// Decompresses every chunk directly into the output, which has MSCOMP_DECOMPRESS_PADDING writable
+// bytes after its end, instead of going through the stream. Gives the same results as
+// lznt1_decompress except that invalid data may give MSCOMP_BUF_ERROR if the output is too small.
+ENTRY_POINT MSCompStatus lznt1_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	const const_bytes                  in_end  = in  + in_len;
+	const const_bytes out_start = out, out_end = out + *_out_len;
+	while (in_end - in >= 2)
+	{
+		// Read chunk header (see lznt1_decompress_chunk_read)
+		const uint16_t header = GET_UINT16(in);
+		if (UNLIKELY(header == 0)) { if (UNLIKELY(in_end - in != 2)) { return MSCOMP_DATA_ERROR; } in = in_end; break; }
+		const size_t in_size = (header & 0x0FFF)+3; // +3 includes +2 for header
+		if (UNLIKELY(in_size > (size_t)(in_end - in))) { return MSCOMP_BUF_ERROR; } // the stream would wait for more input
+		if (UNLIKELY((header & 0x7000) != 0x3000)) { return MSCOMP_DATA_ERROR; }
+		size_t out_size;
+		if (header & 0x8000) // read compressed chunk
+		{
+			const MSCompStatus status = lznt1_decompress_chunk<true>(in+2, in+in_size, out, out + MIN((size_t)(out_end - out), CHUNK_SIZE), &out_size);
+			if (UNLIKELY(status != MSCOMP_OK)) { return status; }
+		}
+		else // read uncompressed chunk
+		{
+			out_size = in_size-2;
+			if (UNLIKELY(out_size > (size_t)(out_end - out))) { return MSCOMP_BUF_ERROR; }
+			memcpy(out, in+2, out_size);
+		}
+		out += out_size;
+		in += in_size;
+	}
+	if (UNLIKELY(in != in_end && *in != 0)) { return MSCOMP_BUF_ERROR; } // a single byte left is only allowed to be part of an end-of-stream
+	*_out_len = out - out_start;
+	return MSCOMP_OK;
+}
+#else
+ENTRY_POINT MSCompStatus lznt1_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* _out_len) { return lznt1_decompress(in, in_len, out, _out_len); }
+#endif
 #ifdef NOT_OPTIMAL___MSCOMP_WITH_OPT_DECOMPRESS // NOTE: the "optimized" version is actually slower!
 ENTRY_POINT MSCompStatus lznt1_decompress(const_rest_bytes in, size_t in_len, rest_bytes out, size_t* RESTRICT _out_len)
 {
@@ -315,7 +361,7 @@ ENTRY_POINT MSCompStatus lznt1_decompress(const_rest_bytes in, size_t in_len, re
 		size_t out_size;
 		if (header & 0x8000) // read compressed chunk
 		{
-			MSCompStatus err = lznt1_decompress_chunk(in, in+in_size, out, out_end, &out_size);
+			MSCompStatus err = lznt1_decompress_chunk<false>(in, in+in_size, out, out_end, &out_size);
 			if (err != MSCOMP_OK) { return err; }
 		}
 		else // read uncompressed chunk
@@ -21,6 +21,7 @@
 #include "../include/lznt1.h"
 #include "../include/xpress.h"
 #include "../include/xpress_huff.h"
+#include "../include/mscomp/ChunkCache.h"
 
 // First we give some simple no-compression 'compression' functions
 MSCompStatus copy(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
@@ -60,6 +61,30 @@ MSCompStatus copy_inflate(mscomp_stream* stream)
 }
 MSCompStatus copy_xxflate_end(mscomp_stream* stream) { CHECK_STREAM(stream, true, MSCOMP_NONE); return MSCOMP_OK; }
 
+// Formats without compression levels check the level and then ignore it
+MSCompStatus copy_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len, unsigned level)
+{
+	if (level > MSCOMP_LEVEL_MAX) { return MSCOMP_ARG_ERROR; }
+	return copy(in, in_len, out, _out_len);
+}
+MSCompStatus copy_deflate_init_level(mscomp_stream* stream, unsigned level)
+{
+	if (level > MSCOMP_LEVEL_MAX) { SET_ERROR(stream, "Error: Invalid level"); return MSCOMP_ARG_ERROR; }
+	return copy_xxflate_init(stream);
+}
+#ifdef MSCOMP_WITH_LZNT1
+MSCompStatus lznt1_compress_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len, unsigned level)
+{
+	if (level > MSCOMP_LEVEL_MAX) { return MSCOMP_ARG_ERROR; }
+	return lznt1_compress(in, in_len, out, _out_len);
+}
+MSCompStatus lznt1_deflate_init_level(mscomp_stream* stream, unsigned level)
+{
+	if (level > MSCOMP_LEVEL_MAX) { SET_ERROR(stream, "Error: Invalid level"); return MSCOMP_ARG_ERROR; }
+	return lznt1_deflate_init(stream);
+}
+#endif
+
 
 
 // Standard Compression and Decompression Functions
@@ -116,6 +141,55 @@ MSCOMPAPI MSCompStatus ms_compress(MSCompFormat format, const_bytes in, size_t i
 	return compressors[format](in, in_len, out, out_len);
 }
 
+typedef MSCompStatus (*compress_level_func)(const_bytes in, size_t in_len, bytes out, size_t* out_len, unsigned level);
+
+static compress_level_func level_compressors[] =
+{
+	copy_level,
+	NULL,
+	IF_WITH_LZNT1(lznt1_compress_level),
+	IF_WITH_XPRESS(xpress_compress_level),
+	IF_WITH_XPRESS_HUFF(xpress_huff_compress_level),
+};
+
+MSCOMPAPI MSCompStatus ms_compress_level(MSCompFormat format, unsigned level, const_bytes in, size_t in_len, bytes out, size_t* out_len)
+{
+	if ((unsigned)format >= ARRAYSIZE(level_compressors) || !level_compressors[format]) { return MSCOMP_ARG_ERROR; }
+	return level_compressors[format](in, in_len, out, out_len, level);
+}
+
+typedef MSCompStatus (*compress_cached_func)(const_bytes in, size_t in_len, bytes out, size_t* out_len, mscomp_chunk_cache* cache);
+
+static compress_cached_func cached_compressors[] =
+{
+	NULL,
+	NULL,
+	IF_WITH_LZNT1(lznt1_compress_cached),
+	NULL,
+	IF_WITH_XPRESS_HUFF(xpress_huff_compress_cached),
+};
+
+MSCOMPAPI MSCompStatus ms_compress_cached(MSCompFormat format, const_bytes in, size_t in_len, bytes out, size_t* out_len, mscomp_chunk_cache* cache)
+{
+	if ((unsigned)format >= ARRAYSIZE(cached_compressors) || !cached_compressors[format] || !cache) { return MSCOMP_ARG_ERROR; }
+	return cached_compressors[format](in, in_len, out, out_len, cache);
+}
+
+MSCOMPAPI mscomp_chunk_cache* ms_chunk_cache_create(size_t max_size)
+{
+	mscomp_chunk_cache* cache = (mscomp_chunk_cache*)malloc(sizeof(mscomp_chunk_cache));
+	if (cache && UNLIKELY(!cache->Init(max_size))) { free(cache); return NULL; }
+	return cache;
+}
+MSCOMPAPI void ms_chunk_cache_free(mscomp_chunk_cache* cache)
+{
+	if (cache) { cache->Destroy(); free(cache); }
+}
+MSCOMPAPI void ms_chunk_cache_stats(const mscomp_chunk_cache* cache, uint64_t* hits, uint64_t* misses)
+{
+	if (cache) { cache->Stats(hits, misses); }
+}
+
 static compress_func decompressors[] =
 {
 	copy,
@@ -131,10 +205,27 @@ MSCOMPAPI MSCompStatus ms_decompress(MSCompFormat format, const_bytes in, size_t
 	return decompressors[format](in, in_len, out, out_len);
 }
 
+static compress_func padded_decompressors[] =
+{
+	copy,
+	NULL,
+	IF_WITH_LZNT1(lznt1_decompress_padded),
+	IF_WITH_XPRESS(xpress_decompress_padded),
+	IF_WITH_XPRESS_HUFF(xpress_huff_decompress_padded),
+};
+
+MSCOMPAPI MSCompStatus ms_decompress_padded(MSCompFormat format, const_bytes in, size_t in_len, bytes out, size_t* out_len)
+{
+	// formats without a padded decompressor are decompressed normally
+	if ((unsigned)format < ARRAYSIZE(padded_decompressors) && padded_decompressors[format]) { return padded_decompressors[format](in, in_len, out, out_len); }
+	return ms_decompress(format, in, in_len, out, out_len);
+}
+
 // Streaming Compression and Decompression Functions
 
 typedef MSCompStatus (*stream_func)(mscomp_stream* stream);
 typedef MSCompStatus (*stream_flush_func)(mscomp_stream* stream, MSCompFlush flush);
+typedef MSCompStatus (*stream_level_func)(mscomp_stream* stream, unsigned level);
 
 static stream_func deflaters_init[] =
 {
@@ -142,7 +233,16 @@ static stream_func deflaters_init[] =
 	NULL,
 	IF_WITH_LZNT1(lznt1_deflate_init),
 	IF_WITH_XPRESS(xpress_deflate_init),
-	// TODO: IF_WITH_XPRESS_HUFF(xpress_huff_deflate_init),
+	IF_WITH_XPRESS_HUFF(xpress_huff_deflate_init),
+};
+
+static stream_level_func deflaters_init_level[] =
+{
+	copy_deflate_init_level,
+	NULL,
+	IF_WITH_LZNT1(lznt1_deflate_init_level),
+	IF_WITH_XPRESS(xpress_deflate_init_level),
+	IF_WITH_XPRESS_HUFF(xpress_huff_deflate_init_level),
 };
 
 static stream_flush_func deflaters[] =
@@ -151,7 +251,7 @@ static stream_flush_func deflaters[] =
 	NULL,
 	IF_WITH_LZNT1(lznt1_deflate),
 	IF_WITH_XPRESS(xpress_deflate),
-	// TODO: IF_WITH_XPRESS_HUFF(xpress_huff_deflate),
+	IF_WITH_XPRESS_HUFF(xpress_huff_deflate),
 };
 
 static stream_func deflaters_end[] =
@@ -160,7 +260,7 @@ static stream_func deflaters_end[] =
 	NULL,
 	IF_WITH_LZNT1(lznt1_deflate_end),
 	IF_WITH_XPRESS(xpress_deflate_end),
-	// TODO: IF_WITH_XPRESS_HUFF(xpress_huff_deflate_end),
+	IF_WITH_XPRESS_HUFF(xpress_huff_deflate_end),
 };
 
 MSCompStatus ms_deflate_init(MSCompFormat format, mscomp_stream* stream)
@@ -168,6 +268,11 @@ MSCompStatus ms_deflate_init(MSCompFormat format, mscomp_stream* stream)
 	if ((unsigned)format >= ARRAYSIZE(deflaters_init) || !deflaters_init[format]) { SET_ERROR(stream, "Error: Invalid format provided"); return MSCOMP_ARG_ERROR; }
 	return deflaters_init[format](stream);
 }
+MSCompStatus ms_deflate_init_level(MSCompFormat format, unsigned level, mscomp_stream* stream)
+{
+	if ((unsigned)format >= ARRAYSIZE(deflaters_init_level) || !deflaters_init_level[format]) { SET_ERROR(stream, "Error: Invalid format provided"); return MSCOMP_ARG_ERROR; }
+	return deflaters_init_level[format](stream, level);
+}
 MSCompStatus ms_deflate(mscomp_stream* stream, MSCompFlush flush)
 {
 	if (stream == NULL || (unsigned)stream->format >= ARRAYSIZE(deflaters) || !deflaters[stream->format]) { SET_ERROR(stream, "Error: Invalid stream provided"); return MSCOMP_ARG_ERROR; }
@@ -185,7 +290,7 @@ static stream_func inflaters_init[] =
 	NULL,
 	IF_WITH_LZNT1(lznt1_inflate_init),
 	IF_WITH_XPRESS(xpress_inflate_init),
-	// TODO: IF_WITH_XPRESS_HUFF(xpress_huff_inflate_init),
+	IF_WITH_XPRESS_HUFF(xpress_huff_inflate_init),
 };
 
 static stream_func inflaters[] =
@@ -194,7 +299,7 @@ static stream_func inflaters[] =
 	NULL,
 	IF_WITH_LZNT1(lznt1_inflate),
 	IF_WITH_XPRESS(xpress_inflate),
-	// TODO: IF_WITH_XPRESS_HUFF(xpress_huff_inflate),
+	IF_WITH_XPRESS_HUFF(xpress_huff_inflate),
 };
 
 static stream_func inflaters_end[] =
@@ -203,7 +308,7 @@ static stream_func inflaters_end[] =
 	NULL,
 	IF_WITH_LZNT1(lznt1_inflate_end),
 	IF_WITH_XPRESS(xpress_inflate_end),
-	// TODO: IF_WITH_XPRESS_HUFF(xpress_huff_inflate_end),
+	IF_WITH_XPRESS_HUFF(xpress_huff_inflate_end),
 };
 
 MSCompStatus ms_inflate_init(MSCompFormat format, mscomp_stream* stream)
@@ -21,12 +21,11 @@
 
 #include "../include/xpress.h"
 #include "../include/mscomp/XpressDictionary.h"
+#include "../include/mscomp/entropy.h"
 
 
 #define MIN_DATA	5
 
-typedef XpressDictionary<0x2000> Dictionary;
-
 size_t xpress_max_compressed_size(size_t in_len) { return in_len + 4 + 4 * (in_len / 32); }
 
 typedef struct
@@ -236,13 +235,22 @@ MSCompStatus xpress_deflate_end(mscomp_stream* stream)
 	return status;
 }
 
+MSCompStatus xpress_deflate_init_level(mscomp_stream* stream, unsigned level)
+{
+	if (UNLIKELY(level > MSCOMP_LEVEL_MAX)) { SET_ERROR(stream, "XPRESS Compression Error: Invalid level"); return MSCOMP_ARG_ERROR; }
+	return xpress_deflate_init(stream);
+}
+
 #ifdef MSCOMP_WITH_OPT_COMPRESS
-ENTRY_POINT MSCompStatus xpress_compress(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+template <unsigned Level>
+static MSCompStatus xpress_compress_at_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
 {
+	typedef typename XpressLevelDictionary<0x2000, 0x2000, Level>::Type Dictionary;
+
 	const size_t out_len = *_out_len;
 	const const_bytes                  in_end  = in +in_len,  in_end2  = in_end  - 2;
 	const const_bytes out_start = out, out_end = out+out_len, out_end1 = out_end - 1;
-	const_bytes filled_to = in;
+	const_bytes filled_to = in, literals_to = in; // literals_to is the end of data that looks incompressible
 
 	uint32_t flags = 0, *out_flags = (uint32_t*)out;
 	byte flag_count;
@@ -266,9 +274,14 @@ ENTRY_POINT MSCompStatus xpress_compress(const_bytes in, size_t in_len, bytes ou
 	while (in < in_end2 && out < out_end1)
 	{
 		uint32_t len, off;
-		if (filled_to <= in) { filled_to = d.Fill(filled_to); }
+		if (filled_to <= in)
+		{
+			const const_bytes start = filled_to;
+			filled_to = d.Fill(filled_to);
+			if (Dictionary::SkipIncompressible && UNLIKELY(is_incompressible(start, filled_to - start, MIN(start - d.Start(), 0x2000)))) { literals_to = filled_to; } // not worth searching
+		}
 		flags <<= 1;
-		if ((len = d.Find(in, &off)) < 3) { *out++ = *in++; } // Copy byte
+		if (in < literals_to || (len = d.Find(in, &off)) < 3) { *out++ = *in++; } // Copy byte
 		else // Match found
 		{
 			in += len;
@@ -345,8 +358,21 @@ ENTRY_POINT MSCompStatus xpress_compress(const_bytes in, size_t in_len, bytes ou
 	*_out_len = out - out_start;
 	return MSCOMP_OK;
 }
+ENTRY_POINT MSCompStatus xpress_compress(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	return xpress_compress_at_level<XPRESS_DICTIONARY_DEFAULT_LEVEL>(in, in_len, out, _out_len);
+}
+ENTRY_POINT MSCompStatus xpress_compress_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len, unsigned level)
+{
+	XPRESS_DICTIONARY_LEVEL_SWITCH(level, xpress_compress_at_level, (in, in_len, out, _out_len))
+}
 #else
 ALL_AT_ONCE_WRAPPER_COMPRESS(xpress)
+ENTRY_POINT MSCompStatus xpress_compress_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len, unsigned level)
+{
+	if (UNLIKELY(level > MSCOMP_LEVEL_MAX)) { return MSCOMP_ARG_ERROR; }
+	return xpress_compress(in, in_len, out, _out_len); // the stream compressor does not support levels
+}
 #endif
 
 #endif
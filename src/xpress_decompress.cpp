@@ -402,11 +402,15 @@ MSCompStatus xpress_inflate_end(mscomp_stream* stream)
 	return status;
 }
 #ifdef MSCOMP_WITH_OPT_DECOMPRESS
-ENTRY_POINT MSCompStatus xpress_decompress(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+// When Padded is true the output has MSCOMP_DECOMPRESS_PADDING (>= OUT_NEAR_END) writable bytes
+// after out_end so the fast loop runs all the way to out_end. The input margin is kept since the
+// end of the stream can only be found with the checks in the slow loop.
+template <bool Padded>
+static MSCompStatus xpress_decompress_all(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
 {
 	const size_t out_len = *_out_len;
 	const const_bytes                  in_end  = in +in_len,  in_endx  = in_end -IN_NEAR_END;
-	const const_bytes out_start = out, out_end = out+out_len, out_endx = out_end-OUT_NEAR_END;
+	const const_bytes out_start = out, out_end = out+out_len, out_endx = Padded ? out_end : out_end-OUT_NEAR_END;
 	const_byte* half_byte = NULL;
 	uint32_t flags, flagged, len;
 	uint_fast16_t off;
@@ -420,6 +424,7 @@ ENTRY_POINT MSCompStatus xpress_decompress(const_bytes in, size_t in_len, bytes
 	INFLATE_FAST(DO_NOTHING, goto CHECKED_LENGTH,
 		if (UNLIKELY(out + len > out_end)) { return MSCOMP_BUF_ERROR; }
 		goto CHECKED_COPY);
+	if (Padded && UNLIKELY(out > out_end)) { return MSCOMP_BUF_ERROR; }
 
 	// Slower decompression but with full bounds checking
 	while (LIKELY(in + 4 <= in_end))
@@ -460,8 +465,11 @@ CHECKED_COPY:		for (end = out + len; out < end; ++out) { *out = *(out-off); }
 	}
 	return MSCOMP_DATA_ERROR;
 }
+ENTRY_POINT MSCompStatus xpress_decompress(const_bytes in, size_t in_len, bytes out, size_t* _out_len) { return xpress_decompress_all<false>(in, in_len, out, _out_len); }
+ENTRY_POINT MSCompStatus xpress_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* _out_len) { return xpress_decompress_all<true>(in, in_len, out, _out_len); }
 #else
 ALL_AT_ONCE_WRAPPER_DECOMPRESS(xpress)
+ENTRY_POINT MSCompStatus xpress_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* _out_len) { return xpress_decompress(in, in_len, out, _out_len); }
 #endif
 
 #endif
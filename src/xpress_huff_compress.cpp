@@ -23,6 +23,9 @@
 #include "../include/mscomp/XpressDictionary.h"
 #include "../include/mscomp/Bitstream.h"
 #include "../include/mscomp/HuffmanEncoder.h"
+#include "../include/mscomp/entropy.h"
+#include "../include/mscomp/Threads.h"
+#include "../include/mscomp/ChunkCache.h"
 
 #define PRINT_ERROR(...) // TODO: remove
 
@@ -40,294 +43,1074 @@
 
 #define MIN_DATA		HALF_SYMBOLS + 4 // the 512 Huffman lens + 2 uint16s for minimal bitstream
 
-typedef XpressDictionary<MAX_OFFSET, CHUNK_SIZE> Dictionary;
+typedef XpressLevelDictionary<MAX_OFFSET, CHUNK_SIZE, XPRESS_DICTIONARY_DEFAULT_LEVEL>::Type Dictionary;
 typedef HuffmanEncoder<HUFF_BITS_MAX, SYMBOLS> Encoder;
 
+// The number of bytes after a chunk that need to be available before the chunk is compressed when
+// streaming, at least the NiceLength of the dictionary so that the matches found near the end of the
+// chunk are not shortened by missing data (this is less than the NiceLength of levels 7 and 8).
+// Streaming output is not the same as compressing all of the data at once: matches are cut at the
+// end of each chunk instead of spanning the chunks after it (see SPAN_CHUNKS_MAX), since those would
+// need far more than the lookahead to be buffered.
+#define LOOKAHEAD		0x100
+
+// A match that goes past the end of a chunk can continue into the following chunks, in which case
+// the next chunk starts where it ends. Those matches are only made when they cover whole chunks so
+// that every chunk still starts at a multiple of CHUNK_SIZE, which keeps the chunks independent of
+// the matches before them (needed by xpress_huff_compress_mt).
+#define SPAN_CHUNKS_MAX	0x7FFE // the most whole chunks covered by a match (keeps the lengths in an int32)
+// Gets the length to use for a match of length len that goes past the end of a chunk with rem bytes
+// left: the end of the last whole chunk it covers or the end of the chunk if there are none
+static FORCE_INLINE uint32_t xh_span_len(const uint32_t len, const uint32_t rem) { return rem + MIN((len - rem) / CHUNK_SIZE, SPAN_CHUNKS_MAX) * CHUNK_SIZE; }
+
+// The LZ77 compressed data of a chunk is kept as separate arrays so that the Huffman encoder can
+// stream through them and the compressed size can be calculated without going through them again:
+//   Symbols: a uint16 for each literal (0x00-0xFF) and match (0x100-0x1FF) including the end of
+//            stream symbol, in order
+//   Offsets: a uint16 for each match without the highest set bit (0 for the end of stream)
+//   Lengths: a uint32 for each match whose symbol has a length of 0xF, the length-3
+// The length of a match is written as extra bytes when its symbol has a length of 0xF:
+//     0x000F <= length-3 <  0x0000010E  length-3-0xF as byte
+//     0x010E <= length-3 <= 0x0000FFFF  0xFF + length-3 as uint16
+//     0xFFFF <  length-3 <= 0xFFFFFFFF  0xFF + 0x0000 + length-3 as uint32
+typedef struct
+{ // ~186 kb
+	uint16_t syms[CHUNK_SIZE + 1];		// every byte can be a literal, plus the end of stream
+	uint16_t offs[CHUNK_SIZE / 3 + 2];	// every match has at least 3 bytes, plus the end of stream and one extra for the encoder
+	uint32_t lens[CHUNK_SIZE / 18 + 1];	// every match with a length of at least 18
+	uint32_t n_syms;
+	uint32_t extra_bytes;				// the number of extra length bytes of all matches
+} xh_tokens;
+
+typedef struct
+{ // ~446 kb (+padding), followed by the dictionary for the level
+	bool finished, end_written;
+	unsigned level;
+	Encoder encoder;
+	xh_tokens tokens;							// the LZ77 compressed chunk
+	byte in[2*CHUNK_SIZE + LOOKAHEAD];			// the window (the last chunk), the next chunk, and the lookahead
+	size_t in_avail, in_window;
+	bool flushed;								// the last chunk was compressed without its lookahead so may be missing from the dictionary
+	byte out[HALF_SYMBOLS + CHUNK_SIZE + 36];	// a compressed chunk
+	size_t out_pos, out_avail;
+} mscomp_xpress_huff_compress_state;
+template <unsigned Level>
+struct xh_compress_level_state : mscomp_xpress_huff_compress_state
+{
+	typedef typename XpressLevelDictionary<MAX_OFFSET, CHUNK_SIZE, Level>::Type Dict;
+	Dict d;
+};
+
 size_t xpress_huff_max_compressed_size(size_t in_len) { return in_len + 34 + (HALF_SYMBOLS + 2) + (HALF_SYMBOLS + 2) * (in_len / CHUNK_SIZE); }
 
 
 ////////////////////////////// Compression Functions ///////////////////////////////////////////////
-WARNINGS_PUSH()
-WARNINGS_IGNORE_POTENTIAL_UNINIT_VALRIABLE_USED()
-static size_t xh_compress_lz77(const_bytes in, int32_t /* * */ in_len, const_bytes in_end, bytes out, uint32_t symbol_counts[SYMBOLS], Dictionary* d)
+// Writes the tokens of a chunk, kept in local variables while writing
+typedef struct
+{
+	uint16_t* syms;
+	uint16_t* offs;
+	uint32_t* lens;
+	uint32_t extra_bytes;
+} xh_tokens_writer;
+static FORCE_INLINE void xh_tokens_start(xh_tokens_writer* w, xh_tokens* tokens, uint32_t symbol_counts[SYMBOLS])
 {
-	int32_t rem = /* * */ in_len;
-	uint32_t mask;
-	const const_bytes in_orig = in, out_orig = out;
-	uint32_t* mask_out = NULL;
-	byte i;
+	w->syms = tokens->syms; w->offs = tokens->offs; w->lens = tokens->lens; w->extra_bytes = 0;
+	memset(symbol_counts, 0, SYMBOLS*sizeof(uint32_t));
+}
+// Writes a literal and counts its symbol
+static FORCE_INLINE void xh_tokens_write_literal(xh_tokens_writer* w, const byte x, uint32_t symbol_counts[SYMBOLS]) { ++symbol_counts[*w->syms++ = x]; }
+// Writes a match and counts its symbol
+static FORCE_INLINE void xh_tokens_write_match(xh_tokens_writer* w, uint32_t len, uint32_t off, uint32_t symbol_counts[SYMBOLS])
+{
+	len -= 3;
+	const byte off_bits = (byte)log2((uint16_t)(off|1)); // |1 prevents taking the log2 of 0 (undefined) and makes 0 -> 1 which is what we want
+	const uint16_t sym = 0x100 | (off_bits << 4) | (byte)MIN(0xF, len);
+	++symbol_counts[*w->syms++ = sym];
+	*w->offs++ = (uint16_t)(off ^ (1 << off_bits)); // clear highest bit
+	if (len >= 0xF)
+	{
+		*w->lens++ = len;
+		w->extra_bytes += (len < 0xFF + 0xF) ? 1 : ((len <= 0xFFFF) ? 3 : 7);
+	}
+}
+// Finishes the tokens after the last symbol, adding the end of stream symbol if is_end
+static FORCE_INLINE void xh_tokens_finish(xh_tokens_writer* w, xh_tokens* tokens, bool is_end, uint32_t symbol_counts[SYMBOLS])
+{
+	if (is_end) { ++symbol_counts[*w->syms++ = STREAM_END]; *w->offs++ = 0; }
+	*w->offs = 0; // the encoder reads one offset past the last match
+	tokens->n_syms = (uint32_t)(w->syms - tokens->syms);
+	tokens->extra_bytes = w->extra_bytes;
+}
 
+template <class Dict>
+static void xh_compress_lz77(const_bytes in, int32_t* in_len, bool is_end, bool span, xh_tokens* tokens, uint32_t symbol_counts[SYMBOLS], Dict* d)
+{
+	// If span is true the last match can go past the end of the chunk (see xh_span_len) and in_len
+	// is increased to include the bytes it covers
+	int32_t rem = *in_len;
+	xh_tokens_writer w;
+	xh_tokens_start(&w, tokens, symbol_counts);
 	d->Fill(in);
-	memset(symbol_counts, 0, SYMBOLS*sizeof(uint32_t));
 
 	////////// Count the symbols and write the initial LZ77 compressed data //////////
-	// A uint32 mask holds the status of each subsequent byte (0 for literal, 1 for match)
-	// Literals are stored using a single byte for their value
-	// Matches are stored in the following manner:
-	//   Symbol: a byte (doesn't include the 0x100)
-	//   Offset: a uint16 (doesn't include the highest set bit)
-	//   Length: for length-3:
-	//     0x0000 <= length <  0x0000000F  nothing (contained in symbol)
-	//     0x000F <= length <  0x0000010E  length-3-0xF as byte
-	//     0x010E <= length <= 0x0000FFFF  0xFF + length-3 as uint16
-	//     0xFFFF <  length <= 0xFFFFFFFF  0xFF + 0x0000 + length-3 as uint32
-	// The number of bytes between uint32 masks is >=32 and <=192 (6*32)
-	//   with the exception that the a length > 0x10002 could be found, but this is longer than a chunk and would immediately end the chunk
-	//   if it is the last one, then we need 4 additional bytes, but we don't have to take it into account in any other way
-	// The number of represented bytes between uint32 masks is at least the number of actual bytes between them
 	while (rem > 0)
 	{
-		mask = 0;
-		mask_out = (uint32_t*)out;
-		out += 4;
-
-		// Go through each bit
-		for (i = 0; i < 32 && rem > 0; ++i)
+		uint32_t len, off;
+		if (rem >= 3 && (len = d->Find(in, &off)) >= 3)
 		{
-			uint32_t len, off;
-			mask >>= 1;
-			//d->Add(in);
-			if (rem >= 3 && (len = d->Find(in, &off)) >= 3)
-			{
-				// TODO: allow len > rem (chunk-spanning matches)
-				if (len > (uint32_t)rem) { len = rem; }
-				in += len; rem -= len;
-				
-				//d->Add(in + 1, len - 1);
-
-				// Create the symbol
-				len -= 3;
-				mask |= 0x80000000; // set the highest bit
-				const byte off_bits = (byte)log2((uint16_t)(off|1)); // |1 prevents taking the log2 of 0 (undefined) and makes 0 -> 1 which is what we want
-				const byte sym = (off_bits << 4) | (byte)MIN(0xF, len);
-				++symbol_counts[0x100 | sym];
-				off ^= 1 << off_bits; // clear highest bit
-
-				// Write symbol / offset / length
-				*out = sym; SET_UINT16_RAW(out+1, off); out += 3;
-				if (UNLIKELY(len > 0xFFFF)) { *out = 0xFF; SET_UINT16_RAW(out+1, 0); SET_UINT32_RAW(out+3, len); out += 7; }
-				else if (len >= 0xFF + 0xF) { *out = 0xFF; SET_UINT16_RAW(out+1, len); out += 3; }
-				else if (len >= 0xF)        { *out++ = (byte)(len - 0xF); }
-			}
-			else
-			{
-				// Write the literal value (which is the symbol)
-				++symbol_counts[*out++ = *in++];
-				--rem;
-			}
+			if (len > (uint32_t)rem) { len = span ? xh_span_len(len, rem) : rem; }
+			in += len; rem -= len;
+			xh_tokens_write_match(&w, len, off, symbol_counts);
+		}
+		else
+		{
+			xh_tokens_write_literal(&w, *in++, symbol_counts);
+			--rem;
 		}
-
-		// Save mask
-		SET_UINT32_RAW(mask_out, mask);
 	}
-	
+
 	// Set the total number of bytes read from in
-	/* *in_len -= rem; */
-	mask >>= (32-i); // finish moving the value over
-	if (in_orig+ /* * */ in_len == in_end)
+	*in_len -= rem;
+	xh_tokens_finish(&w, tokens, is_end, symbol_counts);
+}
+////////// Near-Optimal Parsing //////////
+// Instead of taking the longest match at each position, the symbols of a chunk are chosen by
+// finding the cheapest path through the chunk where each literal and match costs its number of
+// bits. The bit costs come from the Huffman code lengths of the previous chunk. The path is then
+// found a second time using the code lengths that the symbols of the first path would get.
+// A match that continues past the chunk (see xh_span_len) can only start at one position since the
+// positions covered by a long match are not searched. It is priced as if it saved the header of
+// each chunk it covers.
+#define OPT_MAX_MATCHES	8 // the most matches kept at each position
+#define OPT_UNUSED_LEN	HUFF_BITS_MAX // the cost of a symbol that has no code yet
+#define OPT_FIRST_LEN	8 // the code length of every symbol for pricing the first chunk
+typedef XpressDictionary<MAX_OFFSET, CHUNK_SIZE, 15, false, 6> OptDictionary;
+typedef struct
+{ // ~3.6 MB
+	uint32_t match_lens[CHUNK_SIZE][OPT_MAX_MATCHES]; // the matches at each position of the chunk,
+	uint16_t match_offs[CHUNK_SIZE][OPT_MAX_MATCHES]; // the lengths and offsets both increasing
+	byte match_counts[CHUNK_SIZE];
+	uint32_t costs[CHUNK_SIZE+1];	// the cost of the cheapest path to each position, afterwards the position after each on the path
+	uint32_t lens[CHUNK_SIZE+1];	// the length of the last symbol of the cheapest path to each position
+	uint16_t offs[CHUNK_SIZE+1];	// and the offset if it is a match
+	uint32_t span_pos, span_len, span_off; // the match that goes past the end of the chunk, span_len is 0 if there is none
+	bool span;						// if the path ends with that match
+	byte code_lens[SYMBOLS];		// the code lengths of the previous chunk
+} xh_optimal_parse;
+
+static void xh_optimal_init(xh_optimal_parse* opt) { memset(opt->code_lens, OPT_FIRST_LEN, SYMBOLS); }
+
+// Finds the matches at each position of a chunk, if span is true also the match that goes past it
+template <class Dict>
+static void xh_optimal_find_matches(const_bytes in, const uint32_t n, bool span, Dict* d, xh_optimal_parse* opt)
+{
+	uint32_t lens[OPT_MAX_MATCHES], offs[OPT_MAX_MATCHES];
+	d->Fill(in);
+	opt->span_len = 0;
+	for (uint32_t p = 0; p < n; ++p)
 	{
-		// Add the end of stream symbol
-		if (i == 32)
+		const uint32_t rem = n - p;
+		uint32_t count = rem >= 3 ? d->FindAll(in + p, lens, offs, OPT_MAX_MATCHES) : 0;
+
+		// The first match that covers whole chunks past the end of the chunk is the one used for that
+		if (span && count && lens[count-1] >= rem + CHUNK_SIZE)
 		{
-			// Need to add a new mask since the old one is full with just one bit set
-			SET_UINT32_RAW(out, 1);
-			out += 4;
+			uint32_t k = 0;
+			const uint32_t span_len = xh_span_len(lens[count-1], rem);
+			while (xh_span_len(lens[k], rem) != span_len) { ++k; }
+			opt->span_pos = p; opt->span_len = span_len; opt->span_off = offs[k];
 		}
-		else
+
+		// Otherwise matches cannot go past the end of the chunk, the first one that reaches it is cut there
+		for (uint32_t k = 0; k < count; ++k) { if (lens[k] >= rem) { lens[k] = rem; count = k + 1; } }
+		for (uint32_t k = 0; k < count; ++k)
+		{
+			opt->match_lens[p][k] = lens[k];
+			opt->match_offs[p][k] = (uint16_t)offs[k];
+		}
+		opt->match_counts[p] = (byte)count;
+
+		// After a long match the positions it covers are not searched, the match is almost always best
+		if (count && lens[count-1] >= Dict::LevelConfig::NiceLength)
+		{
+			const uint32_t end = p + opt->match_lens[p][count-1];
+			while (++p < end) { opt->match_counts[p] = 0; }
+			--p;
+		}
+	}
+}
+
+// Gets the cost in bits of a match symbol along with its offset bits and extra length bytes
+static FORCE_INLINE uint32_t xh_optimal_match_cost(const uint32_t sym_costs[HALF_SYMBOLS], const uint32_t len, const uint_fast8_t off_bits)
+{
+	const uint32_t l = len - 3;
+	return sym_costs[(off_bits << 4) | MIN(0xF, l)] + off_bits + (l < 0xF ? 0 : (l < 0xFF + 0xF ? 8 : (l <= 0xFFFF ? 24 : 56)));
+}
+
+// Finds the cheapest path through a chunk of length n with the current code lengths, afterwards
+// opt->costs has the position after each position on the path and opt->span is set if the last
+// step is the match that goes past the end of the chunk
+static void xh_optimal_find_path(const_bytes in, const uint32_t n, xh_optimal_parse* opt)
+{
+	uint32_t lit_costs[HALF_SYMBOLS], sym_costs[HALF_SYMBOLS];
+	for (uint_fast16_t i = 0; i < HALF_SYMBOLS; ++i)
+	{
+		lit_costs[i] = opt->code_lens[i] ? opt->code_lens[i] : OPT_UNUSED_LEN;
+		sym_costs[i] = opt->code_lens[HALF_SYMBOLS + i] ? opt->code_lens[HALF_SYMBOLS + i] : OPT_UNUSED_LEN;
+	}
+
+	uint32_t* RESTRICT costs = opt->costs;
+	costs[0] = 0;
+	memset(costs + 1, 0xFF, n * sizeof(uint32_t));
+	for (uint32_t p = 0; p < n; ++p)
+	{
+		const uint32_t c = costs[p];
+
+		// Literal
+		const uint32_t lit = c + lit_costs[in[p]];
+		if (lit < costs[p+1]) { costs[p+1] = lit; opt->lens[p+1] = 1; }
+
+		// Matches, each length uses the match with the smallest offset that is long enough
+		uint32_t len = 3;
+		for (uint_fast8_t k = 0, count = opt->match_counts[p]; k < count; ++k)
 		{
-			// Add to the old mask
-			mask |= 1 << i; // set the highest bit
+			const uint32_t off = opt->match_offs[p][k], max_len = opt->match_lens[p][k];
+			const uint_fast8_t off_bits = (uint_fast8_t)log2((uint16_t)off);
+			for (; len <= max_len; ++len)
+			{
+				const uint32_t cost = c + xh_optimal_match_cost(sym_costs, len, off_bits);
+				if (cost < costs[p+len]) { costs[p+len] = cost; opt->lens[p+len] = len; opt->offs[p+len] = (uint16_t)off; }
+			}
 		}
-		SET_UINT32_RAW(out, 0);
-		out += 3;
-		++symbol_counts[STREAM_END];
 	}
 
-	if (LIKELY(mask_out != NULL))
+	// Use the match that goes past the end if it costs less than ending the chunk here
+	opt->span = false;
+	if (opt->span_len)
 	{
-		SET_UINT32_RAW(mask_out, mask);
+		const uint32_t p = opt->span_pos, len = opt->span_len;
+		const uint64_t chunks = (len - (n - p)) / CHUNK_SIZE;
+		const uint_fast8_t off_bits = (uint_fast8_t)log2((uint16_t)opt->span_off);
+		if ((uint64_t)costs[p] + xh_optimal_match_cost(sym_costs, len, off_bits) < (uint64_t)costs[n] + chunks*HALF_SYMBOLS*8)
+		{
+			opt->span = true;
+			opt->lens[n] = n - p;
+			opt->offs[n] = (uint16_t)opt->span_off;
+		}
 	}
 
-	// Return the number of bytes in the output
-	return out - out_orig;
+	// Follow the path backwards, linking each position on it to the next one
+	for (uint32_t p = n; p; ) { const uint32_t prev = p - opt->lens[p]; costs[prev] = p; p = prev; }
 }
-WARNINGS_POP()
-static size_t xh_compress_no_matching(const_bytes in, size_t in_len, bool is_end, bytes out, uint32_t symbol_counts[SYMBOLS])
+
+// Counts the symbols along the path found by xh_optimal_find_path
+static void xh_optimal_count(const_bytes in, const uint32_t n, const xh_optimal_parse* opt, uint32_t symbol_counts[SYMBOLS])
 {
-	const const_bytes in_end = in + in_len, in_endx = in_end - 32;
-	const const_bytes out_orig = out;
 	memset(symbol_counts, 0, SYMBOLS*sizeof(uint32_t));
-	while (in < in_endx)
+	for (uint32_t p = 0, next; p < n; p = next)
 	{
-		SET_UINT32_RAW(out, 0); out += 4;
-		memcpy(out, in, 32); out += 32;
-		for (uint_fast8_t i = 0; i < 32; ++i) { ++symbol_counts[*in++]; }
+		next = opt->costs[p];
+		const uint32_t len = (next == n && opt->span) ? opt->span_len : next - p;
+		if (len == 1) { ++symbol_counts[in[p]]; continue; }
+		const uint_fast8_t off_bits = (uint_fast8_t)log2(opt->offs[next]);
+		++symbol_counts[0x100 | (off_bits << 4) | MIN(0xF, len - 3)];
 	}
-	const size_t rem = in_end - in; // 1 - 32
-	SET_UINT32_RAW(out, 0); out += 4;
-	memcpy(out, in, rem); out += rem;
-	for (uint_fast8_t i = 0; in < in_end; ++i) { ++symbol_counts[*in++]; }
-	if (is_end)
+}
+
+// The same as xh_compress_lz77 except the symbols are chosen by a near-optimal parse
+template <class Dict>
+static void xh_compress_lz77_optimal(const_bytes in, int32_t* in_len, bool is_end, bool span, xh_tokens* tokens, uint32_t symbol_counts[SYMBOLS], Dict* d, Encoder* encoder, xh_optimal_parse* opt)
+{
+	const uint32_t n = (uint32_t)*in_len;
+
+	// Find the path with the previous code lengths then again with the code lengths of that path
+	xh_optimal_find_matches(in, n, span, d, opt);
+	xh_optimal_find_path(in, n, opt);
+	xh_optimal_count(in, n, opt, symbol_counts);
+	memcpy(opt->code_lens, encoder->CreateCodes(symbol_counts), SYMBOLS);
+	xh_optimal_find_path(in, n, opt);
+
+	// Write the path
+	xh_tokens_writer w;
+	xh_tokens_start(&w, tokens, symbol_counts);
+	for (uint32_t p = 0, next; p < n; p = next)
 	{
-		// Add the end of stream symbol
-		if (rem == 32) { SET_UINT32_RAW(out, 1); out += 4; }
-		else { const uint32_t mask = 1 << rem; SET_UINT32_RAW(out - rem - 4, mask); }
-		SET_UINT32_RAW(out, 0);
-		out += 3;
-		++symbol_counts[STREAM_END];
+		next = opt->costs[p];
+		if (next - p == 1) { xh_tokens_write_literal(&w, in[p], symbol_counts); }
+		else
+		{
+			const uint32_t len = (next == n && opt->span) ? opt->span_len : next - p;
+			if (len != next - p) { *in_len += len - (next - p); }
+			xh_tokens_write_match(&w, len, opt->offs[next], symbol_counts);
+		}
 	}
-	return out - out_orig;
+	xh_tokens_finish(&w, tokens, is_end, symbol_counts);
 }
-static size_t xh_calc_compressed_len(const const_byte lens[SYMBOLS], const uint32_t symbol_counts[SYMBOLS], const size_t buf_len)
+static void xh_compress_no_matching(const_bytes in, size_t in_len, bool is_end, xh_tokens* tokens, uint32_t symbol_counts[SYMBOLS])
 {
-	size_t sym_bits = 16; // we always have at least an extra 16-bits of 0s as the "end-of-chunk"
-	uint32_t literal_syms = 0, match_syms = 0;
-	for (uint_fast16_t i = 0; i < 0x100; ++i) { sym_bits += lens[i] * symbol_counts[i]; literal_syms += symbol_counts[i]; }
-	for (uint_fast16_t i = 0x100; i < SYMBOLS; ++i) { sym_bits += (lens[i] + ((i>>4)&0xF)) * symbol_counts[i]; match_syms += symbol_counts[i]; }
-	return (sym_bits+15)/16*2 + (buf_len - (literal_syms + match_syms*3 + (literal_syms+match_syms+31)/32*4)); // compressed size of all symbols after accounting for 16-bit alignment and extra bytes
+	xh_tokens_writer w;
+	xh_tokens_start(&w, tokens, symbol_counts);
+	for (const const_bytes in_end = in + in_len; in < in_end; ++in) { xh_tokens_write_literal(&w, *in, symbol_counts); }
+	xh_tokens_finish(&w, tokens, is_end, symbol_counts);
 }
-static size_t xh_calc_compressed_len_no_matching(const const_byte lens[SYMBOLS], const uint32_t symbol_counts[SYMBOLS])
+static size_t xh_calc_compressed_len(const const_byte lens[SYMBOLS], const uint32_t symbol_counts[SYMBOLS], const xh_tokens* tokens)
 {
-	size_t sym_bits = 16;
-	for (uint_fast16_t i = 0; i <= 0x100; ++i) { sym_bits += lens[i] * symbol_counts[i]; }
-	return (sym_bits+15)/16*2;
+	size_t sym_bits = 16; // we always have at least an extra 16-bits of 0s as the "end-of-chunk"
+	for (uint_fast16_t i = 0; i < 0x100; ++i) { sym_bits += lens[i] * symbol_counts[i]; }
+	for (uint_fast16_t i = 0x100; i < SYMBOLS; ++i) { sym_bits += (lens[i] + ((i>>4)&0xF)) * symbol_counts[i]; }
+	return (sym_bits+15)/16*2 + tokens->extra_bytes; // compressed size of all symbols after accounting for 16-bit alignment and extra bytes
 }
-static void xh_compress_encode(const_bytes in, const const_bytes in_end, bytes out, Encoder *encoder)
+static FORCE_INLINE void xh_compress_encode_symbols(const xh_tokens* tokens, bytes out, const Encoder *encoder)
 {
 	// Write the encoded compressed data
-	// This involves parsing the LZ77 compressed data and re-writing it with the Huffman codes
 	OutputBitstream bstr(out);
-	while (in < in_end)
+	const uint16_t* offs = tokens->offs;
+	const uint32_t* lens = tokens->lens;
+	for (const uint16_t *sym = tokens->syms, *end = sym + tokens->n_syms; sym != end; ++sym)
 	{
-		// Handle a fragment
-		// Bit mask tells us how to handle the next 32 symbols, go through each bit
-		uint_fast16_t i;
-		uint32_t mask;
-		for (i = 32, mask = GET_UINT32_RAW(in), in += 4; mask && in < in_end; --i, mask >>= 1)
+		const uint_fast16_t s = *sym;
+
+		// Write the Huffman code
+		encoder->EncodeSymbol(s, &bstr);
+
+		// Write extra length bytes
+		if (UNLIKELY((s & 0x10F) == 0x10F))
 		{
-			if (mask & 1) // offset / length symbol
-			{
-				// Get the LZ77 sym and offset
-				const byte sym = *in++;
-				const uint_fast16_t off = GET_UINT16_RAW(in); in += 2;
-
-				// Write the Huffman code
-				encoder->EncodeSymbol(0x100 | sym, &bstr);
-
-				// Write extra length bytes
-				if ((sym & 0xF) == 0xF)
-				{
-					const byte len8 = *in++;
-					bstr.WriteRawByte(len8);
-					if (len8 == 0xFF)
-					{
-						const uint16_t len16 = GET_UINT16_RAW(in); in += 2;
-						bstr.WriteRawUInt16(len16);
-						if (UNLIKELY(len16 == 0)) { bstr.WriteRawUInt32(GET_UINT32_RAW(in)); in += 4; }
-					}
-				}
-
-				// Write offset bits (off already has the high bit cleared)
-				bstr.WriteBits(off, sym >> 4);
-			}
+			const uint32_t len = *lens++;
+			if (len < 0xFF + 0xF) { bstr.WriteRawByte((byte)(len - 0xF)); }
 			else
 			{
-				// Write the literal symbol
-				encoder->EncodeSymbol(*in++, &bstr);
+				bstr.WriteRawByte(0xFF);
+				if (LIKELY(len <= 0xFFFF)) { bstr.WriteRawUInt16((uint16_t)len); }
+				else { bstr.WriteRawUInt16(0); bstr.WriteRawUInt32(len); }
 			}
 		}
-		// Write the remaining literal symbols
-		for (const_bytes end = MIN(in+i, in_end); in != end; ++in) { encoder->EncodeSymbol(*in, &bstr); }
+
+		// Write offset bits, without branching on the type of symbol literals write 0 bits of 0
+		// (which is fine since a code was just written so there are bits waiting)
+		const uint_fast16_t is_match = s >> 8, match_mask = 0 - is_match;
+		bstr.WriteBits(*offs & match_mask, (s >> 4) & 0xF & match_mask);
+		offs += is_match;
 	}
 
 	// Write end of stream symbol and return insufficient buffer or the compressed size
 	bstr.Finish(); // make sure that the write stream is finished writing
 }
+// The encoder is compiled for any processor and, when possible, for ones with BMI2
+static void xh_compress_encode_generic(const xh_tokens* tokens, bytes out, const Encoder *encoder) { xh_compress_encode_symbols(tokens, out, encoder); }
+#ifdef MSCOMP_BMI2_DISPATCH
+static TARGET_BMI2 void xh_compress_encode_bmi2(const xh_tokens* tokens, bytes out, const Encoder *encoder) { xh_compress_encode_symbols(tokens, out, encoder); }
+static const bool has_bmi2 = HAS_BMI2(); // checked once when loaded instead of every chunk
+#endif
+static FORCE_INLINE void xh_compress_encode(const xh_tokens* tokens, bytes out, const Encoder *encoder)
+{
+#ifdef MSCOMP_BMI2_DISPATCH
+	if (has_bmi2) { xh_compress_encode_bmi2(tokens, out, encoder); return; }
+#endif
+	xh_compress_encode_generic(tokens, out, encoder);
+}
 
-ENTRY_POINT MSCompStatus xpress_huff_compress(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+// In fast mode the codes of the previous chunk are used again instead of creating new ones when
+// they use at most 1/REUSE_SLACK more bits than the entropy of the new symbols. Trained codes are
+// used when they make the chunk, including its header, at most 1/TRAINED_SLACK larger than that.
+#define REUSE_SLACK		32
+#define TRAINED_SLACK	8
+static FORCE_INLINE bool xh_codes_are_close(const Encoder* encoder, const uint32_t symbol_counts[SYMBOLS], const uint32_t slack, const uint64_t other_bits)
+{
+	const size_t cost = encoder->Cost(symbol_counts);
+	if (cost == SIZE_MAX) { return false; }
+	const uint64_t entropy = entropy_bits(symbol_counts, SYMBOLS);
+	return ((uint64_t)cost << ENTROPY_FRAC_BITS) <= entropy + (entropy + (other_bits << ENTROPY_FRAC_BITS)) / slack;
+}
+// Gets the encoder with the codes to use for the symbols, either the trained one or encoder
+static FORCE_INLINE const Encoder* xh_create_codes(Encoder* encoder, const uint32_t symbol_counts[SYMBOLS], bool fast, const Encoder* trained)
 {
-	if (in_len == 0) { *_out_len = 0; return MSCOMP_OK; }
+	if (trained && xh_codes_are_close(trained, symbol_counts, TRAINED_SLACK, HALF_SYMBOLS*8)) { return trained; }
+	if (fast)
+	{
+		if (xh_codes_are_close(encoder, symbol_counts, REUSE_SLACK, 0)) { return encoder; }
 
-	bytes buf = (bytes)malloc((in_len >= CHUNK_SIZE) ? 0x1200C : ((in_len + 31) / 32 * 36 + 4 + 8)); // for every 32 bytes in "in" we need up to 36 bytes in the temp buffer + maybe an extra uint32 length symbol + up to 7 for the EOS (+1 for alignment)
-	if (buf == NULL) { return MSCOMP_MEM_ERROR; }
-	
-	const bytes out_orig = out;
-	const const_bytes in_end = in+in_len;
-	size_t out_len = *_out_len;
-	Dictionary d(in, in_end);
-	Encoder encoder;
+		// Give every symbol a code so that the codes can be used for more chunks
+		uint32_t counts[SYMBOLS];
+		for (uint_fast16_t i = 0; i < SYMBOLS; ++i) { counts[i] = symbol_counts[i] ? symbol_counts[i] : 1; }
+		encoder->CreateCodes(counts);
+		return encoder;
+	}
+	encoder->CreateCodes(symbol_counts);
+	return encoder;
+}
+
+template <class Dict>
+static size_t xh_compress_chunk(const_bytes in, size_t* in_len, bool is_end, bool span, bytes out, size_t out_len, xh_tokens* tokens, Dict* d, Encoder* encoder, xh_optimal_parse* opt = NULL, bool fast = false, const Encoder* trained = NULL)
+{
+	// Compresses a chunk of at most CHUNK_SIZE bytes (exactly CHUNK_SIZE bytes unless is_end)
+	// If span is true the last match may continue past the chunk, in_len is updated to the number
+	// of bytes used (the length of the chunk plus a multiple of CHUNK_SIZE)
+	// Uses the near-optimal parse if opt is not NULL, if fast is true the codes of the previous chunk
+	// may be used again and if trained is not NULL its codes may be used (see REUSE_SLACK)
+	// Returns the number of bytes written to out or 0 if out_len is not large enough
 	uint32_t symbol_counts[SYMBOLS]; // 4*512 = 2 kb
+	const size_t chunk_len = *in_len;
+	int32_t len = (int32_t)chunk_len;
 
-	// Go through each chunk except the last
-	while (in_len > CHUNK_SIZE)
+	size_t comp_len = SIZE_MAX;
+	const Encoder* codes = encoder;
+	const_bytes lens = NULL;
+	// the near-optimal parse and the highest levels are for the best ratio so always search
+	if (opt || !Dict::SkipIncompressible || LIKELY(!is_incompressible(in, chunk_len, MIN(in - d->Start(), MAX_OFFSET))))
 	{
 		////////// Perform the initial LZ77 compression //////////
-		size_t buf_len = xh_compress_lz77(in, CHUNK_SIZE, in_end, buf, symbol_counts, &d);
+		if (opt) { xh_compress_lz77_optimal(in, &len, is_end, span, tokens, symbol_counts, d, encoder, opt); }
+		else     { xh_compress_lz77(in, &len, is_end, span, tokens, symbol_counts, d); }
+		*in_len = (uint32_t)len;
 
 		////////// Create the Huffman codes/lens and Calculate the compressed output size //////////
-		const_bytes lens = encoder.CreateCodes(symbol_counts);
-		size_t comp_len = xh_calc_compressed_len(lens, symbol_counts, buf_len);
-		
-		////////// Guarantee Max Compression Size //////////
-		// This is required to guarantee max compressed size
-		// It is very rare that it is used (mainly medium-high uncompressible data)
-		if (UNLIKELY(comp_len > CHUNK_SIZE+2)) // + 2 for alignment
-		{
-			buf_len = xh_compress_no_matching(in, CHUNK_SIZE, false, buf, symbol_counts);
-			lens = encoder.CreateCodesSlow(symbol_counts);
-			comp_len = xh_calc_compressed_len_no_matching(lens, symbol_counts);
-			assert(comp_len <= CHUNK_SIZE+2);
-		}
+		codes = xh_create_codes(encoder, symbol_counts, fast, trained);
+		lens = codes->Lens();
+		comp_len = xh_calc_compressed_len(lens, symbol_counts, tokens);
+	}
+	else { d->Fill(in); } // data that looks incompressible is not searched but can still be matched by the next chunk
 
-		////////// Output Huffman prefix codes as lengths and Encode compressed data //////////
-		if (out_len < HALF_SYMBOLS + comp_len) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); free(buf); return MSCOMP_BUF_ERROR; }
-		for (const const_bytes end = lens + SYMBOLS; lens < end; lens += 2) { *out++ = lens[0] | (lens[1] << 4); }
-		xh_compress_encode(buf, buf+buf_len, out, &encoder);
-		in += CHUNK_SIZE; in_len -= CHUNK_SIZE;
-		out += comp_len; out_len -= HALF_SYMBOLS + comp_len;
+	////////// Guarantee Max Compression Size //////////
+	// This is required to guarantee max compressed size
+	// It is mainly used for data that looks incompressible, otherwise it is very rare
+	// +2 for alignment, +36 for alignment and end of stream (because it causes a different symbol to need 9 bits)
+	const size_t max_comp_len = chunk_len + (is_end ? 36 : 2);
+	if (UNLIKELY(comp_len > max_comp_len))
+	{
+		*in_len = chunk_len;
+		xh_compress_no_matching(in, chunk_len, is_end, tokens, symbol_counts);
+		codes = encoder;
+		lens = encoder->CreateCodes(symbol_counts);
+		comp_len = xh_calc_compressed_len(lens, symbol_counts, tokens);
+		assert(comp_len <= max_comp_len);
 	}
+	if (opt) { memcpy(opt->code_lens, lens, SYMBOLS); }
 
-	// Do the last chunk
-	if (in_len == 0)
+	////////// Output Huffman prefix codes as lengths and Encode compressed data //////////
+	if (UNLIKELY(out_len < HALF_SYMBOLS + comp_len)) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); return 0; }
+	for (const const_bytes end = lens + SYMBOLS; lens < end; lens += 2) { *out++ = lens[0] | (lens[1] << 4); }
+	xh_compress_encode(tokens, out, codes);
+	return HALF_SYMBOLS + comp_len;
+}
+static size_t xh_compress_end_chunk(bytes out, size_t out_len)
+{
+	// Writes a chunk that only has the end of stream symbol
+	// Returns the number of bytes written to out or 0 if out_len is not large enough
+	if (UNLIKELY(out_len < MIN_DATA)) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); return 0; }
+	memset(out, 0, MIN_DATA);
+	out[STREAM_END>>1] = STREAM_END_LEN_1;
+	return MIN_DATA;
+}
+template <class Dict>
+static size_t xh_compress_next_chunk(const_bytes* in, const const_bytes in_end, bool* last, bytes out, size_t out_len, xh_tokens* tokens, Dict* d, Encoder* encoder, xh_optimal_parse* opt = NULL, bool fast = false, const Encoder* trained = NULL)
+{
+	// Compresses the chunk at *in, which is the last one if there are at most CHUNK_SIZE bytes left,
+	// and advances *in past the bytes used
+	// The chunks before it must have been compressed with d, in order
+	// Returns the number of bytes written to out or 0 if out_len is not large enough
+	size_t in_len = in_end - *in, comp_len;
+	*last = in_len <= CHUNK_SIZE;
+	if (*last)
 	{
-		if (UNLIKELY(out_len < MIN_DATA)) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); free(buf); return MSCOMP_BUF_ERROR; }
-		memset(out, 0, MIN_DATA);
-		out[STREAM_END>>1] = STREAM_END_LEN_1;
-		out += MIN_DATA;
+		comp_len = (in_len == 0) ? xh_compress_end_chunk(out, out_len) : xh_compress_chunk(*in, &in_len, true, false, out, out_len, tokens, d, encoder, opt, fast, trained);
 	}
 	else
 	{
-		////////// Perform the initial LZ77 compression //////////
-		size_t buf_len = xh_compress_lz77(in, (int32_t)in_len, in_end, buf, symbol_counts, &d);
+		in_len = CHUNK_SIZE;
+		comp_len = xh_compress_chunk(*in, &in_len, false, true, out, out_len, tokens, d, encoder, opt, fast, trained);
+		// the following chunks were not added to the dictionary, add what the next chunk can reach
+		if (in_len > CHUNK_SIZE) { d->Add(*in + in_len - MAX_OFFSET, MAX_OFFSET); }
+	}
+	*in += in_len;
+	return comp_len;
+}
 
-		////////// Create the Huffman codes/lens and Calculate the compressed output size //////////
-		const_bytes lens = encoder.CreateCodes(symbol_counts);
-		size_t comp_len = xh_calc_compressed_len(lens, symbol_counts, buf_len);
-		
-		////////// Guarantee Max Compression Size //////////
-		// This is required to guarantee max compressed size
-		// It is very rare that it is used (mainly medium-high uncompressible data)
-		if (UNLIKELY(comp_len > in_len+36)) // +36 for alignment and end of stream (because it causes a different symbol to need 9 bits)
-		{
-			buf_len = xh_compress_no_matching(in, in_len, true, buf, symbol_counts);
-			lens = encoder.CreateCodesSlow(symbol_counts);
-			comp_len = xh_calc_compressed_len_no_matching(lens, symbol_counts);
-			assert(comp_len <= in_len+36);
-		}
+static size_t xh_tokens_reach(const xh_tokens* tokens)
+{
+	// Gets how far before the start of a chunk the matches of its tokens refer to
+	const uint16_t* offs = tokens->offs;
+	const uint32_t* lens = tokens->lens;
+	size_t pos = 0, reach = 0;
+	for (const uint16_t *sym = tokens->syms, *end = sym + tokens->n_syms; sym != end; ++sym)
+	{
+		const uint_fast16_t s = *sym;
+		if (s < 0x100) { ++pos; continue; }
+		const size_t off = *offs++ | (1 << ((s >> 4) & 0xF));
+		if (off > pos && off - pos > reach) { reach = off - pos; }
+		pos += (((s & 0xF) == 0xF) ? *lens++ : (s & 0xF)) + 3;
+	}
+	return reach;
+}
+
+template <class Dict>
+static size_t xh_compress_next_chunk_cached(const_bytes* in, const const_bytes in_end, bool* last, bytes out, size_t out_len, xh_tokens* tokens, Dict* d, Encoder* encoder, mscomp_chunk_cache* cache)
+{
+	// Like xh_compress_next_chunk but copies the chunk from the cache when it and the data before it
+	// that it refers to were compressed before. Only chunks without a match continuing past them are
+	// added to the cache.
+	const size_t rem = in_end - *in, in_len = MIN(rem, CHUNK_SIZE), window = MIN((size_t)(*in - d->Start()), MAX_OFFSET);
+	if (UNLIKELY(in_len == 0)) { return xh_compress_next_chunk(in, in_end, last, out, out_len, tokens, d, encoder); }
+	const uint32_t kind = (rem <= CHUNK_SIZE) ? CHUNK_CACHE_XPRESS_HUFF_END : CHUNK_CACHE_XPRESS_HUFF;
+	const uint64_t key = mscomp_chunk_cache::Hash(kind, *in - window, window + in_len);
+	size_t comp_len;
+	const const_bytes cached = cache->Find(kind, key, *in, in_len, window, &comp_len);
+	if (cached)
+	{
+		if (UNLIKELY(out_len < comp_len)) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); return 0; }
+		memcpy(out, cached, comp_len);
+		d->Fill(*in); // the next chunk can still match it
+		*last = rem <= CHUNK_SIZE;
+		*in += in_len;
+		return comp_len;
+	}
+	const const_bytes start = *in;
+	comp_len = xh_compress_next_chunk(in, in_end, last, out, out_len, tokens, d, encoder);
+	if (comp_len && (size_t)(*in - start) == in_len) { cache->Add(kind, key, start, in_len, xh_tokens_reach(tokens), out, comp_len); }
+	return comp_len;
+}
 
-		////////// Output Huffman prefix codes as lengths and Encode compressed data //////////
-		if (UNLIKELY(out_len < HALF_SYMBOLS + comp_len)) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); free(buf); return MSCOMP_BUF_ERROR; }
-		for (const_bytes end = lens + SYMBOLS; lens < end; lens += 2) { *out++ = lens[0] | (lens[1] << 4); }
-		xh_compress_encode(buf, buf+buf_len, out, &encoder);
-		out += comp_len;
+// Compresses everything at once, if index is not NULL the chunk index is created as well, if opt is
+// not NULL the near-optimal parse is used, if fast is true codes may be reused between chunks, if
+// trained is not NULL its codes may be used for any chunk, and if cache is not NULL chunks are
+// copied from it when possible (cannot be used with opt or fast)
+template <class Dict>
+static MSCompStatus xh_compress(const_bytes in, size_t in_len, bytes out, size_t* _out_len, mscomp_xpress_huff_chunk* index, size_t* _index_len, xh_optimal_parse* opt = NULL, bool fast = false, const Encoder* trained = NULL, mscomp_chunk_cache* cache = NULL)
+{
+	if (index)
+	{
+		if (UNLIKELY(*_index_len < (in_len + CHUNK_SIZE - 1) / CHUNK_SIZE + 1)) { return MSCOMP_BUF_ERROR; }
+		index->in_offset = 0;
+		index->out_offset = 0;
 	}
+	if (in_len == 0) { *_out_len = 0; if (index) { *_index_len = 1; } return MSCOMP_OK; }
+
+	xh_tokens* tokens = (xh_tokens*)malloc(sizeof(xh_tokens));
+	if (tokens == NULL) { return MSCOMP_MEM_ERROR; }
+	
+	const bytes out_orig = out;
+	const const_bytes in_orig = in, in_end = in+in_len;
+	const mscomp_xpress_huff_chunk* const index_orig = index;
+	size_t out_len = *_out_len, comp_len;
+	Dict d(in, in_end);
+	Encoder encoder;
+
+	// Go through each chunk, since matches can span chunks they may not all be CHUNK_SIZE bytes
+	bool last;
+	do
+	{
+		comp_len = cache ? xh_compress_next_chunk_cached(&in, in_end, &last, out, out_len, tokens, &d, &encoder, cache) :
+			xh_compress_next_chunk(&in, in_end, &last, out, out_len, tokens, &d, &encoder, opt, fast, trained);
+		if (UNLIKELY(comp_len == 0)) { free(tokens); return MSCOMP_BUF_ERROR; }
+		out += comp_len; out_len -= comp_len;
+		if (index) { ++index; index->in_offset = out - out_orig; index->out_offset = in - in_orig; }
+	} while (!last);
+	if (index) { *_index_len = index - index_orig + 1; }
 
 	// Cleanup
-	free(buf);
+	free(tokens);
 
 	// Return the total number of compressed bytes
 	*_out_len = out - out_orig;
 	return MSCOMP_OK;
 }
+ENTRY_POINT MSCompStatus xpress_huff_compress(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	return xh_compress<Dictionary>(in, in_len, out, _out_len, NULL, NULL);
+}
+ENTRY_POINT MSCompStatus xpress_huff_compress_indexed(const_bytes in, size_t in_len, bytes out, size_t* _out_len, mscomp_xpress_huff_chunk* index, size_t* index_len)
+{
+	return xh_compress<Dictionary>(in, in_len, out, _out_len, index, index_len);
+}
+ENTRY_POINT MSCompStatus xpress_huff_compress_fast(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	return xh_compress<Dictionary>(in, in_len, out, _out_len, NULL, NULL, NULL, true);
+}
+ENTRY_POINT MSCompStatus xpress_huff_compress_cached(const_bytes in, size_t in_len, bytes out, size_t* _out_len, mscomp_chunk_cache* cache)
+{
+	return xh_compress<Dictionary>(in, in_len, out, _out_len, NULL, NULL, NULL, false, NULL, cache);
+}
+template <unsigned Level>
+static MSCompStatus xh_compress_at_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	return xh_compress<typename XpressLevelDictionary<MAX_OFFSET, CHUNK_SIZE, Level>::Type>(in, in_len, out, _out_len, NULL, NULL);
+}
+ENTRY_POINT MSCompStatus xpress_huff_compress_level(const_bytes in, size_t in_len, bytes out, size_t* _out_len, unsigned level)
+{
+	XPRESS_DICTIONARY_LEVEL_SWITCH(level, xh_compress_at_level, (in, in_len, out, _out_len))
+}
+////////// Trained Codes //////////
+// Small inputs take most of their time setting up the dictionary and creating the codes, so they
+// can be compressed with code lengths made ahead of time from similar data (see xpress_huff_train).
+// Small inputs also use a smaller hash table since it is cleared for every input.
+#define SMALL_INPUT_MAX	0x4000
+typedef XpressDictionary<MAX_OFFSET, CHUNK_SIZE, 12> SmallDictionary;
+
+// The built-in code lengths, in the same format as the start of each chunk, trained on 4 KiB pieces
+// of text and executables
+static const byte xh_trained_lens[HALF_SYMBOLS] =
+{
+	0x87, 0x9A, 0x99, 0xAA, 0x98, 0xA8, 0xAA, 0x7A, 0xA8, 0xBB, 0xAA, 0xBB, 0xB9, 0xBB, 0xBB, 0x9B,
+	0xB5, 0xA9, 0xA7, 0x8B, 0x87, 0xAA, 0x88, 0x97, 0x88, 0x98, 0x99, 0xA9, 0x88, 0xA8, 0x99, 0xBA,
+	0x78, 0x8A, 0x88, 0x99, 0x76, 0xAA, 0x87, 0x99, 0xB8, 0x89, 0x98, 0xAA, 0xB9, 0x9B, 0x9A, 0x8B,
+	0x69, 0x78, 0x67, 0x87, 0x67, 0x9A, 0x77, 0x66, 0xA7, 0x66, 0x76, 0x88, 0x88, 0xAA, 0xA9, 0xAA,
+	0xA9, 0x8B, 0x88, 0xBB, 0x69, 0x7C, 0x7A, 0xBB, 0xC9, 0xBB, 0xBA, 0xCB, 0xCA, 0xCC, 0xBB, 0xCC,
+	0xCA, 0xBC, 0xBB, 0xCC, 0xCA, 0xBC, 0xBA, 0xBC, 0xCA, 0xBC, 0xAA, 0xBA, 0xBA, 0xBA, 0xAA, 0xAA,
+	0x98, 0x9A, 0xAA, 0x89, 0xAA, 0xBB, 0xBB, 0xBB, 0xB9, 0xBA, 0xBB, 0xBB, 0xBA, 0xAB, 0xBB, 0xAA,
+	0xB9, 0xBB, 0xBA, 0xAA, 0x86, 0x9A, 0xAA, 0x9A, 0xB9, 0xAA, 0xAB, 0xAA, 0xA9, 0xAA, 0xAA, 0x7A,
+	0x9A, 0xDD, 0xCD, 0xFF, 0xEE, 0xFF, 0xEF, 0xCF, 0xFC, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xA9, 0xCC, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x87, 0xA9, 0xC9, 0xDC, 0xFD, 0xFF, 0xFF, 0xFF,
+	0x87, 0x98, 0xA9, 0xBA, 0xCB, 0xCC, 0xDA, 0xBD, 0x77, 0x88, 0x99, 0xAA, 0xBB, 0xBB, 0xBC, 0x9C,
+	0x76, 0x88, 0x98, 0xA9, 0xBA, 0xBB, 0xBB, 0x8C, 0x76, 0x88, 0x99, 0xAA, 0xBA, 0xBB, 0xBB, 0x8C,
+	0x76, 0x88, 0x99, 0xAA, 0xBA, 0xBB, 0xCB, 0x8C, 0x76, 0x88, 0x99, 0xAA, 0xBA, 0xBB, 0xCB, 0x8C,
+	0x76, 0x88, 0x99, 0xAA, 0xBA, 0xBB, 0xCC, 0x9C, 0x87, 0x99, 0xBA, 0xBB, 0xCC, 0xDC, 0xDD, 0xAE,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
+static void xh_unpack_lens(const_bytes packed, bytes lens) { for (uint_fast16_t i = 0; i < HALF_SYMBOLS; ++i) { lens[2*i] = packed[i] & 0xF; lens[2*i+1] = packed[i] >> 4; } }
+
+ENTRY_POINT MSCompStatus xpress_huff_compress_trained(const_bytes in, size_t in_len, bytes out, size_t* _out_len, const_bytes lens)
+{
+	byte unpacked[SYMBOLS];
+	Encoder trained;
+	xh_unpack_lens(lens ? lens : xh_trained_lens, unpacked);
+	if (UNLIKELY(!trained.SetLens(unpacked))) { return MSCOMP_ARG_ERROR; }
+	return (in_len <= SMALL_INPUT_MAX) ?
+		xh_compress<SmallDictionary>(in, in_len, out, _out_len, NULL, NULL, NULL, false, &trained) :
+		xh_compress<Dictionary>(in, in_len, out, _out_len, NULL, NULL, NULL, false, &trained);
+}
+ENTRY_POINT MSCompStatus xpress_huff_train(const_bytes in, size_t in_len, size_t msg_len, bytes lens)
+{
+	if (msg_len == 0 || msg_len > CHUNK_SIZE) { msg_len = CHUNK_SIZE; }
+	xh_tokens* tokens = (xh_tokens*)malloc(sizeof(xh_tokens));
+	if (UNLIKELY(tokens == NULL)) { return MSCOMP_MEM_ERROR; }
+
+	// Count the symbols of each piece compressed on its own
+	uint64_t totals[SYMBOLS], total = 0;
+	uint32_t symbol_counts[SYMBOLS];
+	memset(totals, 0, sizeof(totals));
+	for (const const_bytes in_end = in + in_len; in < in_end; in += msg_len)
+	{
+		int32_t len = (int32_t)MIN(msg_len, (size_t)(in_end - in));
+		Dictionary d(in, in + len);
+		xh_compress_lz77(in, &len, true, false, tokens, symbol_counts, &d);
+		for (uint_fast16_t i = 0; i < SYMBOLS; ++i) { totals[i] += symbol_counts[i]; total += symbol_counts[i]; }
+	}
+	free(tokens);
+
+	// Every symbol gets a code so the lengths work for any data, the counts are scaled down so that
+	// their sum fits in 32 bits
+	uint_fast8_t shift = 0;
+	while ((total >> shift) + SYMBOLS > 0x7FFFFFFF) { ++shift; }
+	for (uint_fast16_t i = 0; i < SYMBOLS; ++i) { symbol_counts[i] = (uint32_t)(totals[i] >> shift) | 1; }
+	Encoder encoder;
+	const const_bytes l = encoder.CreateCodes(symbol_counts);
+	for (uint_fast16_t i = 0; i < HALF_SYMBOLS; ++i) { lens[i] = l[2*i] | (l[2*i+1] << 4); }
+	return MSCOMP_OK;
+}
+ENTRY_POINT MSCompStatus xpress_huff_compress_optimal(const_bytes in, size_t in_len, bytes out, size_t* _out_len)
+{
+	xh_optimal_parse* opt = (xh_optimal_parse*)malloc(sizeof(xh_optimal_parse));
+	if (UNLIKELY(opt == NULL)) { return MSCOMP_MEM_ERROR; }
+	xh_optimal_init(opt);
+	const MSCompStatus status = xh_compress<OptDictionary>(in, in_len, out, _out_len, NULL, NULL, opt);
+	free(opt);
+	return status;
+}
+
+////////////////////////////// Multi-threaded Compression //////////////////////////////////////////
+// Each worker compresses a contiguous range of chunks into its own buffer. The worker's dictionary
+// is first filled with the chunk before its range so that it finds exactly the same matches as the
+// serial compressor. Since a match can span chunks, the chunks before a range may end past its
+// start, so the outputs are joined where the serial compressor would have started a chunk and any
+// chunk a worker did not start at that position is compressed again. The concatenated output is
+// byte-identical to xpress_huff_compress.
+typedef struct
+{
+	const_bytes in_start, in_end; // the entire input
+	const_bytes in, in_range_end; // the chunks this worker compresses
+	bytes out;
+	size_t* chunks; // the input offset then output offset of the start of each chunk, followed by the ends
+	size_t n_chunks;
+	bool ended; // if the last chunk was the end of the stream
+	MSCompStatus status;
+} xh_compress_mt_job;
+
+static void xh_compress_mt_run(void* _job)
+{
+	xh_compress_mt_job* job = (xh_compress_mt_job*)_job;
+	const_bytes in = job->in;
+	const size_t max_chunks = (job->in_range_end - in + CHUNK_SIZE - 1) / CHUNK_SIZE + 1;
+	size_t out_len = max_chunks * (HALF_SYMBOLS + CHUNK_SIZE + 36), comp_len, n = 0;
+
+	// The dictionary is allocated from the heap since threads may have small stacks
+	xh_tokens* tokens = (xh_tokens*)malloc(sizeof(xh_tokens));
+	bytes out = job->out = (bytes)malloc(out_len);
+	size_t* chunks = job->chunks = (size_t*)malloc(2 * (max_chunks + 1) * sizeof(size_t));
+	Dictionary* d = (Dictionary*)malloc(sizeof(Dictionary));
+	if (UNLIKELY(tokens == NULL || out == NULL || chunks == NULL || d == NULL)) { free(tokens); free(d); job->status = MSCOMP_MEM_ERROR; return; }
+	new (d) Dictionary(job->in_start, job->in_end);
+	Encoder encoder;
+
+	// Add the chunk before the range to the dictionary
+	if (in != job->in_start) { d->Fill(in - CHUNK_SIZE); }
+
+	// Compress each chunk that starts in the range
+	bool last = false;
+	job->status = MSCOMP_OK;
+	while (!last && in < job->in_range_end)
+	{
+		chunks[2*n] = in - job->in_start; chunks[2*n+1] = out - job->out; ++n;
+		comp_len = xh_compress_next_chunk(&in, job->in_end, &last, out, out_len, tokens, d, &encoder);
+		if (UNLIKELY(comp_len == 0)) { job->status = MSCOMP_BUF_ERROR; break; } // never happens
+		out += comp_len; out_len -= comp_len;
+	}
+	chunks[2*n] = in - job->in_start; chunks[2*n+1] = out - job->out;
+	job->n_chunks = n;
+	job->ended = last;
+
+	// Cleanup
+	d->~Dictionary();
+	free(d);
+	free(tokens);
+}
+
+ENTRY_POINT MSCompStatus xpress_huff_compress_mt(const_bytes in, size_t in_len, bytes out, size_t* _out_len, unsigned nthreads)
+{
+	const size_t n_chunks = (in_len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if (nthreads == 0) { nthreads = Thread::ProcessorCount(); }
+	if (nthreads > n_chunks) { nthreads = (unsigned)n_chunks; }
+	if (nthreads <= 1) { return xpress_huff_compress(in, in_len, out, _out_len); }
+
+	xh_compress_mt_job* jobs = (xh_compress_mt_job*)malloc(nthreads * sizeof(xh_compress_mt_job));
+	Thread* threads = (Thread*)malloc(nthreads * sizeof(Thread));
+	if (UNLIKELY(jobs == NULL || threads == NULL)) { free(jobs); free(threads); return MSCOMP_MEM_ERROR; }
+
+	// Split the chunks evenly between the workers, the calling thread does the first range
+	const const_bytes in_end = in + in_len;
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		jobs[i].in_start = in;
+		jobs[i].in_end = in_end;
+		jobs[i].in = in + n_chunks * i / nthreads * CHUNK_SIZE;
+		jobs[i].in_range_end = (i == nthreads - 1) ? in_end : in + n_chunks * (i + 1) / nthreads * CHUNK_SIZE;
+		jobs[i].out = NULL;
+		jobs[i].chunks = NULL;
+	}
+	for (unsigned i = 1; i < nthreads; ++i) { threads[i].Start(&xh_compress_mt_run, jobs + i); }
+	xh_compress_mt_run(jobs);
+	for (unsigned i = 1; i < nthreads; ++i) { threads[i].Join(); }
+
+	// Concatenate the outputs, starting each one at the first of its chunks that the serial
+	// compressor would have started and compressing the chunks before that again
+	MSCompStatus status = MSCOMP_OK;
+	for (unsigned i = 0; i < nthreads && status == MSCOMP_OK; ++i) { status = jobs[i].status; }
+	xh_tokens* tokens = NULL;
+	Dictionary* d = NULL;
+	Encoder encoder;
+	const_bytes pos = in;
+	size_t out_len = *_out_len, total = 0, comp_len;
+	bool last = false;
+	for (unsigned i = 0; i < nthreads && status == MSCOMP_OK && !last; ++i)
+	{
+		const xh_compress_mt_job* job = jobs + i;
+		const size_t* chunks = job->chunks;
+		for (size_t k = 0; status == MSCOMP_OK && !last && pos < in + chunks[2*job->n_chunks]; )
+		{
+			while (k < job->n_chunks && in + chunks[2*k] < pos) { ++k; }
+			if (k < job->n_chunks && in + chunks[2*k] == pos)
+			{
+				const size_t start = chunks[2*k+1], len = chunks[2*job->n_chunks+1] - start;
+				if (UNLIKELY(out_len - total < len)) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); status = MSCOMP_BUF_ERROR; break; }
+				memcpy(out + total, job->out + start, len); total += len;
+				pos = in + chunks[2*job->n_chunks];
+				last = job->ended;
+				break;
+			}
+			if (d == NULL)
+			{
+				tokens = (xh_tokens*)malloc(sizeof(xh_tokens));
+				d = (Dictionary*)malloc(sizeof(Dictionary));
+				if (UNLIKELY(tokens == NULL || d == NULL)) { status = MSCOMP_MEM_ERROR; break; }
+				new (d) Dictionary(in, in_end);
+			}
+			d->Reset(in_end);
+			d->Fill(pos - CHUNK_SIZE);
+			if (UNLIKELY((comp_len = xh_compress_next_chunk(&pos, in_end, &last, out + total, out_len - total, tokens, d, &encoder)) == 0)) { status = MSCOMP_BUF_ERROR; break; }
+			total += comp_len;
+		}
+	}
+	// The last worker's range may have been entirely covered by a match that reached the end
+	if (status == MSCOMP_OK && !last)
+	{
+		if (UNLIKELY((comp_len = xh_compress_end_chunk(out + total, out_len - total)) == 0)) { status = MSCOMP_BUF_ERROR; }
+		total += comp_len;
+	}
+	if (d) { d->~Dictionary(); }
+	free(d);
+	free(tokens);
+	for (unsigned i = 0; i < nthreads; ++i) { free(jobs[i].out); free(jobs[i].chunks); }
+	free(threads);
+	free(jobs);
+
+	if (status == MSCOMP_OK) { *_out_len = total; }
+	return status;
+}
+
+////////////////////////////// Independent Chunks //////////////////////////////////////////////////
+// Each chunk is compressed as complete data on its own with the dictionary reset before it, like WIM
+// resources and Windows system compression (WOF) do. The dictionary window and hash table are sized
+// for the chunk size. Each chunk is first written at its position in the input, which its
+// compressed data never goes past since a chunk that does not get smaller is stored as-is, so the
+// workers do not need their own buffers. Then the chunks are moved together in order.
+typedef struct
+{
+	const_bytes in;
+	size_t in_len;
+	bytes out; // has in_len bytes, chunk i is written to i*ChunkSize
+	uint32_t* sizes;
+	size_t first, last; // the range of chunks
+	MSCompStatus status;
+} xh_compress_chunked_job;
+
+template <uint32_t ChunkSize, unsigned HashBits>
+static void xh_compress_chunked_run(void* _job)
+{
+	typedef XpressDictionary<ChunkSize - 1, ChunkSize, HashBits> Dict;
+	xh_compress_chunked_job* job = (xh_compress_chunked_job*)_job;
+
+	// The dictionary is allocated from the heap since threads may have small stacks
+	xh_tokens* tokens = (xh_tokens*)malloc(sizeof(xh_tokens));
+	Dict* d = (Dict*)malloc(sizeof(Dict));
+	if (UNLIKELY(tokens == NULL || d == NULL)) { free(tokens); free(d); job->status = MSCOMP_MEM_ERROR; return; }
+	new (d) Dict(job->in, job->in + job->in_len);
+	Encoder encoder;
+
+	for (size_t i = job->first; i < job->last; ++i)
+	{
+		const const_bytes in = job->in + i * ChunkSize;
+		const bytes out = job->out + i * ChunkSize;
+		size_t in_len = MIN(job->in_len - i * ChunkSize, ChunkSize), comp_len;
+		d->Reset(in, in + in_len);
+		// The compressed data must be smaller than the chunk, otherwise the chunk is stored as-is
+		if ((comp_len = xh_compress_chunk(in, &in_len, true, false, out, in_len - 1, tokens, d, &encoder)) == 0)
+		{
+			memcpy(out, in, in_len);
+			comp_len = in_len;
+		}
+		job->sizes[i] = (uint32_t)comp_len;
+	}
+	job->status = MSCOMP_OK;
+
+	// Cleanup
+	d->~Dict();
+	free(d);
+	free(tokens);
+}
+
+template <uint32_t ChunkSize, unsigned HashBits>
+static MSCompStatus xh_compress_chunked(const_bytes in, size_t in_len, bytes out, size_t* _out_len, uint32_t* sizes, size_t* n_chunks, unsigned nthreads)
+{
+	const size_t n = (in_len + ChunkSize - 1) / ChunkSize, out_len = *_out_len;
+	if (UNLIKELY(*n_chunks < n)) { return MSCOMP_BUF_ERROR; }
+	if (nthreads == 0) { nthreads = Thread::ProcessorCount(); }
+	if (nthreads > n) { nthreads = (unsigned)n; }
+	if (nthreads == 0) { *_out_len = 0; *n_chunks = 0; return MSCOMP_OK; }
+
+	// The output buffer can only be used for the chunks at their input positions if it is large enough
+	const bytes buf = (out_len >= in_len) ? out : (bytes)malloc(in_len);
+	xh_compress_chunked_job* jobs = (xh_compress_chunked_job*)malloc(nthreads * sizeof(xh_compress_chunked_job));
+	Thread* threads = (Thread*)malloc(nthreads * sizeof(Thread));
+	if (UNLIKELY(buf == NULL || jobs == NULL || threads == NULL)) { if (buf != out) { free(buf); } free(jobs); free(threads); return MSCOMP_MEM_ERROR; }
+
+	// Split the chunks evenly between the workers, the calling thread does the first range
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		jobs[i].in = in;
+		jobs[i].in_len = in_len;
+		jobs[i].out = buf;
+		jobs[i].sizes = sizes;
+		jobs[i].first = n * i / nthreads;
+		jobs[i].last = n * (i + 1) / nthreads;
+	}
+	for (unsigned i = 1; i < nthreads; ++i) { threads[i].Start(&xh_compress_chunked_run<ChunkSize, HashBits>, jobs + i); }
+	xh_compress_chunked_run<ChunkSize, HashBits>(jobs);
+	for (unsigned i = 1; i < nthreads; ++i) { threads[i].Join(); }
+
+	// Move the compressed chunks together, they only ever move towards the start
+	MSCompStatus status = MSCOMP_OK;
+	for (unsigned i = 0; i < nthreads && status == MSCOMP_OK; ++i) { status = jobs[i].status; }
+	size_t total = 0;
+	for (size_t i = 0; i < n && status == MSCOMP_OK; ++i)
+	{
+		if (UNLIKELY(out_len - total < sizes[i])) { PRINT_ERROR("Xpress Huffman Compression Error: Insufficient buffer\n"); status = MSCOMP_BUF_ERROR; break; }
+		if (out + total != buf + i * ChunkSize) { memmove(out + total, buf + i * ChunkSize, sizes[i]); }
+		total += sizes[i];
+	}
+	if (buf != out) { free(buf); }
+	free(threads);
+	free(jobs);
+
+	if (status == MSCOMP_OK) { *_out_len = total; *n_chunks = n; }
+	return status;
+}
+
+ENTRY_POINT MSCompStatus xpress_huff_compress_chunked(const_bytes in, size_t in_len, bytes out, size_t* _out_len, size_t chunk_size, uint32_t* sizes, size_t* n_chunks, unsigned nthreads)
+{
+	switch (chunk_size)
+	{
+	case 0x01000: return xh_compress_chunked<0x01000, 12>(in, in_len, out, _out_len, sizes, n_chunks, nthreads);
+	case 0x02000: return xh_compress_chunked<0x02000, 13>(in, in_len, out, _out_len, sizes, n_chunks, nthreads);
+	case 0x04000: return xh_compress_chunked<0x04000, 14>(in, in_len, out, _out_len, sizes, n_chunks, nthreads);
+	case 0x08000: return xh_compress_chunked<0x08000, 15>(in, in_len, out, _out_len, sizes, n_chunks, nthreads);
+	case 0x10000: return xh_compress_chunked<0x10000, 15>(in, in_len, out, _out_len, sizes, n_chunks, nthreads);
+	default: return MSCOMP_ARG_ERROR;
+	}
+}
+
+////////////////////////////// Streaming ///////////////////////////////////////////////////////////
+// The state is allocated with the dictionary for its level so each of the functions below
+// dispatches on the level to the version for that dictionary
+template <unsigned Level>
+static MSCompStatus xh_deflate_init(mscomp_stream* stream)
+{
+	typedef xh_compress_level_state<Level> State;
+	State* state = (State*)malloc(sizeof(State));
+	if (UNLIKELY(state == NULL)) { SET_ERROR(stream, "Xpress Huffman Compression Error: Unable to allocate state memory"); return MSCOMP_MEM_ERROR; }
+
+	new (&state->d) typename State::Dict(state->in, state->in + sizeof(state->in));
+	new (&state->encoder) Encoder();
+	state->finished = false;
+	state->end_written = false;
+	state->level = Level;
+	state->in_avail = 0;
+	state->in_window = 0;
+	state->flushed = false;
+	state->out_pos = 0;
+	state->out_avail = 0;
+
+	stream->state = (mscomp_internal_state*) state;
+	return MSCOMP_OK;
+}
+MSCompStatus xpress_huff_deflate_init_level(mscomp_stream* stream, unsigned level)
+{
+	INIT_STREAM(stream, true, MSCOMP_XPRESS_HUFF);
+	if (UNLIKELY(level > MSCOMP_LEVEL_MAX)) { SET_ERROR(stream, "Xpress Huffman Compression Error: Invalid level"); return MSCOMP_ARG_ERROR; }
+	XPRESS_DICTIONARY_LEVEL_SWITCH(level, xh_deflate_init, (stream))
+}
+MSCompStatus xpress_huff_deflate_init(mscomp_stream* stream) { return xpress_huff_deflate_init_level(stream, MSCOMP_LEVEL_DEFAULT); }
+template <unsigned Level>
+static MSCompStatus xh_deflate(mscomp_stream* stream, MSCompFlush flush)
+{
+	xh_compress_level_state<Level>* state = (xh_compress_level_state<Level>*) stream->state;
+
+	for (;;)
+	{
+		DUMP_OUT(state, stream);
+		if (state->end_written) { break; }
+
+		// Buffer as much input as possible
+		const size_t copy = MIN(sizeof(state->in) - state->in_avail, stream->in_avail);
+		memcpy(state->in + state->in_avail, stream->in, copy);
+		state->in_avail += copy;
+		ADVANCE_IN(stream, copy);
+
+		// Determine the next chunk to compress, if any
+		// A chunk is normally only compressed once the lookahead after it is available, so that
+		// matches near its end are not shortened by missing data
+		const bytes chunk = state->in + state->in_window;
+		const size_t avail = state->in_avail - state->in_window;
+		size_t in_len = CHUNK_SIZE;
+		bool is_end = false;
+		if (avail < CHUNK_SIZE + LOOKAHEAD)
+		{
+			if (flush == MSCOMP_NO_FLUSH) { break; }
+			ALWAYS(stream->in_avail == 0);
+			if (flush == MSCOMP_FLUSH)
+			{
+				// Only complete chunks can be flushed since every chunk besides the last must
+				// decompress to exactly CHUNK_SIZE bytes
+				if (avail < CHUNK_SIZE) { break; }
+			}
+			else if (avail <= CHUNK_SIZE)
+			{
+				in_len = avail;
+				is_end = true;
+				if (avail == 0 && state->in_window == 0) { state->end_written = true; continue; } // no data at all
+			}
+		}
+
+		// Compress the chunk, directly to the output if there is enough room
+		const bool out_buffering = stream->out_avail < sizeof(state->out);
+		const bytes out = out_buffering ? state->out : stream->out;
+		size_t out_len;
+		if (in_len)
+		{
+			// The dictionary already has the window unless the window was flushed
+			if (state->flushed)
+			{
+				state->d.Reset(state->in + state->in_avail);
+				if (state->in_window) { state->d.Fill(state->in); }
+			}
+			else { state->d.SetEnd(state->in + state->in_avail); }
+			state->flushed = avail < CHUNK_SIZE + LOOKAHEAD;
+			out_len = xh_compress_chunk(chunk, &in_len, is_end, false, out, sizeof(state->out), &state->tokens, &state->d, &state->encoder);
+		}
+		else { out_len = xh_compress_end_chunk(out, sizeof(state->out)); } // the previous chunk was flushed and was the last
+		ALWAYS(out_len != 0);
+		if (out_buffering)
+		{
+			state->out_pos = 0;
+			state->out_avail = out_len;
+		}
+		else { ADVANCE_OUT(stream, out_len); }
+
+		// Keep the chunk as the window for the next chunk
+		if (is_end) { state->end_written = true; }
+		else if (state->in_window)
+		{
+			memmove(state->in, state->in + CHUNK_SIZE, state->in_avail -= CHUNK_SIZE);
+			state->d.Slide();
+		}
+		else { state->in_window = CHUNK_SIZE; }
+	}
+
+	if (flush == MSCOMP_FINISH && state->end_written && !stream->in_avail && !state->out_avail)
+	{
+		state->finished = true;
+		return MSCOMP_STREAM_END;
+	}
+	return MSCOMP_OK;
+}
+ENTRY_POINT MSCompStatus xpress_huff_deflate(mscomp_stream* stream, MSCompFlush flush)
+{
+	const mscomp_xpress_huff_compress_state* state = (const mscomp_xpress_huff_compress_state*) stream->state;
+	CHECK_STREAM_PLUS(stream, true, MSCOMP_XPRESS_HUFF, state == NULL || state->finished);
+	XPRESS_DICTIONARY_LEVEL_SWITCH(state->level, xh_deflate, (stream, flush))
+}
+template <unsigned Level>
+static MSCompStatus xh_deflate_end(mscomp_stream* stream)
+{
+	xh_compress_level_state<Level>* state = (xh_compress_level_state<Level>*) stream->state;
+
+	MSCompStatus status = MSCOMP_OK;
+	if (UNLIKELY(!state->finished || stream->in_avail || state->out_avail)) { SET_ERROR(stream, "Xpress Huffman Compression Error: End prematurely called"); status = MSCOMP_DATA_ERROR; }
+
+	// Cleanup
+	typedef typename xh_compress_level_state<Level>::Dict Dict;
+	state->d.~Dict();
+	state->encoder.~Encoder();
+	free(state);
+	stream->state = NULL;
+
+	return status;
+}
+MSCompStatus xpress_huff_deflate_end(mscomp_stream* stream)
+{
+	CHECK_STREAM_PLUS(stream, true, MSCOMP_XPRESS_HUFF, stream->state == NULL);
+	XPRESS_DICTIONARY_LEVEL_SWITCH(((mscomp_xpress_huff_compress_state*) stream->state)->level, xh_deflate_end, (stream))
+}
 
 #endif
@@ -22,6 +22,7 @@
 #include "../include/xpress_huff.h"
 #include "../include/mscomp/Bitstream.h"
 #include "../include/mscomp/HuffmanDecoder.h"
+#include "../include/mscomp/Threads.h"
 
 #define PRINT_ERROR(...) // TODO: remove
 
@@ -32,50 +33,382 @@
 #define HALF_SYMBOLS	0x100
 #define HUFF_BITS_MAX	15
 #define MIN_DATA		HALF_SYMBOLS + 4 // the 512 Huffman lens + 2 uint16s for minimal bitstream
-typedef HuffmanDecoder<HUFF_BITS_MAX, SYMBOLS> Decoder;
+
+// The offset bits directly follow the code of a match symbol unless it has extra length bytes
+struct XpressHuffExtraBits { static FORCE_INLINE uint_fast8_t Get(uint_fast16_t sym) { return (sym >= HALF_SYMBOLS && (sym & 0xF) != 0xF) ? (uint_fast8_t)((sym >> 4) & 0xF) : 0; } };
+
+// The Huffman decoder remembers the chunk header it was last built from and only rebuilds its
+// table when the header changes, which is common for homogeneous data
+class Decoder : public HuffmanDecoder<HUFF_BITS_MAX, SYMBOLS, HALF_SYMBOLS, XpressHuffExtraBits>
+{
+private:
+	byte header[HALF_SYMBOLS];
+	bool valid;
+
+public:
+	INLINE Decoder() : valid(false) { }
+
+	// Sets the codes from the header of a chunk (which must have at least HALF_SYMBOLS bytes)
+	INLINE bool SetHeader(const_bytes in)
+	{
+		if (this->valid && memcmp(this->header, in, HALF_SYMBOLS) == 0) { return true; }
+		byte code_lengths[SYMBOLS];
+		for (uint_fast16_t i = 0, i2 = 0; i < HALF_SYMBOLS; ++i)
+		{
+			code_lengths[i2++] = (in[i] & 0xF);
+			code_lengths[i2++] = (in[i] >>  4);
+		}
+		if ((this->valid = this->SetCodeLengths(code_lengths)) == true) { memcpy(this->header, in, HALF_SYMBOLS); }
+		return this->valid;
+	}
+};
+#if PNTR_BITS >= 64
+typedef InputBitstream64 Bitstream;
+#else
+typedef InputBitstream Bitstream;
+#endif
+
+#define WINDOW_SIZE		0x10000 // the largest offset is 0xFFFF
+#define OUT_BUF_SIZE	(WINDOW_SIZE + 0x10000)
+
+typedef struct
+{ // ~135 kb (+padding)
+	Decoder decoder;
+	bool in_chunk, possible_end;
+	uint32_t mask;				// the saved bitstream state while in a chunk
+	uint_fast8_t bits;
+	size_t chunk_out;			// number of bytes output in the current chunk
+	uint32_t copy_off, copy_len;// a match that did not fit in out
+	byte in[2*MIN_DATA];		// input that was not enough for the next step
+	size_t in_avail;
+	byte out[OUT_BUF_SIZE];		// the window followed by the output not yet written to the stream
+	size_t out_len, out_pos, out_avail;
+} mscomp_xpress_huff_decompress_state;
+
+
+// A set of ranges of output bytes that are needed, used to find which deferred copies need to be
+// done when only some of the output is wanted. The ranges are kept in a max-heap by their ends.
+// Intersects must be called with decreasing ranges, ranges above the one given are dropped.
+class NeededRanges
+{
+private:
+	typedef struct { const_bytes start, end; } Range;
+	Range* ranges; // 1-based heap
+	size_t count, capacity;
+	const_bytes min;
+
+public:
+	INLINE NeededRanges(const const_bytes start) : ranges(NULL), count(0), capacity(0), min(start) { }
+	INLINE ~NeededRanges() { free(this->ranges); }
+	INLINE const_bytes Min() const { return this->min; }
+
+	// Adds a range, returns false if out of memory
+	INLINE bool Add(const const_bytes start, const const_bytes end)
+	{
+		if (this->count + 1 >= this->capacity)
+		{
+			const size_t capacity = this->capacity ? 2 * this->capacity : 0x100;
+			Range* ranges = (Range*)realloc(this->ranges, capacity * sizeof(Range));
+			if (UNLIKELY(ranges == NULL)) { return false; }
+			this->ranges = ranges;
+			this->capacity = capacity;
+		}
+		size_t j = ++this->count;
+		for (; j > 1 && this->ranges[j>>1].end < end; j >>= 1) { this->ranges[j] = this->ranges[j>>1]; }
+		this->ranges[j].start = start;
+		this->ranges[j].end = end;
+		if (start < this->min) { this->min = start; }
+		return true;
+	}
+
+	// Checks if any needed byte is in [start, end)
+	INLINE bool Intersects(const const_bytes start, const const_bytes end)
+	{
+		while (this->count && this->ranges[1].end > start)
+		{
+			if (this->ranges[1].start < end) { return true; }
+			// Remove the range at the top since it is after this range and all later ones
+			const Range r = this->ranges[this->count--];
+			size_t i = 1;
+			for (size_t j = 2; j <= this->count; i = j, j <<= 1)
+			{
+				if (j < this->count && this->ranges[j+1].end > this->ranges[j].end) { ++j; }
+				if (this->ranges[j].end <= r.end) { break; }
+				this->ranges[i] = this->ranges[j];
+			}
+			this->ranges[i] = r;
+		}
+		return false;
+	}
+};
+
+// Copies whose source data is not available yet, used when chunks are decompressed independently
+// of the chunks before them. Everything before start is dirty (unavailable) as is everything that
+// a deferred copy writes. A copy that reads any dirty byte is deferred instead of being done, so
+// every other byte written is correct. Once the data before start is available Finish does the
+// deferred copies in order. When only some of the output is wanted, MarkNeeded finds the copies
+// that are needed for it and what data they need so that FinishNeeded only does those.
+typedef struct
+{
+	bytes out;
+	uint32_t len;
+	uint16_t off;
+	bool needed;
+} xh_deferred_copy;
+class DeferredCopies
+{
+private:
+	const_bytes start;
+	xh_deferred_copy* copies;
+	size_t count, capacity;
+	bool mem_error;
+
+	INLINE bool IsDirty(const const_bytes src, const const_bytes src_end) const
+	{
+		if (src < this->start) { return true; }
+		// Find the last copy that starts before src_end, the copies are sorted and do not overlap
+		size_t lo = 0, hi = this->count;
+		while (lo < hi)
+		{
+			const size_t mid = (lo + hi) / 2;
+			if (this->copies[mid].out < src_end) { lo = mid + 1; } else { hi = mid; }
+		}
+		return lo > 0 && this->copies[lo-1].out + this->copies[lo-1].len > src;
+	}
+	FORCE_INLINE static void Copy(const xh_deferred_copy* c)
+	{
+		if (c->off >= c->len) { memcpy(c->out, c->out - c->off, c->len); }
+		else { for (bytes out = c->out, end = out + c->len; out < end; ++out) { *out = *(out - c->off); } }
+	}
+
+public:
+	const_bytes clean; // everything from here to the current output position is not dirty
+
+	INLINE DeferredCopies(const const_bytes start) : start(start), copies(NULL), count(0), capacity(0), mem_error(false), clean(start) { }
+	INLINE ~DeferredCopies() { free(this->copies); }
+	INLINE bool HadMemError() const { return this->mem_error; }
+
+	// Checks if a copy of len bytes to out from off bytes before it reads any dirty data, and if so
+	// records it, making its output dirty. Should only be called when out-off < clean.
+	INLINE bool Defer(const bytes out, const uint32_t off, const uint32_t len)
+	{
+		const const_bytes src = out - off;
+		if (!this->IsDirty(src, off < len ? out : src + len)) { return false; } // bytes from out on are written by the copy itself
+		if (this->count == this->capacity)
+		{
+			const size_t capacity = this->capacity ? 2 * this->capacity : 0x400;
+			xh_deferred_copy* copies = (xh_deferred_copy*)realloc(this->copies, capacity * sizeof(xh_deferred_copy));
+			if (UNLIKELY(copies == NULL)) { this->mem_error = true; return true; } // the output is left wrong, reported later
+			this->copies = copies;
+			this->capacity = capacity;
+		}
+		xh_deferred_copy* c = this->copies + this->count++;
+		c->out = out; c->off = (uint16_t)off; c->len = len; c->needed = false; // offsets are always less than 0x10000
+		this->clean = out + len;
+		return true;
+	}
+
+	// Does all of the deferred copies, the data before start must now be available
+	INLINE void Finish()
+	{
+		for (const xh_deferred_copy *c = this->copies, *end = c + this->count; c < end; ++c) { Copy(c); }
+		this->count = 0;
+		this->clean = this->start;
+	}
+
+	// Marks the copies that write needed bytes and adds the data they read to the needed bytes. Must
+	// be called on later chunks first. Returns false if out of memory.
+	INLINE bool MarkNeeded(NeededRanges* needed)
+	{
+		// Copies only read from before themselves so going backwards finds all of them in one pass
+		for (size_t i = this->count; i-- > 0; )
+		{
+			xh_deferred_copy* c = this->copies + i;
+			if (needed->Intersects(c->out, c->out + c->len))
+			{
+				c->needed = true;
+				const const_bytes src = c->out - c->off;
+				if (UNLIKELY(!needed->Add(src, c->off < c->len ? c->out : src + c->len))) { return false; }
+			}
+		}
+		return true;
+	}
+
+	// Does the deferred copies marked by MarkNeeded, the data they read must now be available
+	INLINE void FinishNeeded()
+	{
+		for (const xh_deferred_copy *c = this->copies, *end = c + this->count; c < end; ++c) { if (c->needed) { Copy(c); } }
+		this->count = 0;
+		this->clean = this->start;
+	}
+};
+
+// Where the decoded data of a chunk goes. WriteOutput writes it to memory, giving copies that read
+// dirty data to a DeferredCopies when Deferred is true. When Padded is true the output has
+// MSCOMP_DECOMPRESS_PADDING writable bytes after its end so the fast loop can run to the end.
+// CountOutput only counts the bytes, which is used to build a chunk index without any output
+// buffer. The chunk decoder only reaches the output through these so both use the same loops. Pos
+// is the output position (and Bound a limit on it): a pointer for WriteOutput and the number of
+// bytes from the start of the data for CountOutput.
+template <bool Deferred, bool Padded = false>
+struct WriteOutput
+{
+	CASSERT(!Deferred || !Padded);
+	CASSERT(MSCOMP_DECOMPRESS_PADDING >= FAST_COPY_ROOM);
+	static const bool IsPadded = Padded;
+	typedef bytes Pos;
+	typedef const_bytes Bound;
+	static FORCE_INLINE void Literal(Pos* out, const byte x) { *(*out)++ = x; }
+	static FORCE_INLINE void Literals(Pos* out, const uint16_t x) { SET_UINT16(*out, x); *out += 2; }
+	static FORCE_INLINE void Copy(Pos* _out, const uint32_t off, const uint32_t len)
+	{
+		bytes out = *_out;
+		if (off == 1) { memset(out, out[-1], len); out += len; }
+		else { for (const_bytes end = out + len; out < end; ++out) { *out = *(out-off); } }
+		*_out = out;
+	}
+	// Copies a match while out is before out_endx, if it stops there the rest of the match is left
+	// in len and false is returned
+	static FORCE_INLINE bool CopyFast(Pos* _out, const uint32_t off, uint32_t* _len, const Bound out_endx)
+	{
+		bytes out = *_out;
+		const_bytes o = out - off;
+		uint32_t len = *_len;
+		FAST_COPY(out, o, len, off, out_endx,
+			*_out = out; *_len = len;
+			return false);
+		*_out = out;
+		return true;
+	}
+	// Gives the copy to deferred if it reads dirty data and fits before out_end
+	static FORCE_INLINE bool Defer(DeferredCopies* deferred, const Pos out, const uint32_t off, const uint32_t len, const Bound out_end)
+	{
+		return Deferred && out - off < deferred->clean && len <= (size_t)(out_end - out) && deferred->Defer(out, off, len);
+	}
+};
+struct CountOutput
+{
+	static const bool IsPadded = false;
+	typedef size_t Pos;
+	typedef size_t Bound;
+	static FORCE_INLINE void Literal(Pos* out, const byte) { ++*out; }
+	static FORCE_INLINE void Literals(Pos* out, const uint16_t) { *out += 2; }
+	static FORCE_INLINE void Copy(Pos* out, const uint32_t, const uint32_t len) { *out += len; }
+	static FORCE_INLINE bool CopyFast(Pos* out, const uint32_t, uint32_t* len, const Bound out_endx) { if (UNLIKELY(*len > out_endx - *out)) { return false; } *out += *len; return true; }
+	static FORCE_INLINE bool Defer(DeferredCopies*, const Pos, const uint32_t, const uint32_t, const Bound) { return false; }
+};
 
 
 ////////////////////////////// Decompression Functions /////////////////////////////////////////////
-static MSCompStatus xpress_huff_decompress_chunk(const_bytes* _in, const const_bytes in_end, bytes* _out, const const_bytes out_end, const const_bytes out_origin, Decoder *decoder)
+// Reads the Huffman code lengths from the header of a chunk (in must have at least HALF_SYMBOLS bytes)
+static INLINE bool xpress_huff_read_code_lengths(const_bytes in, Decoder *decoder)
 {
-	InputBitstream bstr(*_in, in_end);
-	const const_bytes in_endx  = in_end - 13; // 6 bytes for the up-to 30 bits we may need (along with the 16-bit alignments the bitstream does) + 7 for an extra length bytes
-	bytes out = *_out;
-	const const_bytes out_endx = out_end - FAST_COPY_ROOM, out_end_chunk = out + CHUNK_SIZE, out_endx_chunk = MIN(out_end_chunk, out_endx);
+	if (UNLIKELY(!decoder->SetHeader(in))) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Unable to resolve Huffman codes\n"); return false; }
+	return true;
+}
+// Decompresses a single symbol (or two literals) with minimal bounds checking, see
+// xpress_huff_decompress_fast for the conditions that make that safe. Returns 0 to keep going, 1
+// when a match reaches past out_endx (with len and off set for the caller to finish it), or a
+// negative MSCompStatus on an error.
+template <class Bitstream, class Output>
+static FORCE_INLINE int xpress_huff_decompress_fast_step(Bitstream* bstr, typename Output::Pos* _out, const typename Output::Bound out_endx, const typename Output::Bound out_origin, const Decoder *decoder, uint32_t* _len, uint32_t* _off, DeferredCopies* deferred)
+{
+	typename Output::Pos out = *_out;
 	uint32_t len, off;
-	uint_fast16_t sym;
-
-	// Fast decompression - minimal bounds checking
-	while (LIKELY(out < out_endx_chunk && bstr.RawStream() < in_endx))
+	bstr->Refill_Fast();
+	const uint32_t e = decoder->LookupFast(bstr);
+	const uint_fast32_t sym = Decoder::SymbolOf(e);
+	if (sym < 0x100) { bstr->Skip_Fast(Decoder::BitsOf(e)); Output::Literal(&out, (byte)sym); }
+	else if (sym > 0xFFFF) { bstr->Skip_Fast(Decoder::BitsOf(e)); Output::Literals(&out, (uint16_t)sym); } // two literals
+	else
 	{
-		sym = decoder->DecodeSymbolFast(&bstr);
 		// TODO: figure out if the following line can ever happen, if not it gives up to a 5 MB/s speedup
 		if (UNLIKELY(sym == INVALID_SYMBOL))	{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Unable to read enough bits for symbol\n"); return MSCOMP_DATA_ERROR; }
-		if (sym < 0x100) { *out++ = (byte)sym; }
-		else
+		const uint_fast8_t off_bits = (uint_fast8_t)((sym>>4) & 0xF);
+		if ((len = sym & 0xF) == 0xF)
 		{
-			const uint_fast8_t off_bits = (uint_fast8_t)((sym>>4) & 0xF);
-			if ((len = sym & 0xF) == 0xF)
+			bstr->Skip_Fast(Decoder::BitsOf(e));
+			if ((len = bstr->ReadRawByte()) == 0xFF)
 			{
-				if ((len = bstr.ReadRawByte()) == 0xFF)
-				{
-					if (UNLIKELY((len = bstr.ReadRawUInt16()) == 0)) { len = bstr.ReadRawUInt32(); }
-					if (UNLIKELY(len < 0xF))	{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Invalid length specified\n"); return MSCOMP_DATA_ERROR; }
-					len -= 0xF;
-				}
-				len += 0xF;
+				if (UNLIKELY((len = bstr->ReadRawUInt16()) == 0)) { len = bstr->ReadRawUInt32(); }
+				if (UNLIKELY(len < 0xF))	{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Invalid length specified\n"); return MSCOMP_DATA_ERROR; }
+				len -= 0xF;
 			}
-			len += 3;
-			off = bstr.ReadBits_Fast(off_bits) | (1 << off_bits);
-			const_bytes o = out-off;
-			if (UNLIKELY(o < out_origin))		{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Invalid offset\n"); return MSCOMP_DATA_ERROR; }
-			FAST_COPY(out, o, len, off, out_endx,
-				if (UNLIKELY(out + len > out_end)) { return MSCOMP_BUF_ERROR; }
-				goto CHECKED_COPY);
+			len += 0xF;
+			off = bstr->ReadBits_Fast(off_bits) | (1 << off_bits);
+		}
+		else if (Bitstream::PeekBitsMax >= HUFF_BITS_MAX + 0xF)
+		{
+			// The code and the offset bits are read at once, the offset bits are the low bits
+			const uint_fast8_t n = Decoder::BitsWithExtraOf(e);
+			off = (bstr->Peek(n) & ((1 << off_bits) - 1)) | (1 << off_bits);
+			bstr->Skip_Fast(n);
+		}
+		else
+		{
+			bstr->Skip_Fast(Decoder::BitsOf(e));
+			off = bstr->ReadBits_Fast(off_bits) | (1 << off_bits);
 		}
+		len += 3;
+		if (UNLIKELY(off > (size_t)(out - out_origin)))	{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Invalid offset\n"); return MSCOMP_DATA_ERROR; }
+		if (UNLIKELY(Output::Defer(deferred, out, off, len, out_endx + FAST_COPY_ROOM))) { *_out = out + len; return 0; }
+		if (UNLIKELY(!Output::CopyFast(&out, off, &len, out_endx))) { *_out = out; *_len = len; *_off = off; return 1; }
+	}
+	*_out = out;
+	return 0;
+}
+// Decompresses symbols with minimal bounds checking while out is before out_endx_loop and the
+// bitstream has not loaded past in_endx. Matches are copied quickly up to out_endx, if a match
+// reaches past that then the number of bytes left to copy and the offset are given in len and off
+// so that the caller can finish it with bounds checking, otherwise len is set to 0. The Output may
+// give copies that read dirty data to deferred instead (which must then not be NULL).
+template <class Bitstream, class Output>
+static FORCE_INLINE MSCompStatus xpress_huff_decompress_fast(Bitstream* bstr, const const_bytes in_endx, typename Output::Pos* _out, const typename Output::Bound out_endx_loop, const typename Output::Bound out_endx, const typename Output::Bound out_origin, const Decoder *decoder, uint32_t* _len, uint32_t* _off, DeferredCopies* deferred)
+{
+	typename Output::Pos out = *_out;
+	while (LIKELY(out < out_endx_loop && bstr->LoadedStream() < in_endx))
+	{
+		const int r = xpress_huff_decompress_fast_step<Bitstream, Output>(bstr, &out, out_endx, out_origin, decoder, _len, _off, deferred);
+		if (UNLIKELY(r != 0)) { *_out = out; return r < 0 ? (MSCompStatus)r : MSCOMP_OK; }
+	}
+	*_out = out;
+	*_len = 0;
+	return MSCOMP_OK;
+}
+// The bounds for the fast decompression of a chunk
+#define XH_IN_ENDX(in_end)						((in_end) - 13) // 6 bytes for the up-to 30 bits we may need (along with the 16-bit alignments the bitstream does) + 7 for an extra length bytes
+#define XH_OUT_ENDX(out_end)					((out_end) - FAST_COPY_ROOM)
+#define XH_OUT_ENDX_PADDED(out_end)				(out_end) // the copies may write up to FAST_COPY_ROOM bytes into the padding
+#define XH_OUT_ENDX_CHUNK(out_end_chunk, out_endx)	MIN((out_end_chunk) - 1, (out_endx)) // -1 since two literals may be written at once
+
+// Finishes decompressing a chunk that ends at out_end_chunk (unless the stream ends) starting with
+// a copy of the bitstream bstr_start.
+// If len is not 0 then the fast decompression was already done and stopped in the middle of a match
+// (len and off are from xpress_huff_decompress_fast).
+template <class Bitstream, class Output>
+static FORCE_INLINE MSCompStatus xh_decompress_chunk_rest(const Bitstream& bstr_start, const_bytes* _in, const const_bytes in_end, typename Output::Pos* _out, const typename Output::Bound out_end, const typename Output::Bound out_end_chunk, const typename Output::Bound out_origin, const Decoder *decoder, DeferredCopies* deferred, uint32_t len, uint32_t off)
+{
+	Bitstream bstr(bstr_start); // a local copy so that the writes to out cannot alias it
+	typename Output::Pos out = *_out;
+	uint_fast32_t sym;
+
+	// Fast decompression - minimal bounds checking
+	if (!len)
+	{
+		const typename Output::Bound out_endx = Output::IsPadded ? XH_OUT_ENDX_PADDED(out_end) : XH_OUT_ENDX(out_end);
+		MSCompStatus status = xpress_huff_decompress_fast<Bitstream, Output>(&bstr, XH_IN_ENDX(in_end), &out, XH_OUT_ENDX_CHUNK(out_end_chunk, out_endx), out_endx, out_origin, decoder, &len, &off, deferred);
+		if (UNLIKELY(status != MSCOMP_OK)) { return status; }
+		if (Output::IsPadded && UNLIKELY(out > out_end)) { PRINT_ERROR("XPRESS Huffman Decompression Error: Insufficient buffer\n"); return MSCOMP_BUF_ERROR; } // a copy ran into the padding
+	}
+	if (len)
+	{
+		// Finish a match that was stopped near the end of the output
+		if (UNLIKELY(len > (size_t)(out_end - out))) { return MSCOMP_BUF_ERROR; }
+		Output::Copy(&out, off, len);
 	}
 
 	// Slow decompression - full bounds checking
+	bstr.Refill();
 	while (out < out_end_chunk || !bstr.MaskIsZero()) /* end of chunk, not stream */
 	{
 		sym = decoder->DecodeSymbol(&bstr);
@@ -84,7 +417,7 @@ static MSCompStatus xpress_huff_decompress_chunk(const_bytes* _in, const const_b
 		if (sym < 0x100)
 		{
 			if (UNLIKELY(out == out_end))							{ PRINT_ERROR("XPRESS Huffman Decompression Error: Insufficient buffer\n"); return MSCOMP_BUF_ERROR; }
-			*out++ = (byte)sym;
+			Output::Literal(&out, (byte)sym);
 		}
 		else
 		{
@@ -110,18 +443,10 @@ static MSCompStatus xpress_huff_decompress_chunk(const_bytes* _in, const const_b
 				if (UNLIKELY(off_bits > bstr.AvailableBits()))		{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Unable to read %u bits for offset\n", sym); return MSCOMP_DATA_ERROR; }
 				off = bstr.ReadBits(off_bits) + (1 << off_bits);
 			}
-			if (UNLIKELY(out - off < out_origin))					{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Illegal offset (%p-%u < %p)\n", out, off, out_origin); return MSCOMP_DATA_ERROR; }
-			if (UNLIKELY(out + len > out_end))						{ PRINT_ERROR("XPRESS Huffman Decompression Error: Insufficient buffer\n"); return MSCOMP_BUF_ERROR; }
-			if (off == 1)
-			{
-				memset(out, out[-1], len);
-				out += len;
-			}
-			else
-			{
-				const_bytes end;
-CHECKED_COPY:	for (end = out + len; out < end; ++out) { *out = *(out-off); }
-			}
+			if (UNLIKELY(off > (size_t)(out - out_origin)))			{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Illegal offset\n"); return MSCOMP_DATA_ERROR; }
+			if (UNLIKELY(len > (size_t)(out_end - out)))			{ PRINT_ERROR("XPRESS Huffman Decompression Error: Insufficient buffer\n"); return MSCOMP_BUF_ERROR; }
+			if (Output::Defer(deferred, out, off, len, out_end)) { out += len; }
+			else { Output::Copy(&out, off, len); }
 		}
 	}
 	*_out = out;
@@ -133,13 +458,33 @@ CHECKED_COPY:	for (end = out + len; out < end; ++out) { *out = *(out-off); }
 	}
 	return MSCOMP_OK;
 }
-ENTRY_POINT MSCompStatus xpress_huff_decompress(const_bytes in, size_t in_len, bytes out, size_t* out_len)
+// The rest of a chunk is compiled for any processor and, when possible, for ones with BMI2
+template <class Bitstream, class Output>
+static MSCompStatus xh_decompress_chunk_rest_generic(const Bitstream& bstr_start, const_bytes* _in, const const_bytes in_end, typename Output::Pos* _out, const typename Output::Bound out_end, const typename Output::Bound out_end_chunk, const typename Output::Bound out_origin, const Decoder *decoder, DeferredCopies* deferred, uint32_t len, uint32_t off) { return xh_decompress_chunk_rest<Bitstream, Output>(bstr_start, _in, in_end, _out, out_end, out_end_chunk, out_origin, decoder, deferred, len, off); }
+#ifdef MSCOMP_BMI2_DISPATCH
+template <class Bitstream, class Output>
+static TARGET_BMI2 MSCompStatus xh_decompress_chunk_rest_bmi2(const Bitstream& bstr_start, const_bytes* _in, const const_bytes in_end, typename Output::Pos* _out, const typename Output::Bound out_end, const typename Output::Bound out_end_chunk, const typename Output::Bound out_origin, const Decoder *decoder, DeferredCopies* deferred, uint32_t len, uint32_t off) { return xh_decompress_chunk_rest<Bitstream, Output>(bstr_start, _in, in_end, _out, out_end, out_end_chunk, out_origin, decoder, deferred, len, off); }
+static const bool has_bmi2 = HAS_BMI2(); // checked once when loaded instead of every chunk
+#endif
+template <class Bitstream, class Output>
+static FORCE_INLINE MSCompStatus xpress_huff_decompress_chunk_rest(const Bitstream& bstr_start, const_bytes* _in, const const_bytes in_end, typename Output::Pos* _out, const typename Output::Bound out_end, const typename Output::Bound out_end_chunk, const typename Output::Bound out_origin, const Decoder *decoder, DeferredCopies* deferred, uint32_t len, uint32_t off)
+{
+#ifdef MSCOMP_BMI2_DISPATCH
+	if (has_bmi2) { return xh_decompress_chunk_rest_bmi2<Bitstream, Output>(bstr_start, _in, in_end, _out, out_end, out_end_chunk, out_origin, decoder, deferred, len, off); }
+#endif
+	return xh_decompress_chunk_rest_generic<Bitstream, Output>(bstr_start, _in, in_end, _out, out_end, out_end_chunk, out_origin, decoder, deferred, len, off);
+}
+template <class Bitstream, class Output>
+static FORCE_INLINE MSCompStatus xpress_huff_decompress_chunk(const_bytes* _in, const const_bytes in_end, typename Output::Pos* _out, const typename Output::Bound out_end, const typename Output::Bound out_origin, Decoder *decoder, DeferredCopies* deferred)
+{
+	return xpress_huff_decompress_chunk_rest<Bitstream, Output>(Bitstream(*_in, in_end), _in, in_end, _out, out_end, *_out + CHUNK_SIZE, out_origin, decoder, deferred, 0, 0);
+}
+template <class Output>
+static MSCompStatus xh_decompress(const_bytes in, size_t in_len, bytes out, size_t* out_len, Decoder *decoder)
 {
 	const const_bytes                  in_end  = in  + in_len;
 	const const_bytes out_start = out, out_end = out + *out_len;
 	MSCompStatus status;
-	Decoder decoder;
-	byte code_lengths[SYMBOLS];
 	do
 	{
 		if (UNLIKELY(in_end - in < MIN_DATA))
@@ -147,18 +492,704 @@ ENTRY_POINT MSCompStatus xpress_huff_decompress(const_bytes in, size_t in_len, b
 			if (in != in_end) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Less than %d input bytes\n", MIN_DATA); return MSCOMP_DATA_ERROR; }
 			break;
 		}
-		for (uint_fast16_t i = 0, i2 = 0; i < HALF_SYMBOLS; ++i)
-		{
-			code_lengths[i2++] = (in[i] & 0xF);
-			code_lengths[i2++] = (in[i] >>  4);
-		}
+		if (UNLIKELY(!xpress_huff_read_code_lengths(in, decoder))) { return MSCOMP_DATA_ERROR; }
 		in += HALF_SYMBOLS;
-		if (UNLIKELY(!decoder.SetCodeLengths(code_lengths))) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Unable to resolve Huffman codes\n"); return MSCOMP_DATA_ERROR; }
-		status = xpress_huff_decompress_chunk(&in, in_end, &out, out_end, out_start, &decoder);
+		status = xpress_huff_decompress_chunk<Bitstream, Output>(&in, in_end, &out, out_end, out_start, decoder, NULL);
 		if (UNLIKELY(status < MSCOMP_OK)) { return status; }
 	} while (status != MSCOMP_STREAM_END);
 	*out_len = out-out_start;
 	return MSCOMP_OK;
 }
+ENTRY_POINT MSCompStatus xpress_huff_decompress(const_bytes in, size_t in_len, bytes out, size_t* out_len) { Decoder decoder; return xh_decompress<WriteOutput<false> >(in, in_len, out, out_len, &decoder); }
+ENTRY_POINT MSCompStatus xpress_huff_decompress_padded(const_bytes in, size_t in_len, bytes out, size_t* out_len) { Decoder decoder; return xh_decompress<WriteOutput<false, true> >(in, in_len, out, out_len, &decoder); }
+
+
+////////////////////////////// Multiple Streams ////////////////////////////////////////////////////
+// Two streams are decompressed at once by alternating symbols between them in the fast loop so that
+// the processor can work on both of their chains of dependent table lookups and shifts at the same
+// time. More streams do not help since there are not enough registers.
+
+// A stream being decompressed by xpress_huff_decompress_multi
+struct xh_multi_stream
+{
+	size_t i; // the index of the stream in the arguments
+	const_bytes in, in_end;
+	bytes out, out_start, out_end, out_end_chunk;
+	union { byte mem[sizeof(Bitstream)]; uint64_t align; } bstr_mem; // the bitstream of the current chunk
+	Decoder decoder;
+	FORCE_INLINE Bitstream* bstr() { return (Bitstream*)this->bstr_mem.mem; }
+};
+// Starts the next chunk of a stream, returns false if the stream is done
+static bool xh_multi_start_chunk(xh_multi_stream* s, size_t* out_len, MSCompStatus* status)
+{
+	if (UNLIKELY(s->in_end - s->in < MIN_DATA))
+	{
+		if (s->in != s->in_end) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Less than %d input bytes\n", MIN_DATA); status[s->i] = MSCOMP_DATA_ERROR; }
+		else { out_len[s->i] = s->out - s->out_start; status[s->i] = MSCOMP_OK; }
+		return false;
+	}
+	if (UNLIKELY(!xpress_huff_read_code_lengths(s->in, &s->decoder))) { status[s->i] = MSCOMP_DATA_ERROR; return false; }
+	s->in += HALF_SYMBOLS;
+	new (s->bstr()) Bitstream(s->in, s->in_end);
+	s->out_end_chunk = s->out + CHUNK_SIZE;
+	return true;
+}
+// Finishes the current chunk of a stream, possibly in the middle of a match given by len and off,
+// returns false if the stream is done
+static bool xh_multi_finish_chunk(xh_multi_stream* s, uint32_t len, uint32_t off, size_t* out_len, MSCompStatus* status)
+{
+	const MSCompStatus st = xpress_huff_decompress_chunk_rest<Bitstream, WriteOutput<false> >(*s->bstr(), &s->in, s->in_end, &s->out, s->out_end, s->out_end_chunk, s->out_start, &s->decoder, NULL, len, off);
+	if (LIKELY(st == MSCOMP_OK)) { return true; }
+	if (st == MSCOMP_STREAM_END) { out_len[s->i] = s->out - s->out_start; status[s->i] = MSCOMP_OK; }
+	else { status[s->i] = st; }
+	return false;
+}
+// Moves a stream to its next chunk if it has more, otherwise to the next stream in the arguments
+// that has any chunks, returns false if there are none left
+static bool xh_multi_next(xh_multi_stream* s, bool more, const const_bytes* in, const size_t* in_len, const bytes* out, size_t* out_len, MSCompStatus* status, size_t* next, size_t n)
+{
+	if (more && xh_multi_start_chunk(s, out_len, status)) { return true; }
+	while (*next < n)
+	{
+		const size_t i = (*next)++;
+		s->i = i;
+		s->in = in[i]; s->in_end = in[i] + in_len[i];
+		s->out = s->out_start = out[i]; s->out_end = out[i] + out_len[i];
+		if (xh_multi_start_chunk(s, out_len, status)) { return true; }
+	}
+	return false;
+}
+ENTRY_POINT MSCompStatus xpress_huff_decompress_multi(const const_bytes* in, const size_t* in_len, const bytes* out, size_t* out_len, MSCompStatus* status, size_t n)
+{
+	xh_multi_stream a, b;
+	size_t next = 0;
+	bool have_a = xh_multi_next(&a, false, in, in_len, out, out_len, status, &next, n);
+	bool have_b = have_a && xh_multi_next(&b, false, in, in_len, out, out_len, status, &next, n);
+	while (have_a && have_b)
+	{
+		// Fast decompression of both streams until one of them has to leave it
+		Bitstream bstr_a(*a.bstr()), bstr_b(*b.bstr());
+		bytes out_a = a.out, out_b = b.out;
+		const const_bytes in_endx_a = XH_IN_ENDX(a.in_end), out_endx_a = XH_OUT_ENDX(a.out_end), out_endx_chunk_a = XH_OUT_ENDX_CHUNK(a.out_end_chunk, out_endx_a);
+		const const_bytes in_endx_b = XH_IN_ENDX(b.in_end), out_endx_b = XH_OUT_ENDX(b.out_end), out_endx_chunk_b = XH_OUT_ENDX_CHUNK(b.out_end_chunk, out_endx_b);
+		uint32_t len = 0, off = 0;
+		int r;
+		bool stopped_a;
+		for (;;)
+		{
+			if (UNLIKELY(out_a >= out_endx_chunk_a || bstr_a.LoadedStream() >= in_endx_a)) { r = 0; stopped_a = true;  break; }
+			if (UNLIKELY(out_b >= out_endx_chunk_b || bstr_b.LoadedStream() >= in_endx_b)) { r = 0; stopped_a = false; break; }
+			if (UNLIKELY((r = xpress_huff_decompress_fast_step<Bitstream, WriteOutput<false> >(&bstr_a, &out_a, out_endx_a, a.out_start, &a.decoder, &len, &off, NULL)) != 0)) { stopped_a = true;  break; }
+			if (UNLIKELY((r = xpress_huff_decompress_fast_step<Bitstream, WriteOutput<false> >(&bstr_b, &out_b, out_endx_b, b.out_start, &b.decoder, &len, &off, NULL)) != 0)) { stopped_a = false; break; }
+		}
+		a.out = out_a; new (a.bstr()) Bitstream(bstr_a);
+		b.out = out_b; new (b.bstr()) Bitstream(bstr_b);
+
+		// The stream that stopped finishes its chunk on its own and moves on
+		xh_multi_stream* s = stopped_a ? &a : &b;
+		bool more;
+		if (r < 0) { status[s->i] = (MSCompStatus)r; more = false; }
+		else { more = xh_multi_finish_chunk(s, len, off, out_len, status); }
+		(stopped_a ? have_a : have_b) = xh_multi_next(s, more, in, in_len, out, out_len, status, &next, n);
+	}
+
+	// Finish the last stream on its own
+	if (have_a || have_b)
+	{
+		xh_multi_stream* s = have_a ? &a : &b;
+		while (xh_multi_next(s, xh_multi_finish_chunk(s, 0, 0, out_len, status), in, in_len, out, out_len, status, &next, n));
+	}
+
+	for (size_t i = 0; i < n; ++i) { if (UNLIKELY(status[i] != MSCOMP_OK)) { return status[i]; } }
+	return MSCOMP_OK;
+}
+
+
+////////////////////////////// Chunk Index /////////////////////////////////////////////////////////
+size_t xpress_huff_max_index_len(size_t in_len) { return in_len / MIN_DATA + 1; }
+
+ENTRY_POINT MSCompStatus xpress_huff_index(const_bytes in, size_t in_len, mscomp_xpress_huff_chunk* index, size_t* index_len)
+{
+	const const_bytes in_start = in, in_end = in + in_len;
+	size_t out = 0, n = 0;
+	MSCompStatus status;
+	Decoder decoder;
+	do
+	{
+		if (UNLIKELY(in_end - in < MIN_DATA))
+		{
+			if (in != in_end) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Less than %d input bytes\n", MIN_DATA); return MSCOMP_DATA_ERROR; }
+			break;
+		}
+		if (UNLIKELY(n == *index_len)) { return MSCOMP_BUF_ERROR; }
+		index[n].in_offset = in - in_start;
+		index[n++].out_offset = out;
+		if (UNLIKELY(!xpress_huff_read_code_lengths(in, &decoder))) { return MSCOMP_DATA_ERROR; }
+		in += HALF_SYMBOLS;
+		status = xpress_huff_decompress_chunk<Bitstream, CountOutput>(&in, in_end, &out, SIZE_MAX, 0, &decoder, NULL);
+		if (UNLIKELY(status < MSCOMP_OK)) { return status == MSCOMP_BUF_ERROR ? MSCOMP_DATA_ERROR : status; } // only when the output size does not fit in a size_t
+	} while (status != MSCOMP_STREAM_END);
+	if (UNLIKELY(n == *index_len)) { return MSCOMP_BUF_ERROR; }
+	index[n].in_offset = in - in_start;
+	index[n++].out_offset = out;
+	*index_len = n;
+	return MSCOMP_OK;
+}
+
+// Checks that an index is usable with the compressed data, it still may not match the data
+static bool xpress_huff_check_index(size_t in_len, const mscomp_xpress_huff_chunk* index, size_t index_len)
+{
+	if (UNLIKELY(index_len == 0 || index[0].in_offset != 0 || index[0].out_offset != 0 || index[index_len-1].in_offset > in_len)) { return false; }
+	for (size_t i = 1; i < index_len; ++i)
+	{
+		if (UNLIKELY(index[i].in_offset < index[i-1].in_offset + MIN_DATA || index[i].out_offset < index[i-1].out_offset)) { return false; }
+	}
+	return true;
+}
+
+// Decompresses chunk i of an index, checking that it ends where the index says
+template <bool Deferred>
+static MSCompStatus xpress_huff_decompress_indexed_chunk(const_bytes in, size_t in_len, bytes out, const mscomp_xpress_huff_chunk* index, size_t index_len, size_t i, Decoder *decoder, DeferredCopies* deferred)
+{
+	const const_bytes in_end = in + in_len;
+	const_bytes in_chunk = in + index[i].in_offset;
+	bytes out_chunk = out + index[i].out_offset;
+	const bytes out_end = out + index[i+1].out_offset;
+	if (UNLIKELY(!xpress_huff_read_code_lengths(in_chunk, decoder))) { return MSCOMP_DATA_ERROR; }
+	in_chunk += HALF_SYMBOLS;
+	MSCompStatus status = xpress_huff_decompress_chunk<Bitstream, WriteOutput<Deferred> >(&in_chunk, in_end, &out_chunk, out_end, out, decoder, deferred);
+	if (UNLIKELY(status < MSCOMP_OK)) { return status == MSCOMP_BUF_ERROR ? MSCOMP_DATA_ERROR : status; }
+	const bool last = i + 2 == index_len;
+	if (UNLIKELY(out_chunk != out_end || in_chunk != in + index[i+1].in_offset ||
+		(last ? status == MSCOMP_OK && in_chunk != in_end : status == MSCOMP_STREAM_END)))
+	{
+		PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Chunk does not match the index\n");
+		return MSCOMP_DATA_ERROR;
+	}
+	return MSCOMP_OK;
+}
+
+// Each worker decompresses a contiguous range of chunks. Data from before its range is not
+// available so copies that need it are deferred until all of the workers are done.
+typedef struct
+{
+	const_bytes in;
+	size_t in_len;
+	bytes out;
+	const mscomp_xpress_huff_chunk* index;
+	size_t index_len, first, last; // the range of chunks
+	DeferredCopies* deferred;
+	MSCompStatus status;
+} xh_decompress_mt_job;
+
+static void xh_decompress_mt_run(void* _job)
+{
+	xh_decompress_mt_job* job = (xh_decompress_mt_job*)_job;
+	Decoder* decoder = (Decoder*)malloc(sizeof(Decoder)); // allocated from the heap since threads may have small stacks
+	if (UNLIKELY(decoder == NULL)) { job->status = MSCOMP_MEM_ERROR; return; }
+	new (decoder) Decoder();
+	job->status = MSCOMP_OK;
+	for (size_t i = job->first; i < job->last && job->status == MSCOMP_OK; ++i)
+	{
+		job->status = xpress_huff_decompress_indexed_chunk<true>(job->in, job->in_len, job->out, job->index, job->index_len, i, decoder, job->deferred);
+	}
+	if (job->status == MSCOMP_OK && UNLIKELY(job->deferred->HadMemError())) { job->status = MSCOMP_MEM_ERROR; }
+	decoder->~Decoder();
+	free(decoder);
+}
+
+ENTRY_POINT MSCompStatus xpress_huff_decompress_mt(const_bytes in, size_t in_len, bytes out, size_t* out_len, const mscomp_xpress_huff_chunk* index, size_t index_len, unsigned nthreads)
+{
+	if (UNLIKELY(!xpress_huff_check_index(in_len, index, index_len))) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid index\n"); return MSCOMP_ARG_ERROR; }
+	const size_t n_chunks = index_len - 1, total = index[n_chunks].out_offset;
+	if (UNLIKELY(total > *out_len)) { PRINT_ERROR("Xpress Huffman Decompression Error: Insufficient buffer\n"); return MSCOMP_BUF_ERROR; }
+
+	if (nthreads == 0) { nthreads = Thread::ProcessorCount(); }
+	if (nthreads > n_chunks) { nthreads = (unsigned)n_chunks; }
+	if (nthreads == 0) { *out_len = 0; return MSCOMP_OK; }
+
+	xh_decompress_mt_job* jobs = (xh_decompress_mt_job*)malloc(nthreads * sizeof(xh_decompress_mt_job));
+	DeferredCopies* deferred = (DeferredCopies*)malloc(nthreads * sizeof(DeferredCopies));
+	Thread* threads = (Thread*)malloc(nthreads * sizeof(Thread));
+	if (UNLIKELY(jobs == NULL || deferred == NULL || threads == NULL)) { free(jobs); free(deferred); free(threads); return MSCOMP_MEM_ERROR; }
+
+	// Split the chunks evenly between the workers, the calling thread does the first range
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		jobs[i].in = in;
+		jobs[i].in_len = in_len;
+		jobs[i].out = out;
+		jobs[i].index = index;
+		jobs[i].index_len = index_len;
+		jobs[i].first = n_chunks * i / nthreads;
+		jobs[i].last = n_chunks * (i + 1) / nthreads;
+		jobs[i].deferred = new (deferred + i) DeferredCopies(out + index[jobs[i].first].out_offset);
+	}
+	for (unsigned i = 1; i < nthreads; ++i) { threads[i].Start(&xh_decompress_mt_run, jobs + i); }
+	xh_decompress_mt_run(jobs);
+	for (unsigned i = 1; i < nthreads; ++i) { threads[i].Join(); }
+
+	// Resolve the copies that needed data from before each range, in order
+	MSCompStatus status = MSCOMP_OK;
+	for (unsigned i = 0; i < nthreads; ++i)
+	{
+		if (status == MSCOMP_OK)
+		{
+			if (UNLIKELY(jobs[i].status != MSCOMP_OK)) { status = jobs[i].status; }
+			else { deferred[i].Finish(); }
+		}
+		deferred[i].~DeferredCopies();
+	}
+	free(threads);
+	free(deferred);
+	free(jobs);
+
+	if (status == MSCOMP_OK) { *out_len = total; }
+	return status;
+}
+
+// Finds the chunk that contains the output byte at offset (which must be before the end)
+static size_t xpress_huff_find_chunk(const mscomp_xpress_huff_chunk* index, size_t index_len, size_t offset)
+{
+	size_t lo = 0, hi = index_len - 1;
+	while (lo + 1 < hi)
+	{
+		const size_t mid = (lo + hi) / 2;
+		if (index[mid].out_offset <= offset) { lo = mid; } else { hi = mid; }
+	}
+	return lo;
+}
+
+// Decompresses the chunks before chunk end and writes the last WINDOW_SIZE bytes they output (or
+// all of them if there are fewer) to where they belong relative to origin
+static MSCompStatus xpress_huff_decompress_window(const_bytes in, size_t in_len, const mscomp_xpress_huff_chunk* index, size_t index_len, size_t end, bytes origin)
+{
+	size_t max_chunk = 0;
+	for (size_t c = 0; c < end; ++c) { max_chunk = MAX(max_chunk, index[c+1].out_offset - index[c].out_offset); }
+	const size_t buf_len = WINDOW_SIZE + max_chunk;
+	const bytes buf = (bytes)malloc(buf_len);
+	if (UNLIKELY(buf == NULL)) { return MSCOMP_MEM_ERROR; }
+	Decoder decoder;
+	size_t buf_offset = 0, buf_used = 0; // the offset in the output of the start of buf and the bytes used
+	MSCompStatus status = MSCOMP_OK;
+	for (size_t c = 0; c < end && status == MSCOMP_OK; ++c)
+	{
+		const size_t chunk_len = index[c+1].out_offset - index[c].out_offset;
+		if (buf_used + chunk_len > buf_len)
+		{
+			const size_t keep = MIN(WINDOW_SIZE, buf_used);
+			memmove(buf, buf + buf_used - keep, keep);
+			buf_offset += buf_used - keep;
+			buf_used = keep;
+		}
+		status = xpress_huff_decompress_indexed_chunk<false>(in, in_len, buf - buf_offset, index, index_len, c, &decoder, NULL);
+		buf_used += chunk_len;
+	}
+	if (status == MSCOMP_OK)
+	{
+		const size_t keep = MIN(WINDOW_SIZE, buf_used);
+		memcpy(origin + buf_offset + buf_used - keep, buf + buf_used - keep, keep);
+	}
+	free(buf);
+	return status;
+}
+
+// The most chunks before the ones with the range that are decompressed when the range references
+// data before itself, if even more are needed then the chunks before them are decompressed from
+// the start to get the window instead
+#define RANGE_MAX_CHUNKS_BACK	4
+
+ENTRY_POINT MSCompStatus xpress_huff_decompress_range(const_bytes in, size_t in_len, const mscomp_xpress_huff_chunk* index, size_t index_len, size_t out_offset, bytes out, size_t* out_len)
+{
+	if (UNLIKELY(!xpress_huff_check_index(in_len, index, index_len) || out_offset > index[index_len-1].out_offset)) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid index or offset\n"); return MSCOMP_ARG_ERROR; }
+	const size_t len = MIN(*out_len, index[index_len-1].out_offset - out_offset);
+	if (len == 0) { *out_len = 0; return MSCOMP_OK; }
+
+	// The chunks are decompressed into buf which has room for the chunks with the range, the
+	// chunks before them that may be needed, and the window before those, each chunk has its own
+	// deferred copies (in reverse order)
+	const size_t first = xpress_huff_find_chunk(index, index_len, out_offset), last = xpress_huff_find_chunk(index, index_len, out_offset + len - 1);
+	const size_t first_back = first > RANGE_MAX_CHUNKS_BACK ? first - RANGE_MAX_CHUNKS_BACK : 0, max_chunks = last - first_back + 1;
+	const size_t buf_offset = index[first_back].out_offset, window = MIN(WINDOW_SIZE, buf_offset);
+	const bytes buf = (bytes)malloc(window + index[last+1].out_offset - buf_offset), origin = buf + window - buf_offset; // origin is where the entire output would start
+	DeferredCopies* deferred = (DeferredCopies*)malloc(max_chunks * sizeof(DeferredCopies));
+	if (UNLIKELY(buf == NULL || deferred == NULL)) { free(buf); free(deferred); return MSCOMP_MEM_ERROR; }
+	Decoder decoder;
+	MSCompStatus status = MSCOMP_OK;
+	size_t i = last + 1, n = 0; // i is the first chunk decompressed
+	NeededRanges needed(origin + out_offset);
+	if (UNLIKELY(!needed.Add(origin + out_offset, origin + out_offset + len))) { status = MSCOMP_MEM_ERROR; }
+
+	// Go back through the chunks until all of the data needed is available
+	while (status == MSCOMP_OK && i > first_back && (i > first || needed.Min() < origin + index[i].out_offset))
+	{
+		// When more than the second half of the chunk before is needed the matches reach far back
+		// (typical of binary data) and going further back rarely ends before the cap, so the window
+		// is decompressed from the start right away instead
+		if (i <= first && needed.Min() < origin + (index[i-1].out_offset + index[i].out_offset) / 2) { break; }
+		--i;
+		status = xpress_huff_decompress_indexed_chunk<true>(in, in_len, origin, index, index_len, i, &decoder, new (deferred + n) DeferredCopies(origin + index[i].out_offset));
+		++n;
+		if (status == MSCOMP_OK && UNLIKELY(!deferred[n-1].MarkNeeded(&needed))) { status = MSCOMP_MEM_ERROR; }
+	}
+
+	// Too much data before the range is needed (common for binary data) so the chunks before the
+	// ones already decompressed are decompressed from the start to get the window before them, the
+	// chunks already decompressed are kept (never goes before the first chunk since offsets are
+	// checked against the start of the output)
+	if (status == MSCOMP_OK && needed.Min() < origin + index[i].out_offset)
+	{
+		status = xpress_huff_decompress_window(in, in_len, index, index_len, i, origin);
+	}
+
+	// Do the deferred copies that are needed, starting with the earliest chunk
+	for (size_t k = n; k-- > 0; )
+	{
+		if (status == MSCOMP_OK)
+		{
+			if (UNLIKELY(deferred[k].HadMemError())) { status = MSCOMP_MEM_ERROR; }
+			else { deferred[k].FinishNeeded(); }
+		}
+		deferred[k].~DeferredCopies();
+	}
+	if (status == MSCOMP_OK) { memcpy(out, origin + out_offset, len); *out_len = len; }
+	free(deferred);
+	free(buf);
+	return status;
+}
+
+////////////////////////////// Independent Chunks //////////////////////////////////////////////////
+// Each chunk is complete compressed data on its own or is stored as-is when its size is its length
+// (see xpress_huff_compress_chunked), so each worker simply decompresses a contiguous range of them.
+typedef struct
+{
+	const_bytes in; // the first chunk of the range
+	bytes out;
+	size_t out_len, chunk_size;
+	const uint32_t* sizes;
+	size_t first, last; // the range of chunks
+	MSCompStatus status;
+} xh_decompress_chunked_job;
+
+static void xh_decompress_chunked_run(void* _job)
+{
+	xh_decompress_chunked_job* job = (xh_decompress_chunked_job*)_job;
+	Decoder* decoder = (Decoder*)malloc(sizeof(Decoder)); // allocated from the heap since threads may have small stacks
+	if (UNLIKELY(decoder == NULL)) { job->status = MSCOMP_MEM_ERROR; return; }
+	new (decoder) Decoder();
+	job->status = MSCOMP_OK;
+	const_bytes in = job->in;
+	for (size_t i = job->first; i < job->last && job->status == MSCOMP_OK; ++i)
+	{
+		const bytes out = job->out + i * job->chunk_size;
+		const size_t len = MIN(job->out_len - i * job->chunk_size, job->chunk_size), size = job->sizes[i];
+		if (size == len) { memcpy(out, in, len); }
+		else
+		{
+			size_t out_len = len;
+			job->status = xh_decompress<WriteOutput<false> >(in, size, out, &out_len, decoder);
+			if (job->status == MSCOMP_BUF_ERROR || (job->status == MSCOMP_OK && out_len != len))
+			{
+				PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Chunk is not the chunk size\n");
+				job->status = MSCOMP_DATA_ERROR;
+			}
+		}
+		in += size;
+	}
+	decoder->~Decoder();
+	free(decoder);
+}
+
+ENTRY_POINT MSCompStatus xpress_huff_decompress_chunked(const_bytes in, size_t in_len, bytes out, size_t* out_len, size_t chunk_size, const uint32_t* sizes, size_t n_chunks, unsigned nthreads)
+{
+	if (UNLIKELY(chunk_size < 0x1000 || chunk_size > CHUNK_SIZE || (chunk_size & (chunk_size - 1)) != 0 || n_chunks != (*out_len + chunk_size - 1) / chunk_size))
+	{
+		PRINT_ERROR("Xpress Huffman Decompression Error: Invalid chunk size or number of chunks\n");
+		return MSCOMP_ARG_ERROR;
+	}
+
+	// Check that the chunks fit in the input, a chunk is never larger than its decompressed length
+	size_t total = 0;
+	for (size_t i = 0; i < n_chunks; ++i)
+	{
+		if (UNLIKELY(sizes[i] == 0 || sizes[i] > MIN(*out_len - i * chunk_size, chunk_size))) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid chunk size\n"); return MSCOMP_DATA_ERROR; }
+		total += sizes[i];
+	}
+	if (UNLIKELY(total > in_len)) { PRINT_ERROR("Xpress Huffman Decompression Error: Invalid Data: Less input than the chunk sizes\n"); return MSCOMP_DATA_ERROR; }
+
+	if (nthreads == 0) { nthreads = Thread::ProcessorCount(); }
+	if (nthreads > n_chunks) { nthreads = (unsigned)n_chunks; }
+	if (nthreads == 0) { return MSCOMP_OK; }
+
+	xh_decompress_chunked_job* jobs = (xh_decompress_chunked_job*)malloc(nthreads * sizeof(xh_decompress_chunked_job));
+	Thread* threads = (Thread*)malloc(nthreads * sizeof(Thread));
+	if (UNLIKELY(jobs == NULL || threads == NULL)) { free(jobs); free(threads); return MSCOMP_MEM_ERROR; }
+
+	// Split the chunks evenly between the workers, the calling thread does the first range
+	size_t i = 0;
+	for (unsigned t = 0; t < nthreads; ++t)
+	{
+		jobs[t].in = in;
+		jobs[t].out = out;
+		jobs[t].out_len = *out_len;
+		jobs[t].chunk_size = chunk_size;
+		jobs[t].sizes = sizes;
+		jobs[t].first = i;
+		jobs[t].last = n_chunks * (t + 1) / nthreads;
+		for (; i < jobs[t].last; ++i) { in += sizes[i]; }
+	}
+	for (unsigned t = 1; t < nthreads; ++t) { threads[t].Start(&xh_decompress_chunked_run, jobs + t); }
+	xh_decompress_chunked_run(jobs);
+	for (unsigned t = 1; t < nthreads; ++t) { threads[t].Join(); }
+
+	MSCompStatus status = MSCOMP_OK;
+	for (unsigned t = 0; t < nthreads && status == MSCOMP_OK; ++t) { status = jobs[t].status; }
+	free(threads);
+	free(jobs);
+	return status;
+}
+
+MSCompStatus xpress_huff_inflate_init(mscomp_stream* stream)
+{
+	INIT_STREAM(stream, false, MSCOMP_XPRESS_HUFF);
+
+	mscomp_xpress_huff_decompress_state* state = (mscomp_xpress_huff_decompress_state*)malloc(sizeof(mscomp_xpress_huff_decompress_state));
+	if (UNLIKELY(state == NULL)) { SET_ERROR(stream, "XPRESS Huffman Decompression Error: Unable to allocate state memory"); return MSCOMP_MEM_ERROR; }
+
+	new (&state->decoder) Decoder();
+	state->in_chunk = false;
+	state->possible_end = true;
+	state->mask = 0;
+	state->bits = 0;
+	state->copy_len = 0;
+	state->in_avail = 0;
+	state->out_len = 0;
+	state->out_pos = 0;
+	state->out_avail = 0;
+
+	stream->state = (mscomp_internal_state*) state;
+	return MSCOMP_OK;
+}
+// Decompresses from in into the state's output buffer as much as possible, one symbol at a time
+// when near the end of the input or output. Returns MSCOMP_OK when more input is needed, in which
+// case in is left at the first byte needed and possible_end is set if the input could end there
+// (not considering the data after in_end). Returns MSCOMP_BUF_ERROR when the output buffer is full.
+static MSCompStatus xpress_huff_inflate_buf(mscomp_xpress_huff_decompress_state* state, const_bytes* _in, const const_bytes in_end)
+{
+	const_bytes in = *_in;
+	const const_bytes out_origin = state->out, out_end = state->out + OUT_BUF_SIZE;
+	bytes out = state->out + state->out_len;
+	uint32_t mask = state->mask, len, off;
+	uint_fast8_t bits = state->bits;
+	uint_fast16_t sym;
+	MSCompStatus status = MSCOMP_OK;
+
+	state->possible_end = false;
+
+	// Finish a match from before
+	if (state->copy_len)
+	{
+		len = MIN(state->copy_len, (uint32_t)(out_end - out));
+		state->copy_len -= len;
+		for (const_bytes end = out + len; out < end; ++out) { *out = *(out-state->copy_off); }
+		if (state->copy_len) { status = MSCOMP_BUF_ERROR; goto DONE; }
+	}
+
+	for (;;)
+	{
+		if (!state->in_chunk)
+		{
+			// Read the Huffman code lengths and the start of the bitstream for the next chunk
+			if (in_end - in < MIN_DATA) { state->possible_end = in == in_end; goto DONE; }
+			if (UNLIKELY(!xpress_huff_read_code_lengths(in, &state->decoder))) { status = MSCOMP_DATA_ERROR; goto DONE; }
+			in += HALF_SYMBOLS;
+			mask = (GET_UINT16(in) << 16) | GET_UINT16(in+2);
+			bits = 32;
+			in += 4;
+			state->chunk_out = 0;
+			state->in_chunk = true;
+		}
+
+		// Fast decompression - minimal bounds checking
+		if (in_end - in > 13 && out_end - out > FAST_COPY_ROOM && state->chunk_out < CHUNK_SIZE - 1)
+		{
+			InputBitstream bstr(in, in_end, mask, bits);
+			bstr.Refill();
+			const const_bytes out_start = out, out_endx = out_end - FAST_COPY_ROOM;
+			status = xpress_huff_decompress_fast<InputBitstream, WriteOutput<false> >(&bstr, in_end - 13, &out, MIN(out + (CHUNK_SIZE - 1 - state->chunk_out), out_endx), out_endx, out_origin, &state->decoder, &len, &off, NULL);
+			if (UNLIKELY(status != MSCOMP_OK)) { goto DONE; }
+			in = bstr.RawStream(); mask = bstr.Mask(); bits = bstr.AvailableBits();
+			state->chunk_out += out - out_start + len;
+			if (len)
+			{
+				// Finish a match that was stopped near the end of the output
+				const uint32_t n = MIN(len, (uint32_t)(out_end - out));
+				for (const_bytes end = out + n; out < end; ++out) { *out = *(out-off); }
+				if (n != len) { state->copy_len = len - n; state->copy_off = off; status = MSCOMP_BUF_ERROR; goto DONE; }
+			}
+		}
+
+		// Slow decompression - a single symbol with full bounds checking, only committed once all of
+		// its data is available (the bitstream is refilled lazily when the data was not available)
+		InputBitstream bstr(in, in_end, mask, bits);
+		bstr.Refill();
+		in = bstr.RawStream(); mask = bstr.Mask(); bits = bstr.AvailableBits();
+		if (state->chunk_out >= CHUNK_SIZE)
+		{
+			if (bstr.AvailableBits() < 16 && bstr.RemainingRawBytes() < 2)
+			{
+				// Unknown if the chunk is over until the refill is done
+				if (bstr.MaskIsZero()) { state->possible_end = bstr.RemainingRawBytes() == 0; goto DONE; }
+			}
+			else if (bstr.MaskIsZero())
+			{
+				// End of chunk (not stream)
+				in = bstr.RawStream();
+				state->in_chunk = false;
+				continue;
+			}
+		}
+		if (out == out_end) { status = MSCOMP_BUF_ERROR; goto DONE; }
+		sym = state->decoder.DecodeSymbol(&bstr);
+		if (UNLIKELY(sym == INVALID_SYMBOL))
+		{
+			if (bstr.AvailableBits() < HUFF_BITS_MAX && bstr.RemainingRawBytes() < 2) { goto DONE; }
+			PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Unable to read enough bits for symbol\n");
+			status = MSCOMP_DATA_ERROR; goto DONE;
+		}
+		if (sym == STREAM_END)
+		{
+			// Only the end of the stream if there is no more data after the refill, so wait for the refill
+			const bool pending = bstr.AvailableBits() < 16 && bstr.RemainingRawBytes() < 2;
+			if (pending || (bstr.RemainingRawBytes() == 0 && bstr.MaskIsZero())) { state->possible_end = bstr.RemainingRawBytes() == 0 && bstr.MaskIsZero(); goto DONE; }
+		}
+		if (sym < 0x100)
+		{
+			*out++ = (byte)sym;
+			++state->chunk_out;
+		}
+		else
+		{
+			if ((len = sym & 0xF) == 0xF)
+			{
+				if (bstr.AvailableBits() < 16 && bstr.RemainingRawBytes() < 2) { goto DONE; } // the refill must be done before reading raw bytes
+				if (bstr.RemainingRawBytes() < 1) { goto DONE; }
+				else if ((len = bstr.ReadRawByte()) == 0xFF)
+				{
+					if (bstr.RemainingRawBytes() < 2) { goto DONE; }
+					if (UNLIKELY((len = bstr.ReadRawUInt16()) == 0))
+					{
+						if (bstr.RemainingRawBytes() < 4) { goto DONE; }
+						len = bstr.ReadRawUInt32();
+					}
+					if (UNLIKELY(len < 0xF))	{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Invalid length specified\n"); status = MSCOMP_DATA_ERROR; goto DONE; }
+					len -= 0xF;
+				}
+				len += 0xF;
+			}
+			len += 3;
+			{
+				const uint_fast8_t off_bits = (uint_fast8_t)((sym>>4) & 0xF);
+				if (off_bits > bstr.AvailableBits()) { goto DONE; }
+				off = bstr.ReadBits(off_bits) + (1 << off_bits);
+			}
+			if (UNLIKELY(out - off < out_origin))	{ PRINT_ERROR("XPRESS Huffman Decompression Error: Invalid data: Illegal offset (%p-%u < %p)\n", out, off, out_origin); status = MSCOMP_DATA_ERROR; goto DONE; }
+			state->chunk_out += len;
+			const uint32_t n = MIN(len, (uint32_t)(out_end - out));
+			for (const_bytes end = out + n; out < end; ++out) { *out = *(out-off); }
+			if (n != len)
+			{
+				state->copy_len = len - n; state->copy_off = off;
+				in = bstr.RawStream(); mask = bstr.Mask(); bits = bstr.AvailableBits();
+				status = MSCOMP_BUF_ERROR; goto DONE;
+			}
+		}
+		in = bstr.RawStream(); mask = bstr.Mask(); bits = bstr.AvailableBits();
+	}
+
+DONE:
+	*_in = in;
+	state->mask = mask;
+	state->bits = bits;
+	state->out_len = out - state->out;
+	return status;
+}
+ENTRY_POINT MSCompStatus xpress_huff_inflate(mscomp_stream* stream)
+{
+	CHECK_STREAM_PLUS(stream, false, MSCOMP_XPRESS_HUFF, stream->state == NULL);
+
+	mscomp_xpress_huff_decompress_state* state = (mscomp_xpress_huff_decompress_state*) stream->state;
+
+	for (;;)
+	{
+		DUMP_OUT(state, stream);
+
+		// Keep only the window when the output buffer is getting full
+		if (state->out_len > OUT_BUF_SIZE - 0x1000)
+		{
+			memmove(state->out, state->out + state->out_len - WINDOW_SIZE, WINDOW_SIZE);
+			state->out_len = WINDOW_SIZE;
+		}
+		state->out_pos = state->out_len;
+
+		MSCompStatus status;
+		if (state->in_avail)
+		{
+			// Continue from the saved input along with as much new input as fits
+			const size_t copy = MIN(sizeof(state->in) - state->in_avail, stream->in_avail);
+			memcpy(state->in + state->in_avail, stream->in, copy);
+			const_bytes in = state->in;
+			const const_bytes in_end = in + state->in_avail + copy;
+			status = xpress_huff_inflate_buf(state, &in, in_end);
+			const size_t used = in - state->in;
+			if (used >= state->in_avail) { ADVANCE_IN(stream, used - state->in_avail); state->in_avail = 0; }
+			else
+			{
+				ADVANCE_IN(stream, copy);
+				memmove(state->in, in, state->in_avail = in_end - in);
+			}
+		}
+		else
+		{
+			const_bytes in = stream->in;
+			const const_bytes in_end = in + stream->in_avail;
+			status = xpress_huff_inflate_buf(state, &in, in_end);
+			const size_t used = in - stream->in;
+			ADVANCE_IN(stream, used);
+			if (status == MSCOMP_OK)
+			{
+				// Save the remaining input since it was not enough for the next step
+				ALWAYS(stream->in_avail < MIN_DATA);
+				memcpy(state->in, stream->in, state->in_avail = stream->in_avail);
+				ADVANCE_IN_TO_END(stream);
+			}
+		}
+		state->out_avail = state->out_len - state->out_pos;
+
+		if (UNLIKELY(status == MSCOMP_DATA_ERROR)) { SET_ERROR(stream, "XPRESS Huffman Decompression Error: Invalid data"); return status; }
+		if (status == MSCOMP_OK && !stream->in_avail)
+		{
+			// All input has been used
+			DUMP_OUT(state, stream);
+			return state->possible_end ? MSCOMP_POSSIBLE_STREAM_END : MSCOMP_OK;
+		}
+	}
+}
+MSCompStatus xpress_huff_inflate_end(mscomp_stream* stream)
+{
+	CHECK_STREAM_PLUS(stream, false, MSCOMP_XPRESS_HUFF, stream->state == NULL);
+
+	mscomp_xpress_huff_decompress_state* state = (mscomp_xpress_huff_decompress_state*) stream->state;
+
+	MSCompStatus status = MSCOMP_OK;
+	if (UNLIKELY(stream->in_avail || state->out_avail || state->copy_len || !state->possible_end)) { SET_ERROR(stream, "XPRESS Huffman Decompression Error: End prematurely called"); status = MSCOMP_DATA_ERROR; }
+
+	// Cleanup
+	state->decoder.~Decoder();
+	free(state);
+	stream->state = NULL;
+
+	return status;
+}
 
 #endif
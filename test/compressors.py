@@ -1,13 +1,14 @@
-from ctypes import c_size_t, c_int, c_void_p, c_ubyte, c_char_p, c_char, c_bool
+from ctypes import c_size_t, c_int, c_uint, c_uint32, c_uint64, c_void_p, c_ubyte, c_char_p, c_char, c_bool
 from ctypes import create_string_buffer, cast, POINTER, byref, cdll, sizeof, memmove, Structure
 from abc import ABCMeta, abstractmethod
 from warnings import warn
 from itertools import product
 import os
 import sys
+import struct
 
 __all__ = ["CompressionFormat", "CompressionEngine", "Compressor", "StreamableCompressor",
-           "NoCompression", "LZNT1", "Xpress", "XpressHuffman",
+           "NoCompression", "LZNT1", "Xpress", "XpressHuffman", "XpressHuffmanChunked",
            "Copy", "CopyFast"]
 
 # Determine the system we are running on
@@ -60,6 +61,7 @@ NoCompression = {}
 LZNT1 = {}
 Xpress = {}
 XpressHuffman = {}
+XpressHuffmanChunked = {}
 
 class Compressor(object):
     """The base class for all compressors"""
@@ -211,6 +213,12 @@ if dll is not None:
     def _prep(f, args):
         f.restype, f.errcheck, f.argtypes = c_int, _errchk, args
         return f
+    def _prep_status(f, args):
+        # like _prep but errors are returned instead of raised (f must be from dll['name'] since the
+        # functions from dll.name are shared with _prep)
+        f.restype, f.argtypes = c_int, args
+        return f
+    ARG_ERROR = -2 # MSCOMP_ARG_ERROR
     class OpenSrc(StreamableCompressor):
         class stream(Structure):
             _fields_ = [("format", c_int), ("compressing", c_bool),
@@ -257,12 +265,15 @@ if dll is not None:
             OpenSrc.decompress(self.format, _ptr(input), c_size_t(len_input), _ptr(output_buf), byref(decomp_len))
             return output_buf[:decomp_len.value]
 
+        def DeflateInit(self, s_ptr):
+            OpenSrc.deflate_init(self.format, s_ptr)
+
         def CompressStream(self, input, output, input_buf=None, output_buf=None):
             input_buf, output_buf = _get_buf(input_buf), _get_buf(output_buf)
             input_ptr, output_ptr, output_len = _ptr(input_buf), _ptr(output_buf), len(output_buf)
             s = OpenSrc.stream()
             s_ptr = byref(s)
-            OpenSrc.deflate_init(self.format, byref(s))
+            self.DeflateInit(s_ptr)
             try:
                 done = False
                 s.in_avail = input.readinto(input_buf)
@@ -312,6 +323,326 @@ if dll is not None:
     LZNT1['OpenSrc']         = OpenSrc.LZNT1
     Xpress['OpenSrc']        = OpenSrc.Xpress
     XpressHuffman['OpenSrc'] = OpenSrc.XpressHuffman
+
+    # Decompression into an output buffer that is padded by MSCOMP_DECOMPRESS_PADDING bytes
+    class OpenSrcPadded(OpenSrc):
+        decompress_padded = _prep(dll.ms_decompress_padded, [c_int, c_void_p, c_size_t, c_void_p, POINTER(c_size_t)])
+        PADDING = 512 # MSCOMP_DECOMPRESS_PADDING
+
+        def Decompress(self, input, output_buf=None):
+            # only the length of output_buf is used since the padding must be added to it
+            len_input = len(input)
+            if output_buf is None: out_len = len_input * 4
+            elif isinstance(output_buf, (int, long)): out_len = output_buf
+            else: out_len = len(output_buf)
+            output_buf = bytearray(out_len + OpenSrcPadded.PADDING)
+            decomp_len = c_size_t(out_len)
+            OpenSrcPadded.decompress_padded(self.format, _ptr(input), c_size_t(len_input), _ptr(output_buf), byref(decomp_len))
+            return output_buf[:decomp_len.value]
+
+    OpenSrc.Padded = CompressionFormat() # dummy class used so we can add attributes
+    OpenSrc.Padded.LZNT1         = OpenSrcPadded(CompressionFormat.LZNT1)
+    OpenSrc.Padded.Xpress        = OpenSrcPadded(CompressionFormat.Xpress)
+    OpenSrc.Padded.XpressHuffman = OpenSrcPadded(CompressionFormat.XpressHuffman)
+    LZNT1['OpenSrc-Padded']         = OpenSrc.Padded.LZNT1
+    Xpress['OpenSrc-Padded']        = OpenSrc.Padded.Xpress
+    XpressHuffman['OpenSrc-Padded'] = OpenSrc.Padded.XpressHuffman
+
+    # Xpress Huffman specific functions
+    class xpress_huff_chunk(Structure):
+        _fields_ = [("in_offset", c_size_t), ("out_offset", c_size_t)]
+
+    class OpenSrcXpressHuffman(OpenSrc):
+        """The Xpress Huffman compressor with the functions that use the chunk index of the data"""
+        index         = _prep(dll.xpress_huff_index, [c_void_p, c_size_t, POINTER(xpress_huff_chunk), POINTER(c_size_t)])
+        decompress_mt = _prep(dll.xpress_huff_decompress_mt, [c_void_p, c_size_t, c_void_p, POINTER(c_size_t), POINTER(xpress_huff_chunk), c_size_t, c_uint])
+        decompress_range = _prep(dll.xpress_huff_decompress_range, [c_void_p, c_size_t, POINTER(xpress_huff_chunk), c_size_t, c_size_t, c_void_p, POINTER(c_size_t)])
+        decompress_multi = _prep(dll.xpress_huff_decompress_multi, [POINTER(c_void_p), POINTER(c_size_t), POINTER(c_void_p), POINTER(c_size_t), POINTER(c_int), c_size_t])
+        max_index_len = dll.xpress_huff_max_index_len
+        max_index_len.restype = c_size_t
+        max_index_len.argtypes = [c_size_t]
+
+        def __init__(self, nthreads=0):
+            OpenSrc.__init__(self, CompressionFormat.XpressHuffman)
+            self.nthreads = c_uint(nthreads)
+
+        def Index(self, input):
+            """Creates the chunk index of the compressed data input, returning a ctypes array"""
+            len_input = len(input)
+            index_len = c_size_t(OpenSrcXpressHuffman.max_index_len(len_input))
+            index = (xpress_huff_chunk * index_len.value)()
+            OpenSrcXpressHuffman.index(_ptr(input), c_size_t(len_input), index, byref(index_len))
+            return (xpress_huff_chunk * index_len.value).from_buffer(index)
+
+        def Decompress(self, input, output_buf=None):
+            len_input, index = len(input), self.Index(input)
+            output_buf = _get_buf(output_buf, len_input * 4)
+            decomp_len = c_size_t(len(output_buf))
+            OpenSrcXpressHuffman.decompress_mt(_ptr(input), c_size_t(len_input), _ptr(output_buf), byref(decomp_len), index, c_size_t(len(index)), self.nthreads)
+            return output_buf[:decomp_len.value]
+
+        def DecompressRange(self, input, index, out_offset, out_len):
+            """
+            Decompress and return out_len bytes starting at out_offset in the decompressed data
+            using its chunk index, which are fewer if the range goes past the end of the data.
+            """
+            output_buf = bytearray(out_len)
+            decomp_len = c_size_t(out_len)
+            OpenSrcXpressHuffman.decompress_range(_ptr(input), c_size_t(len(input)), index, c_size_t(len(index)), c_size_t(out_offset), _ptr(output_buf), byref(decomp_len))
+            return output_buf[:decomp_len.value]
+
+        def DecompressMulti(self, inputs, output_lens):
+            """
+            Decompress and return each of the inputs, which are decompressed together. The output
+            buffers have the lengths given in output_lens.
+            """
+            n = len(inputs)
+            output_bufs = [bytearray(l) for l in output_lens]
+            in_ptrs  = (c_void_p * n)(*[_ptr(input) for input in inputs])
+            in_lens  = (c_size_t * n)(*[len(input) for input in inputs])
+            out_ptrs = (c_void_p * n)(*[_ptr(buf) for buf in output_bufs])
+            out_lens = (c_size_t * n)(*output_lens)
+            OpenSrcXpressHuffman.decompress_multi(in_ptrs, in_lens, out_ptrs, out_lens, (c_int * n)(), c_size_t(n))
+            return [buf[:l] for buf, l in zip(output_bufs, out_lens)]
+
+    class OpenSrcXpressHuffmanRange(OpenSrcXpressHuffman):
+        """Decompresses one range of range_len bytes at a time instead of everything at once"""
+        def __init__(self, range_len):
+            OpenSrcXpressHuffman.__init__(self)
+            self.range_len = range_len
+
+        def Decompress(self, input, output_buf=None):
+            index = self.Index(input)
+            out_end = index[len(index)-1].out_offset
+            return bytearray().join(self.DecompressRange(input, index, off, self.range_len) for off in xrange(0, out_end, self.range_len))
+
+    OpenSrc.XpressHuffmanMT = OpenSrcXpressHuffman()
+    OpenSrc.XpressHuffmanRange = OpenSrcXpressHuffmanRange(100*1024+1)
+    XpressHuffman['OpenSrc-MT'] = OpenSrc.XpressHuffmanMT
+    XpressHuffman['OpenSrc-Range'] = OpenSrc.XpressHuffmanRange
+
+    # The other Xpress Huffman compression functions, their output is decompressed normally
+    class OpenSrcXpressHuffmanCompressor(Compressor):
+        """Compresses with a function that takes the same arguments as xpress_huff_compress"""
+        def __init__(self, compress):
+            self.compress = _prep(compress, [c_void_p, c_size_t, c_void_p, POINTER(c_size_t)])
+
+        def Compress(self, input, output_buf=None):
+            len_input = len(input)
+            output_buf = _get_buf(output_buf, max(int(len_input * 1.5), len_input + 1024))
+            comp_len = c_size_t(len(output_buf))
+            self.compress(_ptr(input), c_size_t(len_input), _ptr(output_buf), byref(comp_len))
+            return output_buf[:comp_len.value]
+
+        def Decompress(self, input, output_buf=None):
+            return OpenSrc.XpressHuffman.Decompress(input, output_buf)
+
+    OpenSrc.XpressHuffmanOptimal = OpenSrcXpressHuffmanCompressor(dll.xpress_huff_compress_optimal)
+    XpressHuffman['OpenSrc-Optimal'] = OpenSrc.XpressHuffmanOptimal
+    OpenSrc.XpressHuffmanFast = OpenSrcXpressHuffmanCompressor(dll.xpress_huff_compress_fast)
+    XpressHuffman['OpenSrc-Fast'] = OpenSrc.XpressHuffmanFast
+
+    class OpenSrcXpressHuffmanTrained(OpenSrcXpressHuffmanCompressor):
+        """
+        Compresses with xpress_huff_compress_trained using the built-in code lengths or, if msg_len is
+        given, code lengths from xpress_huff_train using the input as the sample
+        """
+        compress_trained = _prep(dll.xpress_huff_compress_trained, [c_void_p, c_size_t, c_void_p, POINTER(c_size_t), c_void_p])
+        compress_trained_status = _prep_status(dll['xpress_huff_compress_trained'], [c_void_p, c_size_t, c_void_p, POINTER(c_size_t), c_void_p])
+        train = _prep(dll.xpress_huff_train, [c_void_p, c_size_t, c_size_t, c_void_p])
+
+        def __init__(self, msg_len=None):
+            self.msg_len = msg_len
+
+        def Compress(self, input, output_buf=None):
+            len_input = len(input)
+            lens = None
+            if self.msg_len is not None:
+                lens = bytearray(256)
+                OpenSrcXpressHuffmanTrained.train(_ptr(input), c_size_t(len_input), c_size_t(self.msg_len), _ptr(lens))
+            output_buf = _get_buf(output_buf, max(int(len_input * 1.5), len_input + 1024))
+            comp_len = c_size_t(len(output_buf))
+            OpenSrcXpressHuffmanTrained.compress_trained(_ptr(input), c_size_t(len_input), _ptr(output_buf), byref(comp_len), None if lens is None else _ptr(lens))
+            return output_buf[:comp_len.value]
+
+        def CheckArgs(self):
+            """Raises an exception unless code lengths that are over-subscribed are rejected"""
+            input, output_buf, lens = bytearray('abc' * 100), bytearray(2048), bytearray('\x11' * 256) # 512 codes of length 1
+            comp_len = c_size_t(len(output_buf))
+            status = OpenSrcXpressHuffmanTrained.compress_trained_status(_ptr(input), c_size_t(len(input)), _ptr(output_buf), byref(comp_len), _ptr(lens))
+            if status != ARG_ERROR: raise Exception('xpress_huff_compress_trained returned %d for invalid code lengths' % status)
+
+    OpenSrc.XpressHuffmanTrained = OpenSrcXpressHuffmanTrained()
+    OpenSrc.XpressHuffmanTrainedSample = OpenSrcXpressHuffmanTrained(4096)
+    XpressHuffman['OpenSrc-Trained'] = OpenSrc.XpressHuffmanTrained
+    XpressHuffman['OpenSrc-Trained-Sample'] = OpenSrc.XpressHuffmanTrainedSample
+
+    # Compression with a chunk cache
+    class OpenSrcCached(Compressor):
+        """
+        Compresses the input twice with the same cache, the second time every chunk must be found in
+        the cache (besides Xpress Huffman chunks that a match continues past, which are never added).
+        If windows is True the cache is instead filled from a copy of the input with every other 64 KiB
+        changed so that the same Xpress Huffman chunks come after different data, which must not be
+        taken from the cache.
+        """
+        cache_create = dll.ms_chunk_cache_create
+        cache_create.restype, cache_create.argtypes = c_void_p, [c_size_t]
+        cache_free = dll.ms_chunk_cache_free
+        cache_free.restype, cache_free.argtypes = None, [c_void_p]
+        cache_stats = dll.ms_chunk_cache_stats
+        cache_stats.restype, cache_stats.argtypes = None, [c_void_p, POINTER(c_uint64), POINTER(c_uint64)]
+        compress_cached = _prep(dll.ms_compress_cached, [c_int, c_void_p, c_size_t, c_void_p, POINTER(c_size_t), c_void_p])
+
+        def __init__(self, format, windows=False):
+            self.format, self.windows, self.decompressor = c_int(format), windows, OpenSrc(format)
+
+        def _compress(self, input, cache):
+            len_input = len(input)
+            output_buf = bytearray(max(int(len_input * 1.5), len_input + 1024))
+            comp_len = c_size_t(len(output_buf))
+            OpenSrcCached.compress_cached(self.format, _ptr(input), c_size_t(len_input), _ptr(output_buf), byref(comp_len), cache)
+            return output_buf[:comp_len.value]
+
+        def _misses(self, cache):
+            hits, misses = c_uint64(0), c_uint64(0)
+            OpenSrcCached.cache_stats(cache, byref(hits), byref(misses))
+            return misses.value
+
+        def _spanned(self, compressed):
+            # the number of Xpress Huffman chunks that a match continues past (more than 64 KiB long)
+            if self.format.value != CompressionFormat.XpressHuffman: return 0
+            index = OpenSrc.XpressHuffmanMT.Index(compressed)
+            return sum(1 for i in xrange(len(index)-1) if index[i+1].out_offset - index[i].out_offset > 0x10000)
+
+        def Compress(self, input, output_buf=None):
+            cache = OpenSrcCached.cache_create(c_size_t(max(4 * len(input), 1 << 20)))
+            if not cache: raise MemoryError()
+            try:
+                if self.windows:
+                    changed = bytearray(input)
+                    for i in xrange(0x10000, len(changed), 0x20000):
+                        changed[i:i+0x10000] = bytearray(x ^ 0xFF for x in changed[i:i+0x10000])
+                    self._compress(changed, cache)
+                    return self._compress(input, cache)
+                first = self._compress(input, cache)
+                misses = self._misses(cache)
+                second = self._compress(input, cache)
+                misses = self._misses(cache) - misses
+                if misses != self._spanned(first): raise Exception('%d chunks were not found in the cache the second time' % misses)
+                if second != first: raise Exception('the chunks from the cache are different')
+                return second
+            finally:
+                OpenSrcCached.cache_free(cache)
+
+        def Decompress(self, input, output_buf=None):
+            return self.decompressor.Decompress(input, output_buf)
+
+    OpenSrc.Cached = CompressionFormat() # dummy class used so we can add attributes
+    OpenSrc.Cached.LZNT1         = OpenSrcCached(CompressionFormat.LZNT1)
+    OpenSrc.Cached.XpressHuffman = OpenSrcCached(CompressionFormat.XpressHuffman)
+    OpenSrc.CachedWindows = CompressionFormat()
+    OpenSrc.CachedWindows.LZNT1         = OpenSrcCached(CompressionFormat.LZNT1, True)
+    OpenSrc.CachedWindows.XpressHuffman = OpenSrcCached(CompressionFormat.XpressHuffman, True)
+    LZNT1['OpenSrc-Cached']                 = OpenSrc.Cached.LZNT1
+    LZNT1['OpenSrc-Cached-Windows']         = OpenSrc.CachedWindows.LZNT1
+    XpressHuffman['OpenSrc-Cached']         = OpenSrc.Cached.XpressHuffman
+    XpressHuffman['OpenSrc-Cached-Windows'] = OpenSrc.CachedWindows.XpressHuffman
+
+    # Compression levels, Xpress can only be stream-compressed in debug builds so its levels are only
+    # used all at once
+    class OpenSrcLevel(OpenSrc):
+        compress_level = _prep(dll.ms_compress_level, [c_int, c_uint, c_void_p, c_size_t, c_void_p, POINTER(c_size_t)])
+        compress_level_status = _prep_status(dll['ms_compress_level'], [c_int, c_uint, c_void_p, c_size_t, c_void_p, POINTER(c_size_t)])
+        deflate_init_level = _prep(dll.ms_deflate_init_level, [c_int, c_uint, POINTER(OpenSrc.stream)])
+        deflate_init_level_status = _prep_status(dll['ms_deflate_init_level'], [c_int, c_uint, POINTER(OpenSrc.stream)])
+        DEFAULT, MAX = 0, 8 # MSCOMP_LEVEL_DEFAULT and MSCOMP_LEVEL_MAX
+
+        def __init__(self, format, level):
+            OpenSrc.__init__(self, format)
+            self.level = c_uint(level)
+
+        def Compress(self, input, output_buf=None):
+            len_input = len(input)
+            output_buf = _get_buf(output_buf, max(int(len_input * 1.5), len_input + 1024))
+            comp_len = c_size_t(len(output_buf))
+            OpenSrcLevel.compress_level(self.format, self.level, _ptr(input), c_size_t(len_input), _ptr(output_buf), byref(comp_len))
+            return output_buf[:comp_len.value]
+
+        def DeflateInit(self, s_ptr):
+            OpenSrcLevel.deflate_init_level(self.format, self.level, s_ptr)
+
+        def CheckArgs(self):
+            """Raises an exception unless the level after MSCOMP_LEVEL_MAX is rejected"""
+            input, output_buf = bytearray('abc' * 100), bytearray(2048)
+            comp_len = c_size_t(len(output_buf))
+            status = OpenSrcLevel.compress_level_status(self.format, c_uint(OpenSrcLevel.MAX+1), _ptr(input), c_size_t(len(input)), _ptr(output_buf), byref(comp_len))
+            if status != ARG_ERROR: raise Exception('ms_compress_level returned %d for level %d' % (status, OpenSrcLevel.MAX+1))
+            s = OpenSrc.stream()
+            status = OpenSrcLevel.deflate_init_level_status(self.format, c_uint(OpenSrcLevel.MAX+1), byref(s))
+            if status == 0: OpenSrc.deflate_end(byref(s))
+            if status != ARG_ERROR: raise Exception('ms_deflate_init_level returned %d for level %d' % (status, OpenSrcLevel.MAX+1))
+
+    class OpenSrcLevelAllAtOnce(Compressor):
+        """Compresses with ms_compress_level but does not support streaming"""
+        def __init__(self, format, level): self.compressor = OpenSrcLevel(format, level)
+        def Compress(self, input, output_buf=None): return self.compressor.Compress(input, output_buf)
+        def Decompress(self, input, output_buf=None): return self.compressor.Decompress(input, output_buf)
+        def CheckArgs(self): self.compressor.CheckArgs()
+
+    for level in xrange(OpenSrcLevel.DEFAULT, OpenSrcLevel.MAX+1):
+        name = 'OpenSrc-Level%s' % (level or 'Default')
+        Xpress[name] = OpenSrcLevelAllAtOnce(CompressionFormat.Xpress, level)
+        XpressHuffman[name] = OpenSrcLevel(CompressionFormat.XpressHuffman, level)
+
+    # Xpress Huffman compressed in independent chunks
+    # The compressed sizes of the chunks are not part of the compressed data so the output of these
+    # starts with the chunk size (4 bytes), the decompressed length (8 bytes), and the compressed size
+    # of each chunk (4 bytes each)
+    class OpenSrcXpressHuffmanChunked(Compressor):
+        compress   = _prep(dll.xpress_huff_compress_chunked,   [c_void_p, c_size_t, c_void_p, POINTER(c_size_t), c_size_t, POINTER(c_uint32), POINTER(c_size_t), c_uint])
+        decompress = _prep(dll.xpress_huff_decompress_chunked, [c_void_p, c_size_t, c_void_p, POINTER(c_size_t), c_size_t, POINTER(c_uint32), c_size_t, c_uint])
+        header = struct.Struct('<IQ')
+
+        def __init__(self, chunk_size, nthreads=0, separately=False):
+            """If separately is True each chunk is decompressed on its own with xpress_huff_decompress"""
+            self.chunk_size, self.nthreads, self.separately = chunk_size, c_uint(nthreads), separately
+
+        def Compress(self, input, output_buf=None):
+            len_input = len(input)
+            n_chunks = c_size_t((len_input + self.chunk_size - 1) // self.chunk_size)
+            sizes = (c_uint32 * n_chunks.value)()
+            output_buf = _get_buf(output_buf, len_input) # a chunk that does not get smaller is stored as-is
+            comp_len = c_size_t(len(output_buf))
+            OpenSrcXpressHuffmanChunked.compress(_ptr(input), c_size_t(len_input), _ptr(output_buf), byref(comp_len), c_size_t(self.chunk_size), sizes, byref(n_chunks), self.nthreads)
+            return OpenSrcXpressHuffmanChunked.header.pack(self.chunk_size, len_input) + bytearray(sizes) + output_buf[:comp_len.value]
+
+        def Decompress(self, input, output_buf=None):
+            input = bytearray(input)
+            chunk_size, decomp_len = OpenSrcXpressHuffmanChunked.header.unpack_from(buffer(input))
+            n_chunks = (decomp_len + chunk_size - 1) // chunk_size
+            sizes = (c_uint32 * n_chunks).from_buffer(input, OpenSrcXpressHuffmanChunked.header.size)
+            off = OpenSrcXpressHuffmanChunked.header.size + sizeof(sizes)
+            if self.separately:
+                output = bytearray()
+                for i, size in enumerate(sizes):
+                    chunk_len = min(chunk_size, decomp_len - i * chunk_size)
+                    chunk = input[off:off+size]
+                    output += chunk if size == chunk_len else OpenSrc.XpressHuffman.Decompress(chunk, chunk_len)
+                    off += size
+                return output
+            output_buf = _get_buf(output_buf, decomp_len)
+            if len(output_buf) < decomp_len: output_buf = bytearray(decomp_len)
+            out_len = c_size_t(decomp_len) # must be the exact decompressed length
+            OpenSrcXpressHuffmanChunked.decompress(_ptr(input, off), c_size_t(len(input) - off), _ptr(output_buf), byref(out_len), c_size_t(chunk_size), sizes, c_size_t(n_chunks), self.nthreads)
+            return output_buf[:out_len.value]
+
+    OpenSrc.XpressHuffmanChunked = OpenSrcXpressHuffmanChunked(0x10000)
+    OpenSrc.XpressHuffmanChunked4K = OpenSrcXpressHuffmanChunked(0x1000, 1)
+    OpenSrc.XpressHuffmanChunkedSeparately = OpenSrcXpressHuffmanChunked(0x8000, separately=True)
+    XpressHuffmanChunked['OpenSrc'] = OpenSrc.XpressHuffmanChunked
+    XpressHuffmanChunked['OpenSrc-4K'] = OpenSrc.XpressHuffmanChunked4K
+    XpressHuffmanChunked['OpenSrc-Separately'] = OpenSrc.XpressHuffmanChunkedSeparately
 else:
     warn('OpenSrc compression library is unavailable because the library couldn\'t be found/loaded')
 
@@ -3,10 +3,14 @@
 test_accuracy.py format directory
 
 This tests the accuracy of the various compressors against each other. You select a single format
-(one of None, LZNT1, Xpress, and Xpress-Huffman) and a directory of files and this will read each
-file, send it to each possible compressor and decompressor combination to make sure we get the right
-data back out in all cases. This checks both one-shot and streaming (if the compressor/decompressor
-supports it). No news is good news! Only errors and minimal status messages are reported.
+(one of None, LZNT1, Xpress, Xpress-Huffman, and Xpress-Huffman-Chunked) and a directory of files
+and this will read each file, send it to each possible compressor and decompressor combination to
+make sure we get the right data back out in all cases. This checks both one-shot and streaming (if
+the compressor/decompressor supports it) and the chunk index of the compressed data and reading
+ranges of it (if the decompressor supports them). The files of each directory are also decompressed
+together by the decompressors that can decompress several at once. The compressors that can check
+that they reject invalid arguments do so first. No news is good news! Only errors and minimal status
+messages are reported.
 """
 
 import sys
@@ -21,6 +25,7 @@ compressors = {
     'lznt1': LZNT1,
     'xpress': Xpress,
     'xpress-huffman': XpressHuffman,
+    'xpress-huffman-chunked': XpressHuffmanChunked,
     }
 
 if len(sys.argv) != 3:
@@ -59,16 +64,61 @@ def decompress_stream(fullpath, data, compressed, name1, compressor, name2):
         if len(ex.args) <= 0: raise
         print >> sys.stderr, 'Error: %s failed to %s stream-decompress %s compressed data (%s)' % (fullpath, name2, name1, ex.args[0])
 
+def check_index(fullpath, data, compressed, name1, compressor, name2):
+    try:
+        index = compressor.Index(compressed)
+        end = index[len(index)-1]
+        if end.in_offset != len(compressed) or end.out_offset != len(data):
+            print >> sys.stderr, 'Error: %s failed to %s index %s compressed data (ends %d, %d != %d, %d)' % (fullpath, name2, name1, end.in_offset, end.out_offset, len(compressed), len(data))
+    except Exception as ex:
+        if len(ex.args) <= 0: raise
+        print >> sys.stderr, 'Error: %s failed to %s index %s compressed data (%s)' % (fullpath, name2, name1, ex.args[0])
+
+def check_ranges(fullpath, data, compressed, name1, compressor, name2):
+    # the middle of the data and a range that goes past the end of it
+    try:
+        index = compressor.Index(compressed)
+        for off, n in ((len(data) // 3, len(data) // 3 + 1), (max(len(data) - 1000, 0), 2000)):
+            decomp = compressor.DecompressRange(compressed, index, off, n)
+            if decomp != data[off:off+n]:
+                print >> sys.stderr, 'Error: %s failed to %s decompress range %d+%d of %s compressed data' % (fullpath, name2, off, n, name1)
+    except Exception as ex:
+        if len(ex.args) <= 0: raise
+        print >> sys.stderr, 'Error: %s failed to %s decompress ranges of %s compressed data (%s)' % (fullpath, name2, name1, ex.args[0])
+
+def decompress_multi(root, datas, compressed, name1, compressor, name2):
+    try:
+        decomps = compressor.DecompressMulti(compressed, [len(data) for fullpath, data in datas])
+        for (fullpath, data), decomp in zip(datas, decomps):
+            if data != decomp:
+                print >> sys.stderr, 'Error: %s failed to %s decompress %s compressed data together with the other files' % (fullpath, name2, name1)
+    except Exception as ex:
+        if len(ex.args) <= 0: raise
+        print >> sys.stderr, 'Error: %s failed to %s decompress %s compressed files together (%s)' % (root, name2, name1, ex.args[0])
+
+def check_args(name, compressor):
+    try:
+        compressor.CheckArgs()
+    except Exception as ex:
+        if len(ex.args) <= 0: raise
+        print >> sys.stderr, 'Error: %s failed to reject invalid arguments (%s)' % (name, ex.args[0])
+
+for name, compressor in compressors.iteritems():
+    if hasattr(compressor, 'CheckArgs'):
+        check_args(name, compressor)
+
 start_time = clock()
 for root, dirs, files in os.walk(path):
     print '%8.2f Folder: %s' % (clock() - start_time, root)
     sys.stderr.flush()
+    datas = []
     for name in files:
         fullpath = os.path.join(root, name)
         try:
             with io.open(fullpath, 'rb') as f: data = f.read()
         except: continue
         if len(data) == 0: continue
+        datas.append((fullpath, data))
 
         for name1, compressor1 in compressors.iteritems():
             try:
@@ -77,6 +127,10 @@ for root, dirs, files in os.walk(path):
                     decompress(fullpath, data, compressed, name1, compressor2, name2)
                     if isinstance(compressor2, StreamableCompressor):
                         decompress_stream(fullpath, data, compressed, name1, compressor2, name2)
+                    if hasattr(compressor2, 'Index'):
+                        check_index(fullpath, data, compressed, name1, compressor2, name2)
+                    if hasattr(compressor2, 'DecompressRange'):
+                        check_ranges(fullpath, data, compressed, name1, compressor2, name2)
             except Exception as ex:
                 if len(ex.args) <= 0: raise
                 print >> sys.stderr, 'Error: %s failed to %s compress (%s)' % (fullpath, name1, ex.args[0])
@@ -90,8 +144,22 @@ for root, dirs, files in os.walk(path):
                         decompress(fullpath, data, compressed, name1, compressor2, name2)
                         if isinstance(compressor2, StreamableCompressor):
                             decompress_stream(fullpath, data, compressed, name1, compressor2, name2)
+                        if hasattr(compressor2, 'Index'):
+                            check_index(fullpath, data, compressed, name1, compressor2, name2)
+                        if hasattr(compressor2, 'DecompressRange'):
+                            check_ranges(fullpath, data, compressed, name1, compressor2, name2)
                 except Exception as ex:
                     if len(ex.args) <= 0: raise
                     print >> sys.stderr, 'Error: %s failed to %s stream-compress (%s)' % (fullpath, name1, ex.args[0])
+
+    # all of the files in the folder are decompressed at once by decompressors that support it
+    if len(datas) == 0: continue
+    for name1, compressor1 in compressors.iteritems():
+        try:
+            compressed = [compressor1.Compress(data) for fullpath, data in datas]
+        except Exception: continue # already reported above
+        for name2, compressor2 in compressors.iteritems():
+            if hasattr(compressor2, 'DecompressMulti'):
+                decompress_multi(root, datas, compressed, name1, compressor2, name2)
                     
 print '%8.2f Done' % (clock() - start_time)